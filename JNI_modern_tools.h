@@ -9,6 +9,42 @@
 #include <iostream>
 #include <type_traits>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <list>
+#include <deque>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <iterator>
+#include <cstddef>
+#include <cstdint>
+#include <bitset>
+#include <chrono>
+#include <functional>
+#include <exception>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JNI_MODERN_TOOLS_SSE2
+#endif
+#if defined(__linux__)
+#include <climits>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define JNI_MODERN_TOOLS_FUTEX
+#endif
+#if defined(__has_include)
+#if __has_include(<span>) && __cplusplus > 201703L
+#include <span>
+#endif
+#endif
 
 /*
 ===================
@@ -84,6 +120,17 @@ template<> struct jArrayType_to_jType<jshortArray> { typedef jshort type; };
 template<> struct jArrayType_to_jType<jcharArray> { typedef jchar type; };
 template<> struct jArrayType_to_jType<jlongArray> { typedef jlong type; };
 template<> struct jArrayType_to_jType<jbyteArray> { typedef jbyte type; };
+template<> struct jArrayType_to_jType<jbooleanArray> { typedef jboolean type; };
+
+template<class T> struct jType_to_jArrayType;
+template<> struct jType_to_jArrayType<jint> { typedef jintArray type; };
+template<> struct jType_to_jArrayType<jfloat> { typedef jfloatArray type; };
+template<> struct jType_to_jArrayType<jdouble> { typedef jdoubleArray type; };
+template<> struct jType_to_jArrayType<jshort> { typedef jshortArray type; };
+template<> struct jType_to_jArrayType<jchar> { typedef jcharArray type; };
+template<> struct jType_to_jArrayType<jlong> { typedef jlongArray type; };
+template<> struct jType_to_jArrayType<jbyte> { typedef jbyteArray type; };
+template<> struct jType_to_jArrayType<jboolean> { typedef jbooleanArray type; };
 
 /*
 Note: can use the above as follows:
@@ -121,6 +168,7 @@ template<> std::string get_signature_jtype<jshortArray>(std::string s) { return
 template<> std::string get_signature_jtype<jcharArray>(std::string s) { return "[C"; };
 template<> std::string get_signature_jtype<jlongArray>(std::string s) { return "[J"; };
 template<> std::string get_signature_jtype<jbyteArray>(std::string s) { return "[B"; };
+template<> std::string get_signature_jtype<jbooleanArray>(std::string s) { return "[Z"; };
 template<> std::string get_signature_jtype<void>(std::string s) { return "V"; };
 template<> std::string get_signature_jtype<jobject>(std::string s) { return s; };
 
@@ -142,6 +190,7 @@ template<> struct GetFieldFunctor<jshortArray> { jshortArray operator()(JNIEnv*
 template<> struct GetFieldFunctor<jcharArray> { jcharArray operator()(JNIEnv* env, jobject a, jfieldID b) { return (jcharArray)env->GetObjectField(a, b); } };
 template<> struct GetFieldFunctor<jlongArray> { jlongArray operator()(JNIEnv* env, jobject a, jfieldID b) { return (jlongArray)env->GetObjectField(a, b); } };
 template<> struct GetFieldFunctor<jbyteArray> { jbyteArray operator()(JNIEnv* env, jobject a, jfieldID b) { return (jbyteArray)env->GetObjectField(a, b); } };
+template<> struct GetFieldFunctor<jbooleanArray> { jbooleanArray operator()(JNIEnv* env, jobject a, jfieldID b) { return (jbooleanArray)env->GetObjectField(a, b); } };
 template<> struct GetFieldFunctor<jobject> { jobject operator()(JNIEnv* env, jobject a, jfieldID b) { return env->GetObjectField(a, b); } };
 
 template<class T> struct GetStaticFieldFunctor { T operator()(JNIEnv* env, jclass a, jfieldID b) { return 0; } };
@@ -161,6 +210,7 @@ template<> struct GetStaticFieldFunctor<jshortArray> { jshortArray operator()(JN
 template<> struct GetStaticFieldFunctor<jcharArray> { jcharArray operator()(JNIEnv* env, jclass a, jfieldID b) { return (jcharArray)env->GetStaticObjectField(a, b); } };
 template<> struct GetStaticFieldFunctor<jlongArray> { jlongArray operator()(JNIEnv* env, jclass a, jfieldID b) { return (jlongArray)env->GetStaticObjectField(a, b); } };
 template<> struct GetStaticFieldFunctor<jbyteArray> { jbyteArray operator()(JNIEnv* env, jclass a, jfieldID b) { return (jbyteArray)env->GetStaticObjectField(a, b); } };
+template<> struct GetStaticFieldFunctor<jbooleanArray> { jbooleanArray operator()(JNIEnv* env, jclass a, jfieldID b) { return (jbooleanArray)env->GetStaticObjectField(a, b); } };
 template<> struct GetStaticFieldFunctor<jobject> { jobject operator()(JNIEnv* env, jclass a, jfieldID b) { return env->GetStaticObjectField(a, b); } };
 
 template<class T> struct SetFieldFunctor { void operator()(JNIEnv* env, jobject a, jfieldID b, T c) {} };
@@ -180,6 +230,7 @@ template<> struct SetFieldFunctor<jshortArray> { void operator()(JNIEnv* env, jo
 template<> struct SetFieldFunctor<jcharArray> { void operator()(JNIEnv* env, jobject a, jfieldID b, jcharArray c) { env->SetObjectField(a, b, (jobject)c); } };
 template<> struct SetFieldFunctor<jlongArray> { void operator()(JNIEnv* env, jobject a, jfieldID b, jlongArray c) { env->SetObjectField(a, b, (jobject)c); } };
 template<> struct SetFieldFunctor<jbyteArray> { void operator()(JNIEnv* env, jobject a, jfieldID b, jbyteArray c) { env->SetObjectField(a, b, (jobject)c); } };
+template<> struct SetFieldFunctor<jbooleanArray> { void operator()(JNIEnv* env, jobject a, jfieldID b, jbooleanArray c) { env->SetObjectField(a, b, (jobject)c); } };
 template<> struct SetFieldFunctor<jobject> { void operator()(JNIEnv* env, jobject a, jfieldID b, jobject c) { env->SetObjectField(a, b, c); } };
 
 template<class T> struct SetStaticFieldFunctor { void operator()(JNIEnv* env, jclass a, jfieldID b, T c) {} };
@@ -199,6 +250,7 @@ template<> struct SetStaticFieldFunctor<jshortArray> { void operator()(JNIEnv* e
 template<> struct SetStaticFieldFunctor<jcharArray> { void operator()(JNIEnv* env, jclass a, jfieldID b, jcharArray c) { env->SetStaticObjectField(a, b, (jobject)c); } };
 template<> struct SetStaticFieldFunctor<jlongArray> { void operator()(JNIEnv* env, jclass a, jfieldID b, jlongArray c) { env->SetStaticObjectField(a, b, (jobject)c); } };
 template<> struct SetStaticFieldFunctor<jbyteArray> { void operator()(JNIEnv* env, jclass a, jfieldID b, jbyteArray c) { env->SetStaticObjectField(a, b, (jobject)c); } };
+template<> struct SetStaticFieldFunctor<jbooleanArray> { void operator()(JNIEnv* env, jclass a, jfieldID b, jbooleanArray c) { env->SetStaticObjectField(a, b, (jobject)c); } };
 template<> struct SetStaticFieldFunctor<jobject> { void operator()(JNIEnv* env, jclass a, jfieldID b, jobject c) { env->SetStaticObjectField(a, b, c); } };
 
 template<class T, class... Ts> struct callXMethodFunctor { void operator()(JNIEnv* env, jobject jobj, jmethodID methodID, Ts... args) {} };
@@ -218,6 +270,7 @@ template<class... Ts> struct callXMethodFunctor<jshortArray, Ts...> { jshortArra
 template<class... Ts> struct callXMethodFunctor<jcharArray, Ts...> { jcharArray operator()(JNIEnv* env, jobject jobj, jmethodID methodID, Ts... args) { return (jcharArray)env->CallObjectMethod(jobj, methodID, args...); } };
 template<class... Ts> struct callXMethodFunctor<jlongArray, Ts...> { jlongArray operator()(JNIEnv* env, jobject jobj, jmethodID methodID, Ts... args) { return (jlongArray)env->CallObjectMethod(jobj, methodID, args...); } };
 template<class... Ts> struct callXMethodFunctor<jbyteArray, Ts...> { jbyteArray operator()(JNIEnv* env, jobject jobj, jmethodID methodID, Ts... args) { return (jbyteArray)env->CallObjectMethod(jobj, methodID, args...); } };
+template<class... Ts> struct callXMethodFunctor<jbooleanArray, Ts...> { jbooleanArray operator()(JNIEnv* env, jobject jobj, jmethodID methodID, Ts... args) { return (jbooleanArray)env->CallObjectMethod(jobj, methodID, args...); } };
 template<class... Ts> struct callXMethodFunctor<void, Ts...> { void operator()(JNIEnv* env, jobject jobj, jmethodID methodID, Ts... args) { env->CallVoidMethod(jobj, methodID, args...); } };
 template<class... Ts> struct callXMethodFunctor<jobject, Ts...> { jobject operator()(JNIEnv* env, jobject jobj, jmethodID methodID, Ts... args) { return env->CallObjectMethod(jobj, methodID, args...); } };
 
@@ -238,10 +291,708 @@ template<class... Ts> struct callXStaticMethodFunctor<jshortArray, Ts...> { jsho
 template<class... Ts> struct callXStaticMethodFunctor<jcharArray, Ts...> { jcharArray operator()(JNIEnv* env, jclass jcls, jmethodID methodID, Ts... args) { return (jcharArray)env->CallStaticObjectMethod(jcls, methodID, args...); } };
 template<class... Ts> struct callXStaticMethodFunctor<jlongArray, Ts...> { jlongArray operator()(JNIEnv* env, jclass jcls, jmethodID methodID, Ts... args) { return (jlongArray)env->CallStaticObjectMethod(jcls, methodID, args...); } };
 template<class... Ts> struct callXStaticMethodFunctor<jbyteArray, Ts...> { jbyteArray operator()(JNIEnv* env, jclass jcls, jmethodID methodID, Ts... args) { return (jbyteArray)env->CallStaticObjectMethod(jcls, methodID, args...); } };
+template<class... Ts> struct callXStaticMethodFunctor<jbooleanArray, Ts...> { jbooleanArray operator()(JNIEnv* env, jclass jcls, jmethodID methodID, Ts... args) { return (jbooleanArray)env->CallStaticObjectMethod(jcls, methodID, args...); } };
 template<class... Ts> struct callXStaticMethodFunctor<void, Ts...> { void operator()(JNIEnv* env, jclass jcls, jmethodID methodID, Ts... args) { env->CallStaticVoidMethod(jcls, methodID, args...); } };
 template<class... Ts> struct callXStaticMethodFunctor<jobject, Ts...> { jobject operator()(JNIEnv* env, jclass jcls, jmethodID methodID, Ts... args) { return env->CallStaticObjectMethod(jcls, methodID, args...); } };
 
 
+// per array type JNI functions for primitive java arrays.
+// T_arr can be jdoubleArray, jfloatArray, jintArray, jshortArray, jcharArray, jlongArray, jbyteArray or jbooleanArray.
+template<class T_arr> struct jArrayOps {};
+template<> struct jArrayOps<jdoubleArray>
+{
+	static jdoubleArray New(JNIEnv* env, jsize n) { return env->NewDoubleArray(n); }
+	static jdouble* GetElements(JNIEnv* env, jdoubleArray arr, jboolean* isCopy) { return env->GetDoubleArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jdoubleArray arr, jdouble* ptr, jint mode) { env->ReleaseDoubleArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jdoubleArray arr, jsize start, jsize len, jdouble* buf) { env->GetDoubleArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jdoubleArray arr, jsize start, jsize len, const jdouble* buf) { env->SetDoubleArrayRegion(arr, start, len, buf); }
+};
+template<> struct jArrayOps<jfloatArray>
+{
+	static jfloatArray New(JNIEnv* env, jsize n) { return env->NewFloatArray(n); }
+	static jfloat* GetElements(JNIEnv* env, jfloatArray arr, jboolean* isCopy) { return env->GetFloatArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jfloatArray arr, jfloat* ptr, jint mode) { env->ReleaseFloatArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jfloatArray arr, jsize start, jsize len, jfloat* buf) { env->GetFloatArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jfloatArray arr, jsize start, jsize len, const jfloat* buf) { env->SetFloatArrayRegion(arr, start, len, buf); }
+};
+template<> struct jArrayOps<jintArray>
+{
+	static jintArray New(JNIEnv* env, jsize n) { return env->NewIntArray(n); }
+	static jint* GetElements(JNIEnv* env, jintArray arr, jboolean* isCopy) { return env->GetIntArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jintArray arr, jint* ptr, jint mode) { env->ReleaseIntArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jintArray arr, jsize start, jsize len, jint* buf) { env->GetIntArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jintArray arr, jsize start, jsize len, const jint* buf) { env->SetIntArrayRegion(arr, start, len, buf); }
+};
+template<> struct jArrayOps<jshortArray>
+{
+	static jshortArray New(JNIEnv* env, jsize n) { return env->NewShortArray(n); }
+	static jshort* GetElements(JNIEnv* env, jshortArray arr, jboolean* isCopy) { return env->GetShortArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jshortArray arr, jshort* ptr, jint mode) { env->ReleaseShortArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jshortArray arr, jsize start, jsize len, jshort* buf) { env->GetShortArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jshortArray arr, jsize start, jsize len, const jshort* buf) { env->SetShortArrayRegion(arr, start, len, buf); }
+};
+template<> struct jArrayOps<jcharArray>
+{
+	static jcharArray New(JNIEnv* env, jsize n) { return env->NewCharArray(n); }
+	static jchar* GetElements(JNIEnv* env, jcharArray arr, jboolean* isCopy) { return env->GetCharArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jcharArray arr, jchar* ptr, jint mode) { env->ReleaseCharArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jcharArray arr, jsize start, jsize len, jchar* buf) { env->GetCharArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jcharArray arr, jsize start, jsize len, const jchar* buf) { env->SetCharArrayRegion(arr, start, len, buf); }
+};
+template<> struct jArrayOps<jlongArray>
+{
+	static jlongArray New(JNIEnv* env, jsize n) { return env->NewLongArray(n); }
+	static jlong* GetElements(JNIEnv* env, jlongArray arr, jboolean* isCopy) { return env->GetLongArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jlongArray arr, jlong* ptr, jint mode) { env->ReleaseLongArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jlongArray arr, jsize start, jsize len, jlong* buf) { env->GetLongArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jlongArray arr, jsize start, jsize len, const jlong* buf) { env->SetLongArrayRegion(arr, start, len, buf); }
+};
+template<> struct jArrayOps<jbyteArray>
+{
+	static jbyteArray New(JNIEnv* env, jsize n) { return env->NewByteArray(n); }
+	static jbyte* GetElements(JNIEnv* env, jbyteArray arr, jboolean* isCopy) { return env->GetByteArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jbyteArray arr, jbyte* ptr, jint mode) { env->ReleaseByteArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jbyteArray arr, jsize start, jsize len, jbyte* buf) { env->GetByteArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jbyteArray arr, jsize start, jsize len, const jbyte* buf) { env->SetByteArrayRegion(arr, start, len, buf); }
+};
+template<> struct jArrayOps<jbooleanArray>
+{
+	static jbooleanArray New(JNIEnv* env, jsize n) { return env->NewBooleanArray(n); }
+	static jboolean* GetElements(JNIEnv* env, jbooleanArray arr, jboolean* isCopy) { return env->GetBooleanArrayElements(arr, isCopy); }
+	static void ReleaseElements(JNIEnv* env, jbooleanArray arr, jboolean* ptr, jint mode) { env->ReleaseBooleanArrayElements(arr, ptr, mode); }
+	static void GetRegion(JNIEnv* env, jbooleanArray arr, jsize start, jsize len, jboolean* buf) { env->GetBooleanArrayRegion(arr, start, len, buf); }
+	static void SetRegion(JNIEnv* env, jbooleanArray arr, jsize start, jsize len, const jboolean* buf) { env->SetBooleanArrayRegion(arr, start, len, buf); }
+};
+
+// run fn(idx_begin, idx_end) over the range [0, n) split into contiguous blocks,
+// one block per thread (the calling thread does the first block).
+// nthreads <= 0 means use all hardware threads. Blocks are at least min_block long.
+// Only for pure native work: the JNIEnv must not be used inside fn since it is
+// only valid in the thread it belongs to.
+template<class F>
+void jni_parallel_for(size_t n, F fn, int nthreads = 0, size_t min_block = 1)
+{
+	if (n == 0) return;
+	if (nthreads <= 0) nthreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	size_t nblocks = std::min(static_cast<size_t>(nthreads), (n + min_block - 1) / std::max<size_t>(1, min_block));
+	if (nblocks <= 1)
+	{
+		fn(static_cast<size_t>(0), n);
+		return;
+	}
+
+	size_t block = (n + nblocks - 1) / nblocks;
+	std::vector<std::thread> threads;
+	for (size_t b = block; b < n; b += block)
+		threads.push_back(std::thread(fn, b, std::min(n, b + block)));
+	fn(static_cast<size_t>(0), std::min(n, block));
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
+
+// dense bitmap (one bit per flag, 64 flags per word) for java boolean arrays,
+// which use one byte per flag. Flag idx is bit (idx % 64) of word idx / 64.
+// Packing uses SSE2 (compare + movemask, 16 flags per instruction) when available.
+class jBitmap
+{
+public:
+
+	jBitmap() : n(0) {}
+
+	jBitmap(size_t n_, bool val = false)
+	{
+		resize(n_, val);
+	}
+
+	void resize(size_t n_, bool val = false)
+	{
+		n = n_;
+		words.assign((n + 63) / 64, val ? ~0ULL : 0ULL);
+		clear_padding();
+	}
+
+	size_t size() const { return n; }
+
+	bool get(size_t idx) const { return (words[idx / 64] >> (idx % 64)) & 1ULL; }
+
+	void set(size_t idx, bool val = true)
+	{
+		if (val) words[idx / 64] |= 1ULL << (idx % 64);
+		else words[idx / 64] &= ~(1ULL << (idx % 64));
+	}
+
+	uint64_t* data() { return words.data(); }
+	const uint64_t* data() const { return words.data(); }
+	size_t nwords() const { return words.size(); }
+
+	// number of flags set
+	size_t count() const
+	{
+		size_t c = 0;
+		for (size_t w = 0; w < words.size(); w++)
+			c += popcount64(words[w]);
+		return c;
+	}
+
+	// call fn(idx) for the index of each flag set, in increasing order
+	template<class F>
+	void for_each_set(F fn) const
+	{
+		for (size_t w = 0; w < words.size(); w++)
+		{
+			uint64_t word = words[w];
+			while (word != 0)
+			{
+				fn(w * 64 + ctz64(word));
+				word &= word - 1;
+			}
+		}
+	}
+
+	// the bits past the end of other count as 0
+	jBitmap& operator&=(const jBitmap &other)
+	{
+		size_t w = 0;
+		for (; w < words.size() && w < other.words.size(); w++) words[w] &= other.words[w];
+		for (; w < words.size(); w++) words[w] = 0;
+		return *this;
+	}
+
+	jBitmap& operator|=(const jBitmap &other)
+	{
+		for (size_t w = 0; w < words.size() && w < other.words.size(); w++) words[w] |= other.words[w];
+		clear_padding();
+		return *this;
+	}
+
+	void flip()
+	{
+		for (size_t w = 0; w < words.size(); w++) words[w] = ~words[w];
+		clear_padding();
+	}
+
+	// pack a java boolean array (any non-zero jboolean is true)
+	void from_jbooleanArray(JNIEnv* env, jbooleanArray arr)
+	{
+		resize(env->GetArrayLength(arr));
+		jboolean* body = env->GetBooleanArrayElements(arr, 0);
+		pack(body, n, words.data());
+		env->ReleaseBooleanArrayElements(arr, body, JNI_ABORT);
+	}
+
+	jbooleanArray to_jbooleanArray(JNIEnv* env) const
+	{
+		jbooleanArray arr_out = env->NewBooleanArray(n);
+		jboolean* out_ptr = env->GetBooleanArrayElements(arr_out, 0);
+		unpack(words.data(), n, out_ptr);
+		env->ReleaseBooleanArrayElements(arr_out, out_ptr, 0);
+		return arr_out;
+	}
+
+	// N should be the size of the bitmap
+	template<size_t N>
+	std::bitset<N> to_bitset() const
+	{
+		std::bitset<N> b;
+		for_each_set([&](size_t idx) { if (idx < N) b.set(idx); });
+		return b;
+	}
+
+	template<size_t N>
+	void from_bitset(const std::bitset<N> &b)
+	{
+		resize(N);
+		for (size_t idx = 0; idx < N; idx++)
+			if (b[idx]) set(idx);
+	}
+
+	std::vector<bool> to_stdVec() const
+	{
+		std::vector<bool> v(n);
+		for_each_set([&](size_t idx) { v[idx] = true; });
+		return v;
+	}
+
+	void from_stdVec(const std::vector<bool> &v)
+	{
+		resize(v.size());
+		for (size_t idx = 0; idx < n; idx++)
+			if (v[idx]) set(idx);
+	}
+
+	// pack n flags (one jboolean each) into (n + 63) / 64 words
+	static void pack(const jboolean* src, size_t n, uint64_t* words_out)
+	{
+		size_t i = 0;
+#ifdef JNI_MODERN_TOOLS_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 64 <= n; i += 64)
+		{
+			uint64_t w = 0;
+			for (int b = 0; b < 4; b++)
+			{
+				__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16 * b));
+				uint64_t m = static_cast<unsigned>(~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) & 0xFFFFu;
+				w |= m << (16 * b);
+			}
+			words_out[i / 64] = w;
+		}
+#endif
+		for (; i < n; i++)
+		{
+			if (i % 64 == 0) words_out[i / 64] = 0;
+			if (src[i]) words_out[i / 64] |= 1ULL << (i % 64);
+		}
+	}
+
+	// unpack n flags into one jboolean (JNI_TRUE or JNI_FALSE) each, 8 at a time
+	static void unpack(const uint64_t* words_in, size_t n, jboolean* dst)
+	{
+		const unsigned char (*table)[8] = unpack_table();
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+			std::memcpy(dst + i, table[(words_in[i / 64] >> (i % 64)) & 0xFF], 8);
+		for (; i < n; i++)
+			dst[i] = ((words_in[i / 64] >> (i % 64)) & 1ULL) ? JNI_TRUE : JNI_FALSE;
+	}
+
+private:
+
+	size_t n;
+	std::vector<uint64_t> words;
+
+	// keep the unused bits of the last word at zero (for count() and for_each_set())
+	void clear_padding()
+	{
+		if (n % 64 != 0) words.back() &= (1ULL << (n % 64)) - 1;
+	}
+
+	// bytes of each of the 256 possible 8 bit patterns
+	static const unsigned char (*unpack_table())[8]
+	{
+		static unsigned char table[256][8];
+		static bool initialized = []()
+		{
+			for (int v = 0; v < 256; v++)
+				for (int b = 0; b < 8; b++)
+					table[v][b] = (v >> b) & 1;
+			return true;
+		}();
+		(void)initialized;
+		return table;
+	}
+
+	static int popcount64(uint64_t x)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_popcountll(x);
+#else
+		int c = 0;
+		for (; x != 0; c++) x &= x - 1;
+		return c;
+#endif
+	}
+
+	static int ctz64(uint64_t x)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctzll(x);
+#else
+		int c = 0;
+		for (; (x & 1ULL) == 0; c++) x >>= 1;
+		return c;
+#endif
+	}
+};
+
+// process-wide cache of the class names found by reflection (Class.getName()), used by
+// jni_utils::get_signature_jobject so that the reflective upcall is done once per class
+// instead of for every jobject argument of every call.
+// Classes are held as weak global references (so that they can still be unloaded) and
+// compared with IsSameObject. Each thread also keeps a small cache of the last few classes
+// it looked up (most call sites only ever see one or a few classes), which is checked
+// first without taking the lock. Hits of the inline caches are only counted after
+// set_stats_enabled(true), so that the hot path does not write to a shared counter.
+class jClassNameCache
+{
+public:
+
+	static jClassNameCache& instance()
+	{
+		static jClassNameCache c;
+		return c;
+	}
+
+	// class name of cls with '/' as separator, e.g. java/lang/String or [D for arrays
+	std::string get_classname(JNIEnv* env, jclass cls)
+	{
+		// thread local inline cache
+		inline_cache &ic = get_inline_cache();
+		if (ic.generation != generation)
+			ic = inline_cache();
+		ic.generation = generation;
+		for (int i = 0; i < inline_cache_size; i++)
+			if (ic.cls[i] != nullptr && env->IsSameObject(ic.cls[i], cls))
+			{
+				if (stats_enabled.load(std::memory_order_relaxed))
+					nhits_inline.fetch_add(1, std::memory_order_relaxed);
+				return ic.names[i];
+			}
+
+		std::string str_classname;
+		jweak cls_weak = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			for (size_t i = 0; i < entries.size(); i++)
+				if (env->IsSameObject(entries[i].first, cls))
+				{
+					cls_weak = entries[i].first;
+					str_classname = entries[i].second;
+					nhits++;
+					break;
+				}
+		}
+
+		if (cls_weak == nullptr)
+		{
+			str_classname = lookup_classname(env, cls);
+			if (str_classname.empty()) return str_classname;
+			std::lock_guard<std::mutex> lock(mtx);
+			remove_unloaded(env);
+			cls_weak = env->NewWeakGlobalRef(cls);
+			entries.push_back(std::make_pair(cls_weak, str_classname));
+			nmisses++;
+		}
+
+		ic.cls[ic.next] = cls_weak;
+		ic.names[ic.next] = str_classname;
+		ic.next = (ic.next + 1) % inline_cache_size;
+		return str_classname;
+	}
+
+	// forget all the classes. Must not be called while other threads use the cache
+	// (e.g. only in JNI_OnUnload).
+	void clear(JNIEnv* env)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		for (size_t i = 0; i < entries.size(); i++)
+			env->DeleteWeakGlobalRef(entries[i].first);
+		entries.clear();
+		for (size_t i = 0; i < unloaded.size(); i++)
+			env->DeleteWeakGlobalRef(unloaded[i]);
+		unloaded.clear();
+		generation++;
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return entries.size();
+	}
+
+	void set_stats_enabled(bool enabled) { stats_enabled = enabled; }
+	bool is_stats_enabled() const { return stats_enabled; }
+
+	// the inline hits are 0 unless set_stats_enabled(true)
+	unsigned long long get_nhits_inline() const { return nhits_inline; }
+	unsigned long long get_nhits() const { return nhits; }
+	unsigned long long get_nmisses() const { return nmisses; }
+
+private:
+
+	static const int inline_cache_size = 4;
+
+	struct inline_cache
+	{
+		jweak cls[inline_cache_size];
+		std::string names[inline_cache_size];
+		int next;
+		unsigned int generation;
+		inline_cache() : next(0), generation(0) { for (int i = 0; i < inline_cache_size; i++) cls[i] = nullptr; }
+	};
+
+	std::mutex mtx;
+	std::vector<std::pair<jweak, std::string> > entries;
+	std::vector<jweak> unloaded; // removed from entries, deleted by clear()
+	std::atomic<unsigned int> generation;
+	std::atomic<bool> stats_enabled;
+	std::atomic<unsigned long long> nhits_inline, nhits, nmisses;
+
+	jClassNameCache() : generation(1), stats_enabled(false), nhits_inline(0), nhits(0), nmisses(0) {}
+	jClassNameCache(const jClassNameCache&) = delete;
+	jClassNameCache& operator=(const jClassNameCache&) = delete;
+
+	// drop the entries whose class has been unloaded (weak ref cleared), so that the entries
+	// do not grow forever and the scans stay short. Called with the lock held. The weak refs
+	// may still be in the inline caches of other threads, so they are only deleted by clear();
+	// the generation is bumped so that those caches are dropped on their next lookup.
+	void remove_unloaded(JNIEnv* env)
+	{
+		size_t cc = 0;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (env->IsSameObject(entries[i].first, nullptr))
+				unloaded.push_back(entries[i].first);
+			else
+				entries[cc++] = entries[i];
+		}
+		if (cc == entries.size()) return;
+		entries.resize(cc);
+		generation++;
+	}
+
+	static inline_cache& get_inline_cache()
+	{
+		static thread_local inline_cache ic;
+		return ic;
+	}
+
+	// one upcall to Class.getName()
+	static std::string lookup_classname(JNIEnv* env, jclass cls)
+	{
+		jclass cls_Class = env->GetObjectClass(cls);
+		jmethodID mID_getName = env->GetMethodID(cls_Class, "getName", "()Ljava/lang/String;");
+		env->DeleteLocalRef(cls_Class);
+		jstring className_temp = (jstring)env->CallObjectMethod(cls, mID_getName);
+		if (className_temp == nullptr) return std::string();
+		const char* chars = env->GetStringUTFChars(className_temp, 0);
+		std::string str_classname(chars);
+		env->ReleaseStringUTFChars(className_temp, chars);
+		env->DeleteLocalRef(className_temp);
+		std::replace(str_classname.begin(), str_classname.end(), '.', '/');
+		return str_classname;
+	}
+};
+
+// process-wide accounting of the java arrays pinned by native code: Matkc and jArray (from
+// Get<Type>ArrayElements until release), jByteView and jFfmArg (GetPrimitiveArrayCritical),
+// and the chunks of for_each_critical_chunk below. A critical pin can hold up the GC for the
+// whole process until it is released, so the number of pins, the pinned bytes and how long each
+// pin is held are checked against budgets (0 = no budget), e.g. in JNI_OnLoad:
+//
+// jPinRegistry::instance().set_budgets(16, 256 << 20, 5); // 16 pins, 256 MB, 5 ms
+//
+// Going over a budget does not fail the pin; it is counted (see print_stats) and reported on
+// stderr if set_verbose(true). Each pin is a jPinRegistry::pin (RAII), timestamped when taken.
+// The counters are atomics, so pinning does not take a lock.
+class jPinRegistry
+{
+public:
+
+	static jPinRegistry& instance()
+	{
+		static jPinRegistry r;
+		return r;
+	}
+
+	// one pinned array, released (and its duration accounted) on release() or destruction
+	class pin
+	{
+	public:
+
+		pin() : nbytes(0), critical(false), active(false) {}
+
+		pin(size_t nbytes_, bool critical_) : nbytes(nbytes_), critical(critical_), active(false)
+		{
+			jPinRegistry &r = jPinRegistry::instance();
+			if (!r.is_enabled()) return;
+			t_pinned = std::chrono::steady_clock::now();
+			active = true;
+			r.on_pin(nbytes, critical);
+		}
+
+		pin(pin &&p) : nbytes(p.nbytes), critical(p.critical), active(p.active), t_pinned(p.t_pinned)
+		{
+			p.active = false;
+		}
+
+		pin& operator=(pin &&p)
+		{
+			if (this == &p) return *this;
+			release();
+			nbytes = p.nbytes; critical = p.critical; active = p.active; t_pinned = p.t_pinned;
+			p.active = false;
+			return *this;
+		}
+
+		pin(const pin&) = delete;
+		pin& operator=(const pin&) = delete;
+
+		~pin() { release(); }
+
+		void release()
+		{
+			if (!active) return;
+			active = false;
+			jPinRegistry::instance().on_unpin(nbytes, critical, std::chrono::steady_clock::now() - t_pinned);
+		}
+
+		bool is_active() const { return active; }
+		bool is_critical() const { return critical; }
+		size_t get_nbytes() const { return nbytes; }
+		std::chrono::steady_clock::time_point get_time_pinned() const { return t_pinned; }
+
+		// how long the array has been pinned so far
+		double get_ms() const
+		{
+			return active ? std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_pinned).count() : 0.0;
+		}
+
+	private:
+		size_t nbytes;
+		bool critical;
+		bool active;
+		std::chrono::steady_clock::time_point t_pinned;
+	};
+
+	void set_budgets(size_t max_pins_, size_t max_pinned_bytes_, double max_pin_ms_)
+	{
+		max_pins = max_pins_;
+		max_pinned_bytes = max_pinned_bytes_;
+		max_pin_ns = static_cast<long long>(max_pin_ms_ * 1e6);
+	}
+
+	size_t get_max_pins() const { return max_pins; }
+	size_t get_max_pinned_bytes() const { return max_pinned_bytes; }
+	double get_max_pin_ms() const { return max_pin_ns / 1e6; }
+
+	// when disabled, pins are not accounted at all (they cost nothing)
+	void set_enabled(bool enabled_) { enabled = enabled_; }
+	bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	// report each budget violation on stderr
+	void set_verbose(bool verbose_) { verbose = verbose_; }
+
+	// (elementwise) work on a java array inside bounded critical sections: the array is pinned
+	// with GetPrimitiveArrayCritical, fn(ptr, i0, i1) processes the elements [i0, i1) of ptr,
+	// and the array is released (mode 0 or JNI_ABORT) before the next chunk, so that the GC can
+	// run in between. The chunk size adapts so that each critical section takes about half of
+	// the max_pin_ms budget (1 ms without a budget), starting from chunk_size elements (or
+	// 64 K elements if 0). No other JNI call may be made from fn.
+	// returns false if the array could not be pinned (OutOfMemoryError is pending).
+	template<class T_arr, class F>
+	bool for_each_critical_chunk(JNIEnv* env, T_arr arr, F fn, jint mode = 0, jsize chunk_size = 0)
+	{
+		typedef typename jArrayType_to_jType<T_arr>::type T;
+		jsize n = env->GetArrayLength(arr);
+		double target_ns = max_pin_ns > 0 ? max_pin_ns / 2.0 : 1e6;
+		double chunk = chunk_size > 0 ? chunk_size : 65536;
+		for (jsize i0 = 0; i0 < n;)
+		{
+			jsize i1 = static_cast<jsize>(std::min<double>(n, i0 + std::max(1.0, chunk)));
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			T* ptr = static_cast<T*>(env->GetPrimitiveArrayCritical(arr, nullptr));
+			if (ptr == nullptr) return false;
+			pin p(static_cast<size_t>(n) * sizeof(T), true);
+			fn(ptr, i0, i1);
+			env->ReleasePrimitiveArrayCritical(arr, ptr, mode);
+			p.release();
+			double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+			// at most 4x larger or smaller from one chunk to the next
+			chunk = (i1 - i0) * std::max(0.25, std::min(4.0, target_ns / std::max(ns, 1.0)));
+			nchunks++;
+			i0 = i1;
+		}
+		return true;
+	}
+
+	size_t get_npins() const { return npins; }
+	size_t get_pinned_bytes() const { return pinned_bytes; }
+	size_t get_npins_peak() const { return npins_peak; }
+	size_t get_pinned_bytes_peak() const { return pinned_bytes_peak; }
+	unsigned long long get_npins_total() const { return npins_total; }
+	unsigned long long get_npins_critical() const { return npins_critical; }
+	unsigned long long get_nchunks() const { return nchunks; }
+	double get_ms_longest_pin() const { return ns_longest / 1e6; }
+	double get_ms_longest_critical_pin() const { return ns_longest_critical / 1e6; }
+	double get_ms_mean_pin() const { return npins_released == 0 ? 0.0 : ns_total / 1e6 / npins_released; }
+	unsigned long long get_nviolations_pins() const { return nviolations_pins; }
+	unsigned long long get_nviolations_bytes() const { return nviolations_bytes; }
+	unsigned long long get_nviolations_duration() const { return nviolations_duration; }
+
+	// the peaks, totals, longest pins and violations (not the pins currently held)
+	void reset_stats()
+	{
+		npins_peak = npins.load();
+		pinned_bytes_peak = pinned_bytes.load();
+		npins_total = npins_critical = npins_released = nchunks = 0;
+		ns_total = ns_longest = ns_longest_critical = 0;
+		nviolations_pins = nviolations_bytes = nviolations_duration = 0;
+	}
+
+	void print_stats()
+	{
+		printf("jPinRegistry stats: #pins = %zu (peak %zu, budget %zu), pinned bytes = %zu (peak %zu, budget %zu)\n",
+			get_npins(), get_npins_peak(), get_max_pins(), get_pinned_bytes(), get_pinned_bytes_peak(), get_max_pinned_bytes());
+		printf("    #pins total = %llu (critical %llu, in %llu chunks), pin duration: mean %.3f ms, longest %.3f ms (critical %.3f ms), budget %.3f ms\n",
+			get_npins_total(), get_npins_critical(), get_nchunks(), get_ms_mean_pin(), get_ms_longest_pin(), get_ms_longest_critical_pin(), get_max_pin_ms());
+		printf("    budget violations: #pins %llu, bytes %llu, duration %llu\n",
+			get_nviolations_pins(), get_nviolations_bytes(), get_nviolations_duration());
+	}
+
+private:
+
+	std::atomic<bool> enabled, verbose;
+	std::atomic<size_t> max_pins, max_pinned_bytes;
+	std::atomic<long long> max_pin_ns;
+	std::atomic<size_t> npins, pinned_bytes, npins_peak, pinned_bytes_peak;
+	std::atomic<unsigned long long> npins_total, npins_critical, npins_released, nchunks;
+	std::atomic<long long> ns_total, ns_longest, ns_longest_critical;
+	std::atomic<unsigned long long> nviolations_pins, nviolations_bytes, nviolations_duration;
+
+	jPinRegistry() : enabled(true), verbose(false), max_pins(0), max_pinned_bytes(0), max_pin_ns(0),
+		npins(0), pinned_bytes(0), npins_peak(0), pinned_bytes_peak(0),
+		npins_total(0), npins_critical(0), npins_released(0), nchunks(0),
+		ns_total(0), ns_longest(0), ns_longest_critical(0),
+		nviolations_pins(0), nviolations_bytes(0), nviolations_duration(0) {}
+	jPinRegistry(const jPinRegistry&) = delete;
+	jPinRegistry& operator=(const jPinRegistry&) = delete;
+
+	template<class T>
+	static void update_max(std::atomic<T> &m, T val)
+	{
+		T cur = m.load(std::memory_order_relaxed);
+		while (val > cur && !m.compare_exchange_weak(cur, val, std::memory_order_relaxed)) {}
+	}
+
+	void on_pin(size_t nbytes, bool critical)
+	{
+		size_t n = ++npins;
+		size_t b = (pinned_bytes += nbytes);
+		update_max(npins_peak, n);
+		update_max(pinned_bytes_peak, b);
+		npins_total++;
+		if (critical) npins_critical++;
+		if (max_pins > 0 && n > max_pins)
+		{
+			nviolations_pins++;
+			if (verbose) fprintf(stderr, "jPinRegistry: %zu arrays pinned (budget %zu)\n", n, get_max_pins());
+		}
+		if (max_pinned_bytes > 0 && b > max_pinned_bytes)
+		{
+			nviolations_bytes++;
+			if (verbose) fprintf(stderr, "jPinRegistry: %zu bytes pinned (budget %zu)\n", b, get_max_pinned_bytes());
+		}
+	}
+
+	void on_unpin(size_t nbytes, bool critical, std::chrono::steady_clock::duration held)
+	{
+		long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(held).count();
+		npins--;
+		pinned_bytes -= nbytes;
+		npins_released++;
+		ns_total += ns;
+		update_max(ns_longest, ns);
+		if (critical) update_max(ns_longest_critical, ns);
+		if (max_pin_ns > 0 && ns > max_pin_ns)
+		{
+			nviolations_duration++;
+			if (verbose) fprintf(stderr, "jPinRegistry: %s of %zu bytes pinned for %.3f ms (budget %.3f ms)\n",
+				critical ? "critical array" : "array", nbytes, ns / 1e6, get_max_pin_ms());
+		}
+	}
+};
+
 // class of utility functions for dealing with JNI
 class jni_utils
 {
@@ -366,6 +1117,18 @@ public:
 		env->ReleaseByteArrayElements(arr, body, 0);
 		return arr_out;
 	}
+	std::vector<bool> from_jbooleanArray(jbooleanArray arr)
+	{
+		jBitmap bm;
+		bm.from_jbooleanArray(env, arr);
+		return bm.to_stdVec();
+	}
+	jBitmap from_jbooleanArray_bitmap(jbooleanArray arr)
+	{
+		jBitmap bm;
+		bm.from_jbooleanArray(env, arr);
+		return bm;
+	}
 	
 	jstring to_jstring(std::string s)
 	{
@@ -563,6 +1326,16 @@ public:
 			out_ptr[i] = static_cast<jbyte>(v[i]);
 		env->ReleaseByteArrayElements(arr_out, out_ptr, 0);
 		return arr_out;
+	}
+	jbooleanArray to_jbooleanArray(std::vector<bool> v)
+	{
+		jBitmap bm;
+		bm.from_stdVec(v);
+		return bm.to_jbooleanArray(env);
+	}
+	jbooleanArray to_jbooleanArray(const jBitmap &bm)
+	{
+		return bm.to_jbooleanArray(env);
 	}	
 	
 	// directly change/set values of array input argument
@@ -624,6 +1397,13 @@ public:
 			arr_ptr[i] = static_cast<jbyte>(v[i]);
 		env->ReleaseByteArrayElements(arr, arr_ptr, 0);
 	}
+	void set_jbooleanArray_inputArg(std::vector<bool> v, jbooleanArray arr)
+	{
+		jboolean *arr_ptr = env->GetBooleanArrayElements(arr, 0);
+		for (size_t i = 0; i < env->GetArrayLength(arr); i++)
+			arr_ptr[i] = v[i] ? JNI_TRUE : JNI_FALSE;
+		env->ReleaseBooleanArrayElements(arr, arr_ptr, 0);
+	}
 	
 	void throw_exception(std::string msg)
 	{
@@ -634,18 +1414,12 @@ public:
 	// get the fully qualified class name signature by reflection
 	// template param T should be jobject. If any other type such as
 	// jint and jfloatArray, just return empty string.
+	// The class names are cached (see jClassNameCache), so the reflection is only done
+	// the first time a class is seen.
 	template<class T>
 	std::string get_signature_jobject(T obj, bool just_class_name = false)
 	{	
-		if (!std::is_same<T, jobject>::value) return "";
-		jobject clsObj = env->CallObjectMethod(obj, env->GetMethodID(env->GetObjectClass(obj), "getClass", "()Ljava/lang/Class;"));
-		jstring className_temp = (jstring)env->CallObjectMethod(clsObj, env->GetMethodID(env->GetObjectClass(clsObj), "getName", "()Ljava/lang/String;"));
-		std::string str_classname = from_jstring(className_temp);
-		std::replace(str_classname.begin(), str_classname.end(), '.', '/');
-		std::string str_class_sig = "L" + str_classname + ";";
-		if(just_class_name)
-			return str_classname;
-		return str_class_sig;			
+		return get_signature_jobject(obj, just_class_name, std::integral_constant<bool, std::is_same<T, jobject>::value>());
 	}
 	
 	// generate a complete signature string for a java method
@@ -682,6 +1456,7 @@ public:
 	// jint, jfloat, ..., jintArray, ..., jobject
 	// template param jobject_or_jclass should be only either jobject or jclass
 	// depending whether the method to be called is non-static or static method respectively
+#if 0 // not valid C++ (the variadic arguments cannot be forwarded like this); kept as a record only
 	template<class T, class jobject_or_jclass>
 	T call_method_general(jobject_or_jclass obj_or_cls, std::string methodname, std::string method_sig, ...)
 	{
@@ -768,6 +1543,7 @@ public:
 				env->CallStaticVoidMethod(obj_or_class, mID, ...);
 		}
 	}
+#endif
 
 
 private:
@@ -790,1461 +1566,6544 @@ private:
 		return get_signature_jtype<T>(get_signature_jobject(arg));
 	}
 
-};
+	template<class T>
+	std::string get_signature_jobject(T obj, bool just_class_name, std::false_type)
+	{
+		return "";
+	}
 
+	std::string get_signature_jobject(jobject obj, bool just_class_name, std::true_type)
+	{
+		jclass cls = env->GetObjectClass(obj);
+		std::string str_classname = jClassNameCache::instance().get_classname(env, cls);
+		env->DeleteLocalRef(cls);
+		if (just_class_name)
+			return str_classname;
+		// array classes (e.g. [D or [Ljava/lang/String;) are already signatures
+		if (str_classname.find("[") == 0)
+			return str_classname;
+		return "L" + str_classname + ";";
+	}
 
-// wrapper class for Matkc Java matrix class
-class Matkc
+};
+
+// helper functions shared by the numpy .npy/.npz reader and writers below.
+// All multi-byte fields of the .npy and .zip formats are little endian.
+class npy_utils
 {
-private:
+public:
+	npy_utils() = delete;
 
-	JNIEnv* env;
+	static bool is_little_endian_host()
+	{
+		unsigned short x = 1;
+		return *reinterpret_cast<unsigned char*>(&x) == 1;
+	}
 
-	jclass cls;	
-	jobject obj;
+	static void put_le(std::ostream &os, unsigned long long v, int nbytes)
+	{
+		char b[8];
+		for (int i = 0; i < nbytes; i++)
+			b[i] = static_cast<char>((v >> (8 * i)) & 0xFF);
+		os.write(b, nbytes);
+	}
 
-	jmethodID constructor_methodID;
+	static unsigned long long get_le(const unsigned char* p, int nbytes)
+	{
+		unsigned long long v = 0;
+		for (int i = 0; i < nbytes; i++)
+			v |= static_cast<unsigned long long>(p[i]) << (8 * i);
+		return v;
+	}
 
-	jfieldID fieldID_data;	
-	jfieldID fieldID_nr;
-	jfieldID fieldID_nc;
-	jfieldID fieldID_nch;
-	jfieldID fieldID_ndata_per_chan;
-	jfieldID fieldID_ndata;
-
-	jdoubleArray data;
-	jdouble* ptr_data;
-
-	jint nr, nc, nch, nd, ndpch;
-
-	void prep_class_info(JNIEnv* env_)
+	// reverse in place the bytes of each of the n elements of elem_size bytes at p,
+	// 16 bytes at a time with SSE2 for elements of 2, 4 and 8 bytes
+	static void swap_bytes(char* p, size_t n, int elem_size)
 	{
-		env = env_;
-		cls = env->FindClass("KKH/StdLib/Matkc");
-		constructor_methodID = env->GetMethodID(cls, "<init>", "(III)V");
-		fieldID_data = env->GetFieldID(cls, "data", "[D");
-		fieldID_nr = env->GetFieldID(cls, "nr", "I");
-		fieldID_nc = env->GetFieldID(cls, "nc", "I");
-		fieldID_nch = env->GetFieldID(cls, "nch", "I");
-		fieldID_ndata = env->GetFieldID(cls, "ndata", "I");
-		fieldID_ndata_per_chan = env->GetFieldID(cls, "ndata_per_chan", "I");
+		size_t i = 0;
+#ifdef JNI_MODERN_TOOLS_SSE2
+		if (elem_size == 2 || elem_size == 4 || elem_size == 8)
+		{
+			size_t n_per_vec = 16 / elem_size;
+			for (; i + n_per_vec <= n; i += n_per_vec, p += 16)
+			{
+				__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+				// reverse the order of the 16 bit words in each element, then swap the bytes of each word
+				if (elem_size == 4)
+				{
+					v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+					v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+				}
+				else if (elem_size == 8)
+				{
+					v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+					v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+				}
+				v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+			}
+		}
+#endif
+		for (; i < n; i++, p += elem_size)
+			std::reverse(p, p + elem_size);
 	}
 
-	void create_new_Java_matrix(int nrows, int ncols, int nchannels)
+	// incremental CRC-32 (as used by the zip format)
+	static unsigned int crc32(unsigned int crc, const char* p, size_t n)
 	{
-		obj = env->NewObject(cls, constructor_methodID, nrows, ncols, nchannels);
+		static const std::vector<unsigned int> table = make_crc32_table();
+		crc = ~crc;
+		for (size_t i = 0; i < n; i++)
+			crc = table[(crc ^ static_cast<unsigned char>(p[i])) & 0xFF] ^ (crc >> 8);
+		return ~crc;
 	}
 
-	void wrap_existing_Java_matrix(jobject obj_matJava)
+	// numpy type character and element size corresponding to the C++ type T.
+	// e.g. double -> 'f' 8, jint -> 'i' 4, jchar -> 'u' 2
+	template<class T> static char dtype_kind()
 	{
-		obj = obj_matJava;
+		return std::is_floating_point<T>::value ? 'f' : (std::is_signed<T>::value ? 'i' : 'u');
 	}
 
-	void prep_data_info()
+	// the full numpy descr string for type T, e.g. "<f8" or "|i1"
+	template<class T> static std::string dtype_descr()
 	{
-		data = (jdoubleArray)env->GetObjectField(obj, fieldID_data);		
-		ptr_data = env->GetDoubleArrayElements(data, 0);
-		nr = env->GetIntField(obj, fieldID_nr);
-		nc = env->GetIntField(obj, fieldID_nc);
-		nch = env->GetIntField(obj, fieldID_nch);
-		ndpch = env->GetIntField(obj, fieldID_ndata_per_chan);
-		nd = env->GetIntField(obj, fieldID_ndata);		
+		std::string s;
+		if (sizeof(T) == 1) s = "|";
+		else s = is_little_endian_host() ? "<" : ">";
+		return s + dtype_kind<T>() + std::to_string(sizeof(T));
 	}
 
-	void init_new(JNIEnv* env_, int nrows, int ncols, int nchannels)
+	// shape of a nrows x ncols x nchannels matrix with the trailing singleton
+	// dimensions removed (so that a single channel matrix is saved as 2D, etc.)
+	static std::vector<unsigned long long> matrix_shape(int nrows, int ncols, int nchannels)
 	{
-		prep_class_info(env_);
-		create_new_Java_matrix(nrows, ncols, nchannels);
-		prep_data_info();
+		std::vector<unsigned long long> shape;
+		shape.push_back(nrows);
+		if (ncols != 1 || nchannels != 1) shape.push_back(ncols);
+		if (nchannels != 1) shape.push_back(nchannels);
+		return shape;
 	}
 
-	void init_new(JNIEnv* env_, jobject obj_Matkc)
+private:
+
+	static std::vector<unsigned int> make_crc32_table()
 	{
-		prep_class_info(env_);
-		wrap_existing_Java_matrix(obj_Matkc);
-		prep_data_info();
+		std::vector<unsigned int> table(256);
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			unsigned int c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+			table[i] = c;
+		}
+		return table;
 	}
+};
 
+// read a numpy .npy file (or a .npy member stored without compression
+// inside a .npz archive). The header is parsed on construction and the data
+// is then streamed through a fixed-size chunk buffer, so that files of several
+// GB can be read with bounded native memory.
+class npy_reader
+{
 public:
 
-	~Matkc()
+	npy_reader() = delete;
+
+	// offset_start is the byte position where the .npy data begins
+	// (0 for a .npy file, see npz_utils::find_member for .npz archives).
+	npy_reader(std::string fpath, unsigned long long offset_start = 0, size_t chunk_nbytes = 1 << 20)
 	{
-		env->ReleaseDoubleArrayElements(data, ptr_data, 0);
+		valid = false;
+		fid.open(fpath, std::ios::binary);
+		if (!fid)
+		{
+			str_error = "cannot open file " + fpath;
+			return;
+		}
+		fid.seekg(offset_start);
+		chunk_nelems = std::max<size_t>(1, chunk_nbytes / 8);
+		valid = parse_header();
 	}
 
-	Matkc() {}
+	bool is_valid() const { return valid; }
+	std::string get_error() const { return str_error; }
+	const std::vector<unsigned long long>& get_shape() const { return shape; }
+	bool is_fortran_order() const { return fortran_order; }
 
-	Matkc(const Matkc &m)
+	unsigned long long numel() const
 	{
-		init_new(m.env, m.nrows(), m.ncols(), m.nchannels());
-		std::copy(m.ptr_data, m.ptr_data + nd, ptr_data);
+		unsigned long long n = 1;
+		for (size_t i = 0; i < shape.size(); i++)
+			n *= shape[i];
+		return n;
 	}
 
-	// create a new Matkc 
-	void create(JNIEnv* env_, int nrows, int ncols, int nchannels = 1)
+	// interpret the array as a matrix of nrows x ncols x nchannels.
+	// arrays with 0 to 3 dimensions are supported.
+	bool get_matrix_shape(int &nrows, int &ncols, int &nchannels)
 	{
-		init_new(env_, nrows, ncols, nchannels);
+		if (!valid) return false;
+		if (shape.size() > 3)
+		{
+			str_error = "only numpy arrays with up to 3 dimensions can be interpreted as a matrix.";
+			return false;
+		}
+		if (numel() > 0x7FFFFFFFULL)
+		{
+			str_error = "numpy array has more elements than a java array can hold.";
+			return false;
+		}
+		nrows = shape.size() > 0 ? static_cast<int>(shape[0]) : 1;
+		ncols = shape.size() > 1 ? static_cast<int>(shape[1]) : 1;
+		nchannels = shape.size() > 2 ? static_cast<int>(shape[2]) : 1;
+		return true;
 	}
-	
-	// wrap an existing Matkc from Java
-	// no copy of data
-	void create(JNIEnv* env_, jobject obj_Matkc)
+
+	// read all the elements (in the order they are stored in the file)
+	// directly into ptr_out which must have room for numel() elements.
+	template<class T>
+	bool read_all(T* ptr_out)
 	{
-		init_new(env_, obj_Matkc);
+		// same type and byte order as in the file: no conversion needed at all
+		if (dtype_kind == npy_utils::dtype_kind<T>() && dtype_size == sizeof(T) && !need_swap)
+		{
+			unsigned long long n = numel();
+			unsigned long long cc = 0;
+			while (cc < n)
+			{
+				size_t n_chunk = static_cast<size_t>(std::min<unsigned long long>(chunk_nelems * 8 / sizeof(T), n - cc));
+				if (!fid.read(reinterpret_cast<char*>(ptr_out + cc), n_chunk * sizeof(T)))
+					return fail_truncated();
+				cc += n_chunk;
+			}
+			return true;
+		}
+
+		return read_chunks<T>([ptr_out](unsigned long long idx_start, const T* buf, size_t n)
+		{
+			std::copy(buf, buf + n, ptr_out + idx_start);
+		});
 	}
 
-	// construct from opencv matrix (make copy of data)
-	// assumes that the opencv matrix is a 2D matrix with a variable number of channels
-	// template param T should be C++ native types such as float, double, int and unsigned char
-	template<class T, int nchannels>
-	void create(JNIEnv* env_, cv::Mat mIn, bool divBy255 = false)
+	// stream all the elements (in the order they are stored in the file) converted
+	// to type T through a fixed-size buffer. For each chunk, fn(idx_start, buf, n) is called
+	// where idx_start is the linear index of buf[0] in the file.
+	template<class T, class F>
+	bool read_chunks(F fn)
 	{
-		int nrows = mIn.rows;
-		int ncols = mIn.cols;
-
-		jni_utils ju(env_);
+		if (!valid) return false;
 
-		if (mIn.channels() != nchannels)
-		{
-			ju.throw_exception("ERROR from JNI: Input opencv matrix does not have the same number of channels as the specified template parameter.");
-			return;
-		}			
+		unsigned long long n = numel();
+		std::vector<double> buf_raw(chunk_nelems); // double for alignment of any type
+		std::vector<T> buf_out(chunk_nelems * 8 / dtype_size);
+		size_t n_per_chunk = buf_out.size();
+		unsigned long long cc = 0;
 
-		if (mIn.dims != 2)
+		while (cc < n)
 		{
-			ju.throw_exception("ERROR from JNI: Input opencv matrix is not 2D (with a variable number of channels).");
-			return;
+			size_t n_chunk = static_cast<size_t>(std::min<unsigned long long>(n_per_chunk, n - cc));
+			char* raw = reinterpret_cast<char*>(buf_raw.data());
+			if (!fid.read(raw, n_chunk * dtype_size))
+				return fail_truncated();
+			if (need_swap)
+				npy_utils::swap_bytes(raw, n_chunk, dtype_size);
+			convert(raw, n_chunk, buf_out.data());
+			fn(cc, static_cast<const T*>(buf_out.data()), n_chunk);
+			cc += n_chunk;
 		}
-
-		init_new(env_, nrows, ncols, nchannels);
-
-		double divBy;
-		if (divBy255)
-			divBy = 255;
-		else
-			divBy = 1;
-		
-		int cc = 0;
-		for (int k = 0; k < nchannels; k++)
-			for (int j = 0; j < ncols; j++)
-				for (int i = 0; i < nrows; i++)
-					ptr_data[cc++] = static_cast<double>(mIn.at<cv::Vec<T, nchannels>>(i, j)[k]) / divBy;
+		return true;
 	}
 
-	// construct from opencv IplImage (make copy of data)
-	// assumes that the opencv matrix is a 2D matrix with a variable number of channels
-	// template param T should be C++ native types such as float, double, int and unsigned char
-	template<class T, int nchannels>
-	void create(JNIEnv* env_, IplImage* img_ipl, bool divBy255 = false)
-	{		
-		cv::Mat mIn = cv::cvarrToMat(img_ipl, false);
+private:
 
-		int nrows = mIn.rows;
-		int ncols = mIn.cols;
+	std::ifstream fid;
+	bool valid;
+	std::string str_error;
+	std::vector<unsigned long long> shape;
+	bool fortran_order;
+	char dtype_kind;
+	int dtype_size;
+	bool need_swap;
+	size_t chunk_nelems;
 
-		jni_utils ju(env_);
+	bool fail_truncated()
+	{
+		str_error = "numpy file is truncated.";
+		return false;
+	}
 
-		if (mIn.channels() != nchannels)
+	bool parse_header()
+	{
+		unsigned char preamble[10];
+		if (!fid.read(reinterpret_cast<char*>(preamble), 8) || std::memcmp(preamble, "\x93NUMPY", 6) != 0)
 		{
-			ju.throw_exception("ERROR from JNI: Input opencv matrix does not have the same number of channels as the specified template parameter.");
-			return;
+			str_error = "not a numpy .npy file (magic string not found).";
+			return false;
 		}
 
-		if (mIn.dims != 2)
+		int nbytes_len = preamble[6] == 1 ? 2 : 4;
+		if (!fid.read(reinterpret_cast<char*>(preamble), nbytes_len))
+			return fail_truncated();
+		std::string header(static_cast<size_t>(npy_utils::get_le(preamble, nbytes_len)), ' ');
+		if (!fid.read(&header[0], header.size()))
+			return fail_truncated();
+
+		// e.g. {'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), }
+		size_t pos = header.find("'descr'");
+		if (pos != std::string::npos)
+			pos = header.find_first_not_of(' ', header.find(':', pos) + 1);
+		if (pos == std::string::npos || header[pos] != '\'')
 		{
-			ju.throw_exception("ERROR from JNI: Input opencv matrix is not 2D (with a variable number of channels).");
-			return;
+			str_error = "numpy structured dtypes are not supported.";
+			return false;
 		}
-
-		init_new(env_, nrows, ncols, nchannels);
-
-		double divBy;
-		if (divBy255)
-			divBy = 255;
-		else
-			divBy = 0;
-
-		int cc = 0;
-		for (int k = 0; k < nchannels; k++)
-			for (int j = 0; j < ncols; j++)
-				for (int i = 0; i < nrows; i++)
-					ptr_data[cc++] = static_cast<double>(mIn.at<cv::Vec<T, nchannels>>(i, j)[k]) / divBy;
-	}
-	
-	// construct from std::vector (make copy of data)
-	// template parameter T should be native C++ types such as float, double, int and unsigned char
-	template<class T>
-	void create(JNIEnv* env_, std::vector<T> vIn, int nrows, int ncols, int nchannels, bool transpose = false)
-	{
-		jni_utils ju(env_);
-
-		if (vIn.size() != nrows * ncols * nchannels)
+		std::string descr = header.substr(pos + 1, header.find('\'', pos + 1) - pos - 1);
+		if (descr.size() < 3)
 		{
-			ju.throw_exception("ERROR from JNI: vIn.size() != nrows * ncols * nchannels.");
-			return;
+			str_error = "cannot parse numpy dtype " + descr;
+			return false;
 		}
-			
-		init_new(env_, nrows, ncols, nchannels);
+		dtype_kind = descr[1] == 'b' ? 'u' : descr[1];
+		dtype_size = std::atoi(descr.c_str() + 2);
+		need_swap = dtype_size > 1 && descr[0] != '|' && ((descr[0] == '<') != npy_utils::is_little_endian_host());
 
-		if (!transpose) // assume the data in the the vector is stored in col major
+		bool dtype_ok = (dtype_kind == 'f' && (dtype_size == 4 || dtype_size == 8))
+			|| ((dtype_kind == 'i' || dtype_kind == 'u') && (dtype_size == 1 || dtype_size == 2 || dtype_size == 4 || dtype_size == 8));
+		if (!dtype_ok)
 		{
-			if (std::is_same<T, double>::value)
-			{
-				std::copy(vIn.begin(), vIn.end(), ptr_data);
-			}
+			str_error = "unsupported numpy dtype " + descr;
+			return false;
+		}
 
-			else
-			{
-				for (int ii = 0; ii < vIn.size(); ii++)
-					ptr_data[ii] = static_cast<double>(vIn[ii]);
-			}
+		pos = header.find("'fortran_order'");
+		fortran_order = pos != std::string::npos && header.compare(header.find(':', pos) + 1, 5, " True") == 0;
+
+		pos = header.find('(', header.find("'shape'"));
+		size_t pos_end = header.find(')', pos);
+		if (pos == std::string::npos || pos_end == std::string::npos)
+		{
+			str_error = "cannot parse numpy shape.";
+			return false;
 		}
-		else // assume the data in the the vector is stored in row major
+		std::stringstream ss(header.substr(pos + 1, pos_end - pos - 1));
+		std::string token;
+		while (std::getline(ss, token, ','))
 		{
-			unsigned long long cc = 0;
-			int nch_mult_nc = nch * nc;
-			for (int k = 0; k < nch; k++)
-				for (int j = 0; j < nc; j++)
-					for (int i = 0; i < nr; i++)
-						ptr_data[cc++] = static_cast<double>(vIn[i * nch_mult_nc + j * nch + k]);
-		}			
+			if (token.find_first_of("0123456789") != std::string::npos)
+				shape.push_back(std::stoull(token));
+		}
+
+		return true;
 	}
 
-	// construct from raw data pointer (make copy of data)
-	// template parameter T should be native C++ types such as float, double, int and unsigned char
-	template<class T>
-	void create(JNIEnv* env_, T* ptr_in, int nrows, int ncols, int nchannels)
+	template<class T_in, class T>
+	static void convert_typed(const char* raw, size_t n, T* out)
 	{
-		init_new(env_, nrows, ncols, nchannels);
+		const T_in* in = reinterpret_cast<const T_in*>(raw);
+		for (size_t i = 0; i < n; i++)
+			out[i] = static_cast<T>(in[i]);
+	}
 
-		if (std::is_same<T, double>::value)
-			std::copy(ptr_in, ptr_in + nd, ptr_data);
+	template<class T>
+	void convert(const char* raw, size_t n, T* out)
+	{
+		if (dtype_kind == 'f')
+		{
+			if (dtype_size == 4) convert_typed<float>(raw, n, out);
+			else convert_typed<double>(raw, n, out);
+		}
+		else if (dtype_kind == 'i')
+		{
+			if (dtype_size == 1) convert_typed<signed char>(raw, n, out);
+			else if (dtype_size == 2) convert_typed<short>(raw, n, out);
+			else if (dtype_size == 4) convert_typed<int>(raw, n, out);
+			else convert_typed<long long>(raw, n, out);
+		}
 		else
 		{
-			for (int ii = 0; ii < nd; ii++)
-				ptr_data[ii] = static_cast<double>(ptr_in[ii]);
+			if (dtype_size == 1) convert_typed<unsigned char>(raw, n, out);
+			else if (dtype_size == 2) convert_typed<unsigned short>(raw, n, out);
+			else if (dtype_size == 4) convert_typed<unsigned int>(raw, n, out);
+			else convert_typed<unsigned long long>(raw, n, out);
 		}
 	}
+};
 
-	// type T should be native C++ types such as float, double and unsigned char
-	template<class T>
-	void create(JNIEnv* env_, arma::Mat<T> mIn)
-	{		
-		int nrows = mIn.n_rows;
-		int ncols = mIn.n_cols;
-		int nchannels = 1;
-
-		init_new(env_, nrows, ncols, nchannels);
+// write a numpy .npy array (header + data) to a stream.
+// the number of bytes written and the CRC-32 of everything written so far
+// are kept so that the same writer can produce members of .npz archives.
+class npy_writer
+{
+public:
 
-		T* ptr_in = mIn.memptr();
+	npy_writer() = delete;
 
-		if (std::is_same<T, double>::value)
-			std::copy(ptr_in, ptr_in + nd, ptr_data);
-		else
-		{
-			for (int ii = 0; ii < nd; ii++)
-				ptr_data[ii] = static_cast<double>(ptr_in[ii]);
-		}
+	npy_writer(std::ostream &os_, size_t chunk_nbytes = 1 << 20)
+		: os(os_)
+	{
+		nbytes_written = 0;
+		crc = 0;
+		chunk_nbytes_max = std::max<size_t>(8, chunk_nbytes);
 	}
 
-	// type T should be native C++ types such as float, double and unsigned char
+	// the complete header (magic string, version, header length and the
+	// padded header dictionary) for an array of type T with the given shape
 	template<class T>
-	void create(JNIEnv* env_, arma::Cube<T> mIn)
+	static std::string make_header(const std::vector<unsigned long long> &shape, bool fortran_order)
+	{
+		std::string dict = "{'descr': '" + npy_utils::dtype_descr<T>() + "', 'fortran_order': ";
+		dict += fortran_order ? "True" : "False";
+		dict += ", 'shape': (";
+		for (size_t i = 0; i < shape.size(); i++)
+			dict += std::to_string(shape[i]) + (shape.size() == 1 ? "," : (i + 1 < shape.size() ? ", " : ""));
+		dict += "), }";
+
+		// total header size must be a multiple of 64 and end with a newline
+		size_t nbytes_preamble = 10;
+		bool v2 = dict.size() + nbytes_preamble + 1 > 65535;
+		if (v2) nbytes_preamble = 12;
+		size_t nbytes_total = (dict.size() + nbytes_preamble + 1 + 63) / 64 * 64;
+		dict.append(nbytes_total - nbytes_preamble - dict.size() - 1, ' ');
+		dict += '\n';
+
+		std::ostringstream ss;
+		ss.write("\x93NUMPY", 6);
+		ss.put(v2 ? 2 : 1);
+		ss.put(0);
+		npy_utils::put_le(ss, dict.size(), v2 ? 4 : 2);
+		ss << dict;
+		return ss.str();
+	}
+
+	// total number of bytes of the .npy representation of the given array
+	template<class T>
+	static unsigned long long nbytes_npy(const std::vector<unsigned long long> &shape, bool fortran_order)
 	{
-		int nrows = mIn.n_rows;
-		int ncols = mIn.n_cols;
-		int nchannels = mIn.n_slices;
+		unsigned long long n = 1;
+		for (size_t i = 0; i < shape.size(); i++)
+			n *= shape[i];
+		return make_header<T>(shape, fortran_order).size() + n * sizeof(T);
+	}
 
-		init_new(env_, nrows, ncols, nchannels);
+	// write header and data. The data is streamed in chunks straight from ptr_data.
+	template<class T>
+	bool write(const T* ptr_data, const std::vector<unsigned long long> &shape, bool fortran_order)
+	{
+		std::string header = make_header<T>(shape, fortran_order);
+		write_bytes(header.data(), header.size());
 
-		T* ptr_in = mIn.memptr();
+		unsigned long long n = 1;
+		for (size_t i = 0; i < shape.size(); i++)
+			n *= shape[i];
 
-		if (std::is_same<T, double>::value)
-			std::copy(ptr_in, ptr_in + nd, ptr_data);
-		else
+		const char* p = reinterpret_cast<const char*>(ptr_data);
+		unsigned long long nbytes = n * sizeof(T);
+		unsigned long long cc = 0;
+		while (cc < nbytes)
 		{
-			for (int ii = 0; ii < nd; ii++)
-				ptr_data[ii] = static_cast<double>(ptr_in[ii]);
+			size_t nbytes_chunk = static_cast<size_t>(std::min<unsigned long long>(chunk_nbytes_max, nbytes - cc));
+			write_bytes(p + cc, nbytes_chunk);
+			cc += nbytes_chunk;
 		}
+		return static_cast<bool>(os);
 	}
-	
-	// template parameter T should be native C++ types such as float, double, int and unsigned char
-	template<class T>
-	std::vector<T> to_stdVec(bool transpose = false)
+
+	unsigned long long get_nbytes_written() const { return nbytes_written; }
+	unsigned int get_crc32() const { return crc; }
+
+private:
+
+	std::ostream &os;
+	unsigned long long nbytes_written;
+	unsigned int crc;
+	size_t chunk_nbytes_max;
+
+	void write_bytes(const char* p, size_t n)
 	{
-		std::vector<T> vOut(nd);
+		os.write(p, n);
+		crc = npy_utils::crc32(crc, p, n);
+		nbytes_written += n;
+	}
+};
 
-		if (!transpose)
+// locating arrays inside uncompressed numpy .npz archives (as written by numpy.savez).
+// zip64 archives are supported so that members larger than 4 GB can be read.
+class npz_utils
+{
+public:
+	npz_utils() = delete;
+
+	// find the member named name_array (with or without the ".npy" extension)
+	// and give the byte offset where its .npy data starts. This offset can then
+	// be given to npy_reader. Returns false (with str_error set) if not found.
+	static bool find_member(std::string fpath, std::string name_array, unsigned long long &offset_data, std::string &str_error)
+	{
+		std::ifstream fid(fpath, std::ios::binary);
+		if (!fid)
 		{
-			if (std::is_same<T, double>::value)
-				std::copy(ptr_data, ptr_data + nd, vOut.begin());
-			else
+			str_error = "cannot open file " + fpath;
+			return false;
+		}
+
+		// the end of central directory record is within the last 64KB + 22 bytes
+		fid.seekg(0, std::ios::end);
+		unsigned long long nbytes_file = static_cast<unsigned long long>(fid.tellg());
+		unsigned long long nbytes_tail = std::min<unsigned long long>(nbytes_file, 65535 + 22);
+		std::vector<unsigned char> tail(static_cast<size_t>(nbytes_tail));
+		fid.seekg(nbytes_file - nbytes_tail);
+		fid.read(reinterpret_cast<char*>(tail.data()), tail.size());
+
+		long long pos_eocd = -1;
+		for (long long i = static_cast<long long>(tail.size()) - 22; i >= 0; i--)
+		{
+			if (npy_utils::get_le(&tail[i], 4) == 0x06054b50)
 			{
-				for (int ii = 0; ii < nd; ii++)
-					vOut[ii] = static_cast<T>(ptr_data[ii]);
+				pos_eocd = i;
+				break;
 			}
 		}
-
-		else
+		if (pos_eocd < 0)
 		{
-			unsigned long long cc = 0;
-			for (int i = 0; i < nr; i++)
-				for (int j = 0; j < nc; j++)
-					for (int k = 0; k < nch; k++)
-						vOut[cc++] = get(i,j,k);
+			str_error = "not a zip/npz file (end of central directory not found).";
+			return false;
 		}
-		
-		return vOut;
-	}
 
-	// convert to opencv matrix (make copy of data)
-	// the output opencv matrix will be a 2D matrix with a variable number of channels
-	// template param T should be C++ native types such as float, double, int and unsigned char
-	template<class T, int nchannels>
-	cv::Mat to_cvMat(bool multBy255 = false)
-	{
-		jni_utils ju(env);
-			
-		if (nchannels != nch)
+		unsigned long long nentries = npy_utils::get_le(&tail[pos_eocd + 10], 2);
+		unsigned long long offset_cd = npy_utils::get_le(&tail[pos_eocd + 16], 4);
+
+		// zip64: the real values are in the zip64 end of central directory record
+		if ((nentries == 0xFFFF || offset_cd == 0xFFFFFFFF) && pos_eocd >= 20
+			&& npy_utils::get_le(&tail[pos_eocd - 20], 4) == 0x07064b50)
 		{
-			ju.throw_exception("ERROR from JNI: template parameter nchannels does not match with internal matrix nchannels.");
-			return cv::Mat();
+			unsigned char rec[56];
+			fid.seekg(npy_utils::get_le(&tail[pos_eocd - 20 + 8], 8));
+			fid.read(reinterpret_cast<char*>(rec), 56);
+			nentries = npy_utils::get_le(rec + 32, 8);
+			offset_cd = npy_utils::get_le(rec + 48, 8);
 		}
 
-		double multBy;
-		if (multBy255)
-			multBy = 255;
-		else
-			multBy = 1;
-			
-		cv::Mat mOut(nr, nc, CV_MAKE_TYPE(cv::DataType<T>::depth, nch));
-		int cc = 0;
-		for (int k = 0; k < nch; k++)
-			for (int j = 0; j < nc; j++)
-				for (int i = 0; i < nr; i++)
-					mOut.at<cv::Vec<T, nchannels>>(i, j)[k] = static_cast<T>(ptr_data[cc++] * multBy);
-
-		return mOut;
-	}
+		std::string name_npy = name_array + ".npy";
+		fid.seekg(offset_cd);
+		for (unsigned long long e = 0; e < nentries; e++)
+		{
+			unsigned char h[46];
+			if (!fid.read(reinterpret_cast<char*>(h), 46) || npy_utils::get_le(h, 4) != 0x02014b50)
+				break;
+			int method = static_cast<int>(npy_utils::get_le(h + 10, 2));
+			unsigned long long nbytes_comp = npy_utils::get_le(h + 20, 4);
+			unsigned long long nbytes_uncomp = npy_utils::get_le(h + 24, 4);
+			size_t len_name = static_cast<size_t>(npy_utils::get_le(h + 28, 2));
+			size_t len_extra = static_cast<size_t>(npy_utils::get_le(h + 30, 2));
+			size_t len_comment = static_cast<size_t>(npy_utils::get_le(h + 32, 2));
+			unsigned long long offset_local = npy_utils::get_le(h + 42, 4);
+
+			std::string name(len_name, ' ');
+			std::vector<unsigned char> extra(len_extra);
+			fid.read(&name[0], len_name);
+			if (len_extra > 0)
+				fid.read(reinterpret_cast<char*>(extra.data()), len_extra);
+			fid.seekg(len_comment, std::ios::cur);
+
+			if (name != name_array && name != name_npy)
+				continue;
+
+			if (method != 0)
+			{
+				str_error = "npz member " + name + " is compressed; only uncompressed npz (numpy.savez) is supported.";
+				return false;
+			}
 
-	// type T should be native C++ types such as float, double and unsigned char
-	template<class T>
-	arma::Cube<T> to_armaCube()
-	{
-		arma::Cube<T> mOut(nr, nc, nch);		
-		T* ptr_out = mOut.memptr();
+			// zip64 extended information: only the fields set to 0xFFFFFFFF are present, in this order
+			for (size_t i = 0; i + 4 <= extra.size();)
+			{
+				unsigned long long id = npy_utils::get_le(&extra[i], 2);
+				size_t len = static_cast<size_t>(npy_utils::get_le(&extra[i + 2], 2));
+				if (id == 0x0001)
+				{
+					size_t p = i + 4;
+					if (nbytes_uncomp == 0xFFFFFFFF) { nbytes_uncomp = npy_utils::get_le(&extra[p], 8); p += 8; }
+					if (nbytes_comp == 0xFFFFFFFF) { nbytes_comp = npy_utils::get_le(&extra[p], 8); p += 8; }
+					if (offset_local == 0xFFFFFFFF) { offset_local = npy_utils::get_le(&extra[p], 8); p += 8; }
+				}
+				i += 4 + len;
+			}
 
-		if (std::is_same<T, double>::value)
-			std::copy(ptr_data, ptr_data + nd, ptr_out);
-		else
-		{
-			for (int ii = 0; ii < nd; ii++)
-				ptr_out[ii] = static_cast<T>(ptr_data[ii]);
+			unsigned char lh[30];
+			fid.seekg(offset_local);
+			if (!fid.read(reinterpret_cast<char*>(lh), 30) || npy_utils::get_le(lh, 4) != 0x04034b50)
+			{
+				str_error = "corrupt local file header in npz file.";
+				return false;
+			}
+			offset_data = offset_local + 30 + npy_utils::get_le(lh + 26, 2) + npy_utils::get_le(lh + 28, 2);
+			return true;
 		}
 
-		return mOut;
+		str_error = "array " + name_array + " not found in npz file " + fpath;
+		return false;
 	}
+};
 
-	// type T should be native C++ types such as float, double and unsigned char
-	template<class T>
-	arma::Mat<T> to_armaMat()
+// write an uncompressed numpy .npz archive (the same as numpy.savez).
+// each array is streamed into the archive with npy_writer; the
+// central directory is written when close() is called (or on destruction).
+class npz_writer
+{
+public:
+
+	npz_writer() = delete;
+
+	npz_writer(std::string fpath)
 	{
-		jni_utils ju(env);
+		fid.open(fpath, std::ios::binary | std::ios::trunc);
+		closed = false;
+	}
 
-		if (nch != 1)
-		{
-			ju.throw_exception("ERROR from JNI: to_armMat() can only called if the underlying matrix has 1 channel.");
-			return arma::Mat<T>();
-		}			
+	~npz_writer()
+	{
+		close();
+	}
 
-		arma::Mat<T> mOut(nr, nc);
-		T* ptr_out = mOut.memptr();
+	bool is_valid() const { return static_cast<bool>(fid); }
 
-		if (std::is_same<T, double>::value)
-			std::copy(ptr_data, ptr_data + nd, ptr_out);
-		else
+	// add an array named name_array (".npy" is appended) to the archive.
+	template<class T>
+	bool add(std::string name_array, const T* ptr_data, const std::vector<unsigned long long> &shape, bool fortran_order)
+	{
+		if (closed || !fid) return false;
+
+		entry e;
+		e.name = name_array + ".npy";
+		e.offset = static_cast<unsigned long long>(fid.tellp());
+		e.nbytes = npy_writer::nbytes_npy<T>(shape, fortran_order);
+		e.zip64 = e.nbytes >= 0xFFFFFFFF;
+
+		// local file header; the CRC is patched in after the data has been streamed
+		npy_utils::put_le(fid, 0x04034b50, 4);
+		npy_utils::put_le(fid, e.zip64 ? 45 : 20, 2); // version needed
+		npy_utils::put_le(fid, 0, 2); // flags
+		npy_utils::put_le(fid, 0, 2); // method: stored
+		npy_utils::put_le(fid, 0, 2); // time
+		npy_utils::put_le(fid, 0x21, 2); // date: 1980-01-01
+		npy_utils::put_le(fid, 0, 4); // crc (patched later)
+		npy_utils::put_le(fid, e.zip64 ? 0xFFFFFFFF : e.nbytes, 4);
+		npy_utils::put_le(fid, e.zip64 ? 0xFFFFFFFF : e.nbytes, 4);
+		npy_utils::put_le(fid, e.name.size(), 2);
+		npy_utils::put_le(fid, e.zip64 ? 20 : 0, 2);
+		fid << e.name;
+		if (e.zip64)
 		{
-			for (int ii = 0; ii < nd; ii++)
-				ptr_out[ii] = static_cast<T>(ptr_data[ii]);
+			npy_utils::put_le(fid, 0x0001, 2);
+			npy_utils::put_le(fid, 16, 2);
+			npy_utils::put_le(fid, e.nbytes, 8);
+			npy_utils::put_le(fid, e.nbytes, 8);
 		}
 
-		return mOut;
-	}
+		npy_writer w(fid);
+		w.write(ptr_data, shape, fortran_order);
+		e.crc = w.get_crc32();
 
-	double get(int i, int j, int k)
-	{
-		return ptr_data[k * ndpch + j * nr + i];
+		std::streampos pos_end = fid.tellp();
+		fid.seekp(e.offset + 14);
+		npy_utils::put_le(fid, e.crc, 4);
+		fid.seekp(pos_end);
+
+		entries.push_back(e);
+		return static_cast<bool>(fid);
 	}
 
-	// get the copy of data corresponding to given range of a full matrix
-	Matkc get(int r1, int r2, int c1, int c2, int ch1, int ch2)
+	// write the central directory and close the file
+	void close()
 	{
-		if (r1 == -1) r1 = nr - 1;
-		if (r2 == -1) r2 = nr - 1;
-		if (c1 == -1) c1 = nc - 1;
-		if (c2 == -1) c2 = nc - 1;
-		if (ch1 == -1) ch1 = nch - 1;
-		if (ch2 == -1) ch2 = nch - 1;
-
-		int nr_new = r2 - r1 + 1;
-		int nc_new = c2 - c1 + 1;
-		int nch_new = ch2 - ch1 + 1;
-		int ndata_per_chan_new = nr_new * nc_new;
-		int ndata_new = ndata_per_chan_new * nch_new;
-
-		Matkc mOut;
-		mOut.create(env, nr_new, nc_new, nch_new);
-		double* temp_out = mOut.ptr_data;
+		if (closed) return;
+		closed = true;
+		if (!fid) return;
 
-		if (nr_new == nr && nc_new == nc)
-		{
-			std::copy(ptr_data + ch1 * ndpch, ptr_data + ch1 * ndpch + ndata_new, temp_out);
-		}
-		else if (nr_new == nr && nc_new != nc)
+		unsigned long long offset_cd = static_cast<unsigned long long>(fid.tellp());
+		for (size_t i = 0; i < entries.size(); i++)
 		{
-			int cc = 0;
-			int idx_temp;
-			for (int k = 0; k<nch_new; k++)
+			const entry &e = entries[i];
+			bool zip64_offset = e.offset >= 0xFFFFFFFF;
+			int len_extra = (e.zip64 ? 16 : 0) + (zip64_offset ? 8 : 0);
+			npy_utils::put_le(fid, 0x02014b50, 4);
+			npy_utils::put_le(fid, (e.zip64 || zip64_offset) ? 45 : 20, 2); // version made by
+			npy_utils::put_le(fid, (e.zip64 || zip64_offset) ? 45 : 20, 2); // version needed
+			npy_utils::put_le(fid, 0, 2);
+			npy_utils::put_le(fid, 0, 2);
+			npy_utils::put_le(fid, 0, 2);
+			npy_utils::put_le(fid, 0x21, 2);
+			npy_utils::put_le(fid, e.crc, 4);
+			npy_utils::put_le(fid, e.zip64 ? 0xFFFFFFFF : e.nbytes, 4);
+			npy_utils::put_le(fid, e.zip64 ? 0xFFFFFFFF : e.nbytes, 4);
+			npy_utils::put_le(fid, e.name.size(), 2);
+			npy_utils::put_le(fid, len_extra > 0 ? len_extra + 4 : 0, 2);
+			npy_utils::put_le(fid, 0, 2); // comment length
+			npy_utils::put_le(fid, 0, 2); // disk number
+			npy_utils::put_le(fid, 0, 2); // internal attributes
+			npy_utils::put_le(fid, 0, 4); // external attributes
+			npy_utils::put_le(fid, zip64_offset ? 0xFFFFFFFF : e.offset, 4);
+			fid << e.name;
+			if (len_extra > 0)
 			{
-				idx_temp = (k + ch1) * ndpch + c1*nr;
-				std::copy(ptr_data + idx_temp, ptr_data + idx_temp + ndata_per_chan_new, temp_out + cc);
-				cc += nr_new * nc_new;
+				npy_utils::put_le(fid, 0x0001, 2);
+				npy_utils::put_le(fid, len_extra, 2);
+				if (e.zip64)
+				{
+					npy_utils::put_le(fid, e.nbytes, 8);
+					npy_utils::put_le(fid, e.nbytes, 8);
+				}
+				if (zip64_offset)
+					npy_utils::put_le(fid, e.offset, 8);
 			}
 		}
-		else
+		unsigned long long offset_cd_end = static_cast<unsigned long long>(fid.tellp());
+		unsigned long long nbytes_cd = offset_cd_end - offset_cd;
+
+		bool zip64 = offset_cd >= 0xFFFFFFFF || entries.size() >= 0xFFFF;
+		if (zip64)
 		{
-			int cc = 0;
-			int idx_temp;
-			for (int k = 0; k<nch_new; k++)
-				for (int j = 0; j<nc_new; j++)
-				{					
-					idx_temp = (k + ch1) * ndpch + (j + c1) * nr + r1;
-					std::copy(ptr_data + idx_temp, ptr_data + idx_temp + nr_new, temp_out + cc);
-					cc += nr_new;
-				}
+			// zip64 end of central directory record and locator
+			npy_utils::put_le(fid, 0x06064b50, 4);
+			npy_utils::put_le(fid, 44, 8);
+			npy_utils::put_le(fid, 45, 2);
+			npy_utils::put_le(fid, 45, 2);
+			npy_utils::put_le(fid, 0, 4);
+			npy_utils::put_le(fid, 0, 4);
+			npy_utils::put_le(fid, entries.size(), 8);
+			npy_utils::put_le(fid, entries.size(), 8);
+			npy_utils::put_le(fid, nbytes_cd, 8);
+			npy_utils::put_le(fid, offset_cd, 8);
+
+			npy_utils::put_le(fid, 0x07064b50, 4);
+			npy_utils::put_le(fid, 0, 4);
+			npy_utils::put_le(fid, offset_cd_end, 8);
+			npy_utils::put_le(fid, 1, 4);
 		}
 
-		return mOut;
+		npy_utils::put_le(fid, 0x06054b50, 4);
+		npy_utils::put_le(fid, 0, 2);
+		npy_utils::put_le(fid, 0, 2);
+		npy_utils::put_le(fid, zip64 ? 0xFFFF : entries.size(), 2);
+		npy_utils::put_le(fid, zip64 ? 0xFFFF : entries.size(), 2);
+		npy_utils::put_le(fid, zip64 ? 0xFFFFFFFF : nbytes_cd, 4);
+		npy_utils::put_le(fid, zip64 ? 0xFFFFFFFF : offset_cd, 4);
+		npy_utils::put_le(fid, 0, 2);
+		fid.close();
 	}
 
-	// get the copy of data corresponding to given range of a full matrix
-	std::vector<double> get_stdVecOutput(int r1, int r2, int c1, int c2, int ch1, int ch2)
+private:
+
+	struct entry
 	{
-		if (r1 == -1) r1 = nr - 1;
-		if (r2 == -1) r2 = nr - 1;
-		if (c1 == -1) c1 = nc - 1;
-		if (c2 == -1) c2 = nc - 1;
-		if (ch1 == -1) ch1 = nch - 1;
-		if (ch2 == -1) ch2 = nch - 1;
+		std::string name;
+		unsigned long long offset;
+		unsigned long long nbytes;
+		unsigned int crc;
+		bool zip64;
+	};
 
-		int nr_new = r2 - r1 + 1;
-		int nc_new = c2 - c1 + 1;
-		int nch_new = ch2 - ch1 + 1;
-		int ndata_per_chan_new = nr_new * nc_new;
-		int ndata_new = ndata_per_chan_new * nch_new;
+	std::ofstream fid;
+	std::vector<entry> entries;
+	bool closed;
+};
 
-		Matkc mOut;
-		mOut.create(env, nr_new, nc_new, nch_new);
-		std::vector<double> vOut(nr_new * nc_new * nch_new);
-		double* temp_out = vOut.data();
 
-		if (nr_new == nr && nc_new == nc)
+// conversion between jagged java arrays (e.g. double[][] or float[][][]) and contiguous
+// native storage. A 2D array arr[i][j] has the shape nrows x ncols and a 3D array arr[i][j][k]
+// the shape nrows x ncols x nchannels. All the inner arrays must have the same length.
+// Each inner array is copied with a single Get/SetXArrayRegion call, inside local frames
+// so that the local references of the rows are freed as they go. The row copies are JNI calls,
+// so they run on the calling thread (its JNIEnv cannot be used by the workers of
+// jni_parallel_for). Conversions to or from the col major Matkc layout
+// (idx = k * nrows * ncols + j * nrows + i) are done in parallel after all the rows have been copied.
+// T_arr should be of type jdoubleArray, jintArray, etc. and T the corresponding primitive type.
+class jJagged
+{
+public:
+
+	jJagged() = delete;
+
+	jJagged(JNIEnv* env_)
+	{
+		env = env_;
+	}
+
+	// shape of a 2D (is_3d false, nchannels = 1) or 3D java array, given by its first row
+	template<class T_arr>
+	bool get_shape(jobjectArray arr, int &nrows, int &ncols, int &nchannels, bool is_3d)
+	{
+		nrows = env->GetArrayLength(arr);
+		ncols = 1; nchannels = 1;
+		if (nrows == 0) return true;
+		jobject row = env->GetObjectArrayElement(arr, 0);
+		ncols = row == nullptr ? 0 : env->GetArrayLength(static_cast<jarray>(row));
+		if (is_3d && ncols > 0)
 		{
-			std::copy(ptr_data + ch1 * ndpch, ptr_data + ch1 * ndpch + ndata_new, temp_out);
+			jobject elem = env->GetObjectArrayElement(static_cast<jobjectArray>(row), 0);
+			nchannels = elem == nullptr ? 0 : env->GetArrayLength(static_cast<jarray>(elem));
+			env->DeleteLocalRef(elem);
 		}
-		else if (nr_new == nr && nc_new != nc)
+		env->DeleteLocalRef(row);
+		if (ncols == 0 || nchannels == 0)
 		{
-			int cc = 0;
-			int idx_temp;
-			for (int k = 0; k<nch_new; k++)
-			{
-				idx_temp = (k + ch1) * ndpch + c1*nr;
-				std::copy(ptr_data + idx_temp, ptr_data + idx_temp + ndata_per_chan_new, temp_out + cc);
-				cc += nr_new * nc_new;
-			}
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: the inner arrays of a jagged array must not be null or empty.");
+			return false;
 		}
-		else
+		return true;
+	}
+
+	// copy a 2D or 3D java array of the given shape (see get_shape()) into dst, row major interleaved
+	// (dst[i * ncols * nchannels + j * nchannels + k]), with one region copy per inner array
+	template<class T_arr, class T>
+	bool read_rows(jobjectArray arr, T* dst, int nrows, int ncols, int nchannels, bool is_3d)
+	{
+		jni_utils ju(env);
+		size_t len_row = static_cast<size_t>(ncols) * nchannels;
+		for (int i0 = 0; i0 < nrows; i0 += nrows_per_frame)
 		{
-			int cc = 0;
-			int idx_temp;
-			for (int k = 0; k<nch_new; k++)
-				for (int j = 0; j<nc_new; j++)
+			int i1 = std::min(i0 + nrows_per_frame, nrows);
+			if (env->PushLocalFrame(is_3d ? 2 : i1 - i0) != 0) return false;
+			for (int i = i0; i < i1; i++)
+			{
+				jobject row = env->GetObjectArrayElement(arr, i);
+				if (row == nullptr || env->GetArrayLength(static_cast<jarray>(row)) != ncols)
 				{
-					idx_temp = (k + ch1) * ndpch + (j + c1) * nr + r1;
-					std::copy(ptr_data + idx_temp, ptr_data + idx_temp + nr_new, temp_out + cc);
-					cc += nr_new;
+					env->PopLocalFrame(nullptr);
+					ju.throw_exception("ERROR from JNI: all the rows of a jagged array must have the same length.");
+					return false;
 				}
+				if (!is_3d)
+					jArrayOps<T_arr>::GetRegion(env, static_cast<T_arr>(row), 0, ncols, dst + len_row * i);
+				else
+				{
+					for (int j = 0; j < ncols; j++)
+					{
+						T_arr elem = static_cast<T_arr>(env->GetObjectArrayElement(static_cast<jobjectArray>(row), j));
+						if (elem == nullptr || env->GetArrayLength(elem) != nchannels)
+						{
+							env->PopLocalFrame(nullptr);
+							ju.throw_exception("ERROR from JNI: all the innermost arrays of a jagged array must have the same length.");
+							return false;
+						}
+						jArrayOps<T_arr>::GetRegion(env, elem, 0, nchannels, dst + len_row * i + static_cast<size_t>(j) * nchannels);
+						env->DeleteLocalRef(elem);
+					}
+					env->DeleteLocalRef(row);
+				}
+			}
+			env->PopLocalFrame(nullptr);
 		}
-
-		return vOut;
+		return true;
 	}
 
-	Matkc get(int r1, int r2, int c1, int c2)
+	// copy a 2D java array into out, row major (out[i * ncols + j]) or col major (out[j * nrows + i])
+	template<class T_arr, class T>
+	bool read_2d(jobjectArray arr, std::vector<T> &out, int &nrows, int &ncols, bool colMajor = false, int nthreads = 0)
 	{
-		return get(r1, r2, c1, c2, 0, -1);
+		int nchannels;
+		return read<T_arr>(arr, out, nrows, ncols, nchannels, false, colMajor, nthreads);
 	}
 
-	std::vector<double> get_stdVecOutput(int r1, int r2, int c1, int c2)
-	{
-		return get_stdVecOutput(r1, r2, c1, c2, 0, -1);
-	}
-	
-	// assume k=0
-	double get(int i, int j)
+	// copy a 3D java array into out, row major interleaved (out[i * ncols * nchannels + j * nchannels + k])
+	// or col major with one channel after another (out[k * nrows * ncols + j * nrows + i])
+	template<class T_arr, class T>
+	bool read_3d(jobjectArray arr, std::vector<T> &out, int &nrows, int &ncols, int &nchannels, bool colMajor = false, int nthreads = 0)
 	{
-		return ptr_data[j * nr + i];
+		return read<T_arr>(arr, out, nrows, ncols, nchannels, true, colMajor, nthreads);
 	}
 
-	// get from a linear index
-	double get(int lin_index)
+	// create a new 2D java array from data (row major or col major, as above)
+	template<class T_arr, class T>
+	jobjectArray write_2d(const T* data, int nrows, int ncols, bool colMajor = false, int nthreads = 0)
 	{
-		return ptr_data[lin_index];
+		return write<T_arr>(data, nrows, ncols, 1, false, colMajor, nthreads);
 	}
 
-	// get first element
-	double get()
+	// create a new 3D java array from data (row major interleaved or col major, as above)
+	template<class T_arr, class T>
+	jobjectArray write_3d(const T* data, int nrows, int ncols, int nchannels, bool colMajor = false, int nthreads = 0)
 	{
-		return ptr_data[0];
+		return write<T_arr>(data, nrows, ncols, nchannels, true, colMajor, nthreads);
 	}
 
-	// get a discontinuous submatrix of the current matrix.
-	Matkc get(std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
+	// parallel conversion between the row major interleaved layout and the col major
+	// layout with one channel after another (to_colMajor false for the opposite direction),
+	// also casting from T_src to T_dst
+	template<class T_src, class T_dst>
+	static void convert_layout(const T_src* src, T_dst* dst, int nrows, int ncols, int nchannels, bool to_colMajor, int nthreads = 0)
 	{
-		int nr_new = row_indices.size();
-		int nc_new = col_indices.size();
-		int nch_new = channel_indices.size();
-		Matkc mOut;
-		mOut.create(env, nr_new, nc_new, nch_new);
-		double* temp_out = mOut.ptr_data;
-
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]];
-
-		return mOut;
+		size_t ndpch = static_cast<size_t>(nrows) * ncols;
+		size_t nc_mult_nch = static_cast<size_t>(ncols) * nchannels;
+		// one task per (channel, column)
+		jni_parallel_for(static_cast<size_t>(nchannels) * ncols, [&](size_t idx_begin, size_t idx_end)
+		{
+			for (size_t idx = idx_begin; idx < idx_end; idx++)
+			{
+				size_t k = idx / ncols, j = idx % ncols;
+				size_t idx_colMajor = k * ndpch + j * nrows, idx_rowMajor = j * nchannels + k;
+				if (to_colMajor)
+					for (int i = 0; i < nrows; i++)
+						dst[idx_colMajor + i] = static_cast<T_dst>(src[idx_rowMajor + i * nc_mult_nch]);
+				else
+					for (int i = 0; i < nrows; i++)
+						dst[idx_rowMajor + i * nc_mult_nch] = static_cast<T_dst>(src[idx_colMajor + i]);
+			}
+		}, nthreads, 16);
 	}
 
-	// get a discontinuous submatrix of the current matrix.
-	std::vector<double> get_stdVecOutput(std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
-	{
-		int nr_new = row_indices.size();
-		int nc_new = col_indices.size();
-		int nch_new = channel_indices.size();
-		std::vector<double> vOut(nr_new * nc_new * nch_new);
-		double* temp_out = vOut.data();
+private:
 
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]];
+	JNIEnv* env;
 
-		return vOut;
-	}
+	// number of rows handled per local frame
+	static const int nrows_per_frame = 256;
 
-	Matkc get_row(int row_index)
+	template<class T_arr, class T>
+	bool read(jobjectArray arr, std::vector<T> &out, int &nrows, int &ncols, int &nchannels, bool is_3d, bool colMajor, int nthreads)
 	{
-		return get(row_index, row_index, 0, -1, 0, -1);
+		if (!get_shape<T_arr>(arr, nrows, ncols, nchannels, is_3d)) return false;
+		size_t nd = static_cast<size_t>(nrows) * ncols * nchannels;
+		out.resize(nd);
+		if (!colMajor)
+			return read_rows<T_arr>(arr, out.data(), nrows, ncols, nchannels, is_3d);
+		std::vector<T> rowMajor(nd);
+		if (!read_rows<T_arr>(arr, rowMajor.data(), nrows, ncols, nchannels, is_3d)) return false;
+		convert_layout(rowMajor.data(), out.data(), nrows, ncols, nchannels, true, nthreads);
+		return true;
 	}
 
-	std::vector<double> get_row_stdVecOutput(int row_index)
+	template<class T_arr, class T>
+	jobjectArray write(const T* data, int nrows, int ncols, int nchannels, bool is_3d, bool colMajor, int nthreads)
 	{
-		return get_stdVecOutput(row_index, row_index, 0, -1, 0, -1);
+		std::vector<T> rowMajor;
+		if (colMajor)
+		{
+			rowMajor.resize(static_cast<size_t>(nrows) * ncols * nchannels);
+			convert_layout(data, rowMajor.data(), nrows, ncols, nchannels, false, nthreads);
+			data = rowMajor.data();
+		}
+		size_t len_row = static_cast<size_t>(ncols) * nchannels;
+
+		std::string sig_elem = get_signature_jtype<T_arr>("");
+		jclass cls_elem = env->FindClass(sig_elem.c_str());
+		jclass cls_row = (is_3d && cls_elem != nullptr) ? env->FindClass(("[" + sig_elem).c_str()) : cls_elem;
+		jobjectArray arr = cls_row == nullptr ? nullptr : env->NewObjectArray(nrows, cls_row, nullptr);
+
+		// on any failure (a java exception is then pending) stop, and free the local references
+		// below, since a thread attached from native code may never free them otherwise
+		bool ok = arr != nullptr;
+		for (int i0 = 0; ok && i0 < nrows; i0 += nrows_per_frame)
+		{
+			int i1 = std::min(i0 + nrows_per_frame, nrows);
+			if (env->PushLocalFrame(is_3d ? 3 : i1 - i0) != 0) { ok = false; break; }
+			for (int i = i0; ok && i < i1; i++)
+			{
+				if (!is_3d)
+				{
+					T_arr row = jArrayOps<T_arr>::New(env, ncols);
+					if (row == nullptr) { ok = false; break; }
+					jArrayOps<T_arr>::SetRegion(env, row, 0, ncols, data + len_row * i);
+					env->SetObjectArrayElement(arr, i, row);
+				}
+				else
+				{
+					jobjectArray row = env->NewObjectArray(ncols, cls_elem, nullptr);
+					if (row == nullptr) { ok = false; break; }
+					for (int j = 0; j < ncols; j++)
+					{
+						T_arr elem = jArrayOps<T_arr>::New(env, nchannels);
+						if (elem == nullptr) { ok = false; break; }
+						jArrayOps<T_arr>::SetRegion(env, elem, 0, nchannels, data + len_row * i + static_cast<size_t>(j) * nchannels);
+						env->SetObjectArrayElement(row, j, elem);
+						env->DeleteLocalRef(elem);
+					}
+					if (ok) env->SetObjectArrayElement(arr, i, row);
+					env->DeleteLocalRef(row);
+				}
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		if (is_3d && cls_row != nullptr) env->DeleteLocalRef(cls_row);
+		if (cls_elem != nullptr) env->DeleteLocalRef(cls_elem);
+		if (!ok)
+		{
+			if (arr != nullptr) env->DeleteLocalRef(arr);
+			return nullptr;
+		}
+		return arr;
 	}
+};
 
-	Matkc get_rows(int start_index, int end_index)
+
+// typed view (float, int, long long, double, etc.) over the bytes of a java byte[] or of a
+// direct java.nio.ByteBuffer, e.g. binary payloads received from the network, without first
+// copying them into a std::vector<signed char>.
+// The view points directly into the java memory when the data is in the byte order of the host
+// and suitably aligned for T. Otherwise the elements are copied once into an aligned buffer
+// of the view (byte-swapped if needed) and the java array is released straight away.
+// A byte[] is pinned (GetByteArrayElements, or GetPrimitiveArrayCritical if critical is true,
+// in which case no other JNI call may be made until release()) until release() or destruction.
+// The java data is never modified through the view.
+template<class T>
+class jByteView
+{
+public:
+
+	jByteView() = delete;
+
+	jByteView(JNIEnv* env_)
 	{
-		return get(start_index, end_index, 0, -1, 0, -1);
+		env = env_;
+		arr = nullptr;
+		ptr_bytes = nullptr;
+		ptr = nullptr;
+		n = 0;
+		critical = false;
+		zero_copy = false;
 	}
 
-	std::vector<double> get_rows_stdVecOutput(int start_index, int end_index)
+	~jByteView()
 	{
-		return get_stdVecOutput(start_index, end_index, 0, -1, 0, -1);
+		release();
 	}
 
-	// take a discontinuous submatrix in the form of rows
-	Matkc get_rows(std::vector<int> row_indices)
+	// view the bytes of arr from offset_bytes to the end (trailing bytes that do not make
+	// a whole element are ignored). big_endian gives the byte order of the payload.
+	// returns false if the array could not be pinned (OutOfMemoryError is pending).
+	bool wrap(jbyteArray arr_, size_t offset_bytes = 0, bool big_endian = false, bool critical_ = false)
 	{
-		int nr_new = row_indices.size();
-		Matkc mOut;
-		mOut.create(env, nr_new, nc, nch);
-		double* temp_out = mOut.ptr_data;
+		release();
+		size_t nbytes = env->GetArrayLength(arr_);
+		if (offset_bytes > nbytes)
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: offset_bytes is past the end of the byte array.");
+			return false;
+		}
+		arr = arr_;
+		critical = critical_;
+		if (critical)
+			ptr_bytes = static_cast<jbyte*>(env->GetPrimitiveArrayCritical(arr, 0));
+		else
+			ptr_bytes = env->GetByteArrayElements(arr, 0);
+		if (ptr_bytes == nullptr) return false; // OutOfMemoryError pending
+		pin_bytes = jPinRegistry::pin(nbytes, critical);
+		set_view(reinterpret_cast<const char*>(ptr_bytes) + offset_bytes, (nbytes - offset_bytes) / sizeof(T), big_endian);
+		if (!zero_copy) release_array();
+		return true;
+	}
 
-		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[cc++] = ptr_data[k * ndpch + j * nr + row_indices[i]];
+	// view the bytes of a direct java.nio.ByteBuffer from offset_bytes to its capacity
+	bool wrap_direct(jobject buffer, size_t offset_bytes = 0, bool big_endian = false)
+	{
+		release();
+		const char* address = static_cast<const char*>(env->GetDirectBufferAddress(buffer));
+		jlong nbytes = env->GetDirectBufferCapacity(buffer);
+		if (address == nullptr || nbytes < 0 || offset_bytes > static_cast<size_t>(nbytes))
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: not a direct buffer, or offset_bytes is past its end.");
+			return false;
+		}
+		set_view(address + offset_bytes, (static_cast<size_t>(nbytes) - offset_bytes) / sizeof(T), big_endian);
+		return true;
+	}
 
-		return mOut;
+	void release()
+	{
+		release_array();
+		ptr = nullptr;
+		n = 0;
+		zero_copy = false;
+		scratch.clear();
 	}
 
-	std::vector<double> get_rows_stdVecOutput(std::vector<int> row_indices)
+	const T* data() const { return ptr; }
+	size_t size() const { return n; }
+	const T& operator[](size_t idx) const { return ptr[idx]; }
+	const T* begin() const { return ptr; }
+	const T* end() const { return ptr + n; }
+
+	// true if the view points directly into the java memory
+	bool is_zero_copy() const { return zero_copy; }
+
+	// copy (and convert) all the elements into dst
+	template<class T_out>
+	void copy_to(T_out* dst) const
 	{
-		int nr_new = row_indices.size();
-		std::vector<double> temp_out(nr_new * nc * nch);
+		if (std::is_same<T, T_out>::value)
+			std::memcpy(dst, ptr, n * sizeof(T));
+		else
+			for (size_t i = 0; i < n; i++)
+				dst[i] = static_cast<T_out>(ptr[i]);
+	}
 
-		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[cc++] = ptr_data[k * ndpch + j * nr + row_indices[i]];
+private:
 
-		return temp_out;
+	JNIEnv* env;
+	jbyteArray arr;
+	jbyte* ptr_bytes;
+	jPinRegistry::pin pin_bytes;
+	const T* ptr;
+	size_t n;
+	bool critical;
+	bool zero_copy;
+	std::vector<T> scratch;
+
+	void set_view(const char* p, size_t n_, bool big_endian)
+	{
+		n = n_;
+		bool needs_swap = big_endian == npy_utils::is_little_endian_host();
+		bool aligned = reinterpret_cast<uintptr_t>(p) % alignof(T) == 0;
+		zero_copy = !needs_swap && aligned;
+		if (zero_copy)
+		{
+			ptr = reinterpret_cast<const T*>(p);
+			return;
+		}
+		scratch.resize(n);
+		std::memcpy(scratch.data(), p, n * sizeof(T));
+		if (needs_swap && sizeof(T) > 1)
+			npy_utils::swap_bytes(reinterpret_cast<char*>(scratch.data()), n, sizeof(T));
+		ptr = scratch.data();
 	}
 
-	// take a continuous submatrix in the form of a column
-	Matkc get_col(int col_index)
+	void release_array()
 	{
-		return get(0, -1, col_index, col_index, 0, -1);
+		if (ptr_bytes == nullptr) return;
+		if (critical)
+			env->ReleasePrimitiveArrayCritical(arr, ptr_bytes, JNI_ABORT);
+		else
+			env->ReleaseByteArrayElements(arr, ptr_bytes, JNI_ABORT);
+		pin_bytes.release();
+		ptr_bytes = nullptr;
 	}
+};
 
-	std::vector<double> get_col_stdVecOutput(int col_index)
+// lock-free ring buffer of fixed-size slots laid out in a direct java.nio.ByteBuffer, so that
+// java and native code can stream messages (frames, telemetry, ...) to each other without a
+// JNI call or an allocation per message. Single producer / single consumer (spsc) or
+// multiple producers / single consumer (mpsc).
+// Layout (native byte order, all indices are 64 bit and only ever increase):
+//	[0]    magic 0x4A524231 ("JRB1", int), mode (int: 0 spsc, 1 mpsc)
+//	[8]    capacity (number of slots, a power of two), [16] slot_size (payload bytes per slot)
+//	[64]   tail: next position to claim (written by the producers)
+//	[128]  head: next position to read (written by the consumer)
+//	[192]  consumer_waiting (int), data_signal (int): futex word the consumer sleeps on
+//	[256]  producers_waiting (int), space_signal (int): futex word the producers sleep on
+//	[320]  slots. Slot of position pos: 320 + (pos & (capacity - 1)) * stride, where
+//	       stride = slot_size + 16 rounded up to 8. Each slot is [seq (long)][length (int)][pad][payload]
+// A slot is free for position pos when seq == pos, holds a published message of position pos
+// when seq == pos + 1, and is handed back by the consumer by setting seq = pos + capacity.
+// head, tail and the wait words each have their own cache line.
+//
+// Java side of the protocol, with LONG = MethodHandles.byteBufferViewVarHandle(long[].class,
+// ByteOrder.nativeOrder()) and INT likewise:
+//	producer: pos = tail (spsc: its own copy; mpsc: LONG.getVolatile(buf, 64));
+//	          if ((long) LONG.getAcquire(buf, slot(pos)) != pos) the ring is full;
+//	          mpsc only: if (!LONG.compareAndSet(buf, 64, pos, pos + 1)) retry;
+//	          write the payload at slot(pos) + 16 and its length at slot(pos) + 8;
+//	          LONG.setRelease(buf, slot(pos), pos + 1); spsc only: LONG.setRelease(buf, 64, pos + 1);
+//	          VarHandle.fullFence(); if ((int) INT.getVolatile(buf, 192) != 0) call a native that
+//	          does jRingBuffer::wake_consumer (the only JNI call, and only when the consumer sleeps)
+//	consumer: pos = head; if ((long) LONG.getAcquire(buf, slot(pos)) == pos + 1) read the message,
+//	          LONG.setRelease(buf, slot(pos), pos + capacity); LONG.setRelease(buf, 128, pos + 1);
+//	          VarHandle.fullFence(); if ((int) INT.getVolatile(buf, 256) != 0) call a native that
+//	          does jRingBuffer::wake_producers
+// Batches: claim n slots at once by checking the seq of the last one (slots are handed back in
+// order) and advancing tail by n; publish and hand back each slot of the batch in order.
+// The native waits (claim, wait) use futexes on Linux and short sleeps elsewhere. Java threads
+// cannot sleep on those words, so java consumers/producers should spin, yield or park on their
+// own notification instead.
+class jRingBuffer
+{
+public:
+
+	enum ring_mode { spsc = 0, mpsc = 1 };
+
+	enum
 	{
-		return get_stdVecOutput(0, -1, col_index, col_index, 0, -1);
-	}
+		off_magic = 0, off_mode = 4, off_capacity = 8, off_slot_size = 16,
+		off_tail = 64, off_head = 128,
+		off_consumer_waiting = 192, off_data_signal = 196,
+		off_producers_waiting = 256, off_space_signal = 260,
+		header_bytes = 320, slot_header_bytes = 16,
+		magic = 0x4A524231
+	};
 
-	// take a continuous submatrix in the form of cols
-	Matkc get_cols(int start_index, int end_index)
+	jRingBuffer() : base(nullptr), capacity(0), slot_size(0), stride(0), mode(spsc), mem(nullptr), buffer(nullptr), vm(nullptr) {}
+
+	jRingBuffer(const jRingBuffer&) = delete;
+	jRingBuffer& operator=(const jRingBuffer&) = delete;
+
+	~jRingBuffer()
 	{
-		return get(0, -1, start_index, end_index, 0, -1);
+		JNIEnv* env = nullptr;
+		if (buffer != nullptr && vm != nullptr && vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK)
+			env->DeleteGlobalRef(buffer);
+		free(mem);
 	}
 
-	std::vector<double> get_cols_stdVecOutput(int start_index, int end_index)
+	static size_t required_bytes(long long capacity_, long long slot_size_)
 	{
-		return get_stdVecOutput(0, -1, start_index, end_index, 0, -1);
+		return header_bytes + static_cast<size_t>(capacity_) * get_stride(slot_size_);
 	}
 
-	// take a discontinuous submatrix in the form of cols
-	Matkc get_cols(std::vector<int> col_indices)
+	// allocate the ring in native memory and return a direct ByteBuffer over it for java
+	// (local ref). The memory belongs to this object, so it must outlive the java side's use.
+	// capacity is rounded up to a power of two.
+	jobject create_new(JNIEnv* env, long long capacity_, long long slot_size_, ring_mode mode_ = spsc)
 	{
-		int nc_new = col_indices.size();
-		Matkc mOut;
-		mOut.create(env, nr, nc_new, nch);
-		double* temp_out = mOut.ptr_data;
-
-		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[cc++] = ptr_data[k * ndpch + col_indices[j] * nr + i];
+		capacity_ = round_up_pow2(capacity_);
+		size_t nbytes = required_bytes(capacity_, slot_size_);
+		free(mem);
+		base = nullptr;
+		mem = malloc(nbytes + 63);
+		if (mem == nullptr)
+		{
+			jclass cls_oom = env->FindClass("java/lang/OutOfMemoryError");
+			env->ThrowNew(cls_oom, "ERROR from JNI: could not allocate the ring buffer.");
+			env->DeleteLocalRef(cls_oom);
+			return nullptr;
+		}
+		unsigned char* p = static_cast<unsigned char*>(mem);
+		p += (64 - reinterpret_cast<uintptr_t>(p) % 64) % 64;
+		if (!attach(p, nbytes, true, capacity_, slot_size_, mode_))
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: invalid capacity or slot size for the ring buffer.");
+			return nullptr;
+		}
+		return env->NewDirectByteBuffer(p, static_cast<jlong>(nbytes));
+	}
 
-		return mOut;
+	// use a direct ByteBuffer allocated on the java side (e.g. ByteBuffer.allocateDirect(n + 63)
+	// .alignedSlice(64)), keeping a global ref to it. With init the ring is initialized
+	// with the given capacity, slot_size and mode; otherwise they are read from the buffer.
+	bool wrap(JNIEnv* env, jobject buffer_, bool init, long long capacity_ = 0, long long slot_size_ = 0, ring_mode mode_ = spsc)
+	{
+		jni_utils ju(env);
+		unsigned char* p = static_cast<unsigned char*>(env->GetDirectBufferAddress(buffer_));
+		jlong nbytes = env->GetDirectBufferCapacity(buffer_);
+		if (p == nullptr || reinterpret_cast<uintptr_t>(p) % 64 != 0 || nbytes < header_bytes)
+		{
+			ju.throw_exception("ERROR from JNI: the ring buffer needs a direct buffer aligned to 64 bytes (e.g. alignedSlice(64)).");
+			return false;
+		}
+		if (!attach(p, static_cast<size_t>(nbytes), init, capacity_, slot_size_, mode_))
+		{
+			ju.throw_exception("ERROR from JNI: the direct buffer is not a ring buffer, or is too small for it.");
+			return false;
+		}
+		if (buffer != nullptr) env->DeleteGlobalRef(buffer);
+		buffer = env->NewGlobalRef(buffer_);
+		env->GetJavaVM(&vm);
+		return true;
 	}
 
-	std::vector<double> get_cols_stdVecOutput(std::vector<int> col_indices)
+	// over any suitably aligned memory (e.g. shared memory)
+	bool attach(void* p, size_t nbytes, bool init, long long capacity_ = 0, long long slot_size_ = 0, ring_mode mode_ = spsc)
 	{
-		int nc_new = col_indices.size();
-		std::vector<double> temp_out(nr * nc_new * nch);
+		unsigned char* b = static_cast<unsigned char*>(p);
+		if (init)
+		{
+			if (capacity_ <= 0 || (capacity_ & (capacity_ - 1)) != 0 || slot_size_ < 0 || required_bytes(capacity_, slot_size_) > nbytes)
+				return false;
+			memset(b, 0, header_bytes);
+			*reinterpret_cast<int32_t*>(b + off_mode) = mode_;
+			*reinterpret_cast<int64_t*>(b + off_capacity) = capacity_;
+			*reinterpret_cast<int64_t*>(b + off_slot_size) = slot_size_;
+			for (long long i = 0; i < capacity_; i++)
+				*reinterpret_cast<int64_t*>(b + header_bytes + i * get_stride(slot_size_)) = i;
+			std::atomic_thread_fence(std::memory_order_release);
+			reinterpret_cast<std::atomic<int32_t>*>(b + off_magic)->store(magic, std::memory_order_release);
+		}
+		else
+		{
+			if (reinterpret_cast<std::atomic<int32_t>*>(b + off_magic)->load(std::memory_order_acquire) != magic) return false;
+			mode_ = static_cast<ring_mode>(*reinterpret_cast<int32_t*>(b + off_mode));
+			capacity_ = *reinterpret_cast<int64_t*>(b + off_capacity);
+			slot_size_ = *reinterpret_cast<int64_t*>(b + off_slot_size);
+			if (required_bytes(capacity_, slot_size_) > nbytes) return false;
+		}
+		base = b;
+		capacity = capacity_;
+		slot_size = slot_size_;
+		stride = get_stride(slot_size_);
+		mode = mode_;
+		return true;
+	}
 
-		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[cc++] = ptr_data[k * ndpch + col_indices[j] * nr + i];
+	//------------------------- producer side -------------------------
 
-		return temp_out;
+	// claim n consecutive slots; returns the position of the first one, or -1 if there is not
+	// enough free space (n must be at most the capacity). Fill them with slot()/set_length(),
+	// then publish().
+	long long try_claim(int n = 1)
+	{
+		if (n <= 0 || n > capacity) return -1;
+		std::atomic<int64_t>& t = idx(off_tail);
+		int64_t pos = t.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			// the consumer hands slots back in order, so checking the last one is enough
+			if (seq(pos + n - 1).load(std::memory_order_acquire) != pos + n - 1)
+			{
+				int64_t pos_now = t.load(std::memory_order_relaxed);
+				if (pos_now == pos) return -1;
+				pos = pos_now;
+				continue;
+			}
+			if (mode == spsc)
+			{
+				t.store(pos + n, std::memory_order_relaxed);
+				return pos;
+			}
+			if (t.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+				return pos;
+		}
 	}
 
-	// take a continuous submatrix in the form of a channel
-	Matkc get_channel(int channel_index)
+	// as try_claim, waiting for space for up to timeout_ns (< 0: forever)
+	long long claim(int n = 1, long long timeout_ns = -1)
 	{
-		return get(0, -1, 0, -1, channel_index, channel_index);
+		return wait_for([&]() { return try_claim(n); }, off_producers_waiting, off_space_signal, true, timeout_ns);
 	}
 
-	std::vector<double> get_channel_stdVecOutput(int channel_index)
+	void* slot(long long pos) { return slot_base(pos) + slot_header_bytes; }
+	void set_length(long long pos, int32_t len) { *reinterpret_cast<int32_t*>(slot_base(pos) + 8) = len; }
+
+	// publish n claimed slots starting at pos (in order) and wake the consumer if it sleeps
+	void publish(long long pos, int n = 1)
 	{
-		return get_stdVecOutput(0, -1, 0, -1, channel_index, channel_index);
+		for (int i = 0; i < n; i++)
+			seq(pos + i).store(pos + i + 1, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (word(off_consumer_waiting).load(std::memory_order_relaxed) != 0)
+			wake(off_data_signal);
 	}
 
-	// take a continuous submatrix in the form of channels
-	Matkc get_channels(int start_index, int end_index)
+	// copy one message in; false if it does not fit in a slot or the ring is full
+	bool try_write(const void* data, int32_t len)
 	{
-		return get(0, -1, 0, -1, start_index, end_index);
+		if (len < 0 || len > slot_size) return false;
+		long long pos = try_claim(1);
+		if (pos < 0) return false;
+		memcpy(slot(pos), data, len);
+		set_length(pos, len);
+		publish(pos, 1);
+		return true;
 	}
 
-	std::vector<double> get_channels_stdVecOutput(int start_index, int end_index)
+	//------------------------- consumer side -------------------------
+
+	// number of published messages (at most max_n) from the position returned in pos.
+	// Read them with slot()/length(), then hand them back with release().
+	int poll(long long &pos, int max_n = 1)
 	{
-		return get_stdVecOutput(0, -1, 0, -1, start_index, end_index);
+		pos = idx(off_head).load(std::memory_order_relaxed);
+		int n = 0;
+		while (n < max_n && seq(pos + n).load(std::memory_order_acquire) == pos + n + 1)
+			n++;
+		return n;
 	}
 
-	// take a discontinuous submatrix in the form of cols
-	Matkc get_channels(std::vector<int> channel_indices)
+	// as poll, waiting for at least one message for up to timeout_ns (< 0: forever)
+	int wait(long long &pos, int max_n = 1, long long timeout_ns = -1)
 	{
-		int nch_new = channel_indices.size();
-		Matkc mOut;
-		mOut.create(env, nr, nc, nch_new);
-		double* temp_out = mOut.ptr_data;
+		int n = 0;
+		wait_for([&]() { n = poll(pos, max_n); return n > 0 ? pos : -1LL; }, off_consumer_waiting, off_data_signal, false, timeout_ns);
+		return n;
+	}
 
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + j * nr + i];
+	int32_t length(long long pos) { return *reinterpret_cast<int32_t*>(slot_base(pos) + 8); }
 
-		return mOut;
+	// hand n read slots back to the producers and wake those that wait for space
+	void release(long long pos, int n = 1)
+	{
+		for (int i = 0; i < n; i++)
+			seq(pos + i).store(pos + i + capacity, std::memory_order_release);
+		idx(off_head).store(pos + n, std::memory_order_release);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (word(off_producers_waiting).load(std::memory_order_relaxed) != 0)
+			wake(off_space_signal);
 	}
 
-	std::vector<double> get_channels_stdVecOutput(std::vector<int> channel_indices)
+	// call fn(const void* data, int32_t len) on up to max_n messages; returns how many
+	template<class F>
+	int consume(F fn, int max_n = 64)
 	{
-		int nch_new = channel_indices.size();
-		std::vector<double> temp_out(nr * nc * nch_new);
-
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + j * nr + i];
-
-		return temp_out;
+		long long pos;
+		int n = poll(pos, max_n);
+		for (int i = 0; i < n; i++)
+			fn(static_cast<const void*>(slot(pos + i)), length(pos + i));
+		if (n > 0) release(pos, n);
+		return n;
 	}
-	
-	// use the entire given input matrix to set part of this matrix with the given range
-	void set(Matkc mIn, int r1, int r2, int c1, int c2, int ch1, int ch2)
+
+	// copy one message out (dst must hold slot_size bytes); false if there is none
+	bool try_read(void* dst, int32_t &len)
 	{
-		if (r1 == -1) r1 = nr - 1;
-		if (r2 == -1) r2 = nr - 1;
-		if (c1 == -1) c1 = nc - 1;
-		if (c2 == -1) c2 = nc - 1;
-		if (ch1 == -1) ch1 = nch - 1;
-		if (ch2 == -1) ch2 = nch - 1;
+		long long pos;
+		if (poll(pos, 1) == 0) return false;
+		len = length(pos);
+		memcpy(dst, slot(pos), len);
+		release(pos, 1);
+		return true;
+	}
 
-		int nr_new = r2 - r1 + 1;
-		int nc_new = c2 - c1 + 1;
-		int nch_new = ch2 - ch1 + 1;
-		int ndata_per_chan_new = nr_new * nc_new;
-		int ndata_new = ndata_per_chan_new * nch_new;
+	//------------------------- misc -------------------------
 
-		if (nr_new != mIn.nr || nc_new != mIn.nc || nch_new != mIn.nch)
-		{
-			jni_utils ju(env);
-			ju.throw_exception("ERROR from JNI: the input matrix and the range specified do not match.");
-			return;
-		}			
+	// for natives called by java producers / consumers that found the other side waiting
+	void wake_consumer() { wake(off_data_signal); }
+	void wake_producers() { wake(off_space_signal); }
 
-		double* temp_in = mIn.ptr_data;
-		double* temp_out = ptr_data;
+	long long get_capacity() const { return capacity; }
+	long long get_slot_size() const { return slot_size; }
+	ring_mode get_mode() const { return mode; }
+	// slots claimed and not yet handed back (a snapshot). This includes the slots that the
+	// producers have claimed but not published yet, so it can be more than poll() returns.
+	long long size() { return idx(off_tail).load(std::memory_order_relaxed) - idx(off_head).load(std::memory_order_relaxed); }
 
-		if (nr_new == nr && nc_new == nc)
+private:
+
+	unsigned char* base;
+	long long capacity, slot_size, stride;
+	ring_mode mode;
+	void* mem; // when allocated by create_new
+	jobject buffer; // global ref when wrapping a java buffer
+	JavaVM* vm;
+
+	static long long get_stride(long long slot_size_) { return (slot_size_ + slot_header_bytes + 7) / 8 * 8; }
+
+	static long long round_up_pow2(long long n)
+	{
+		long long p = 1;
+		while (p < n) p <<= 1;
+		return p;
+	}
+
+	unsigned char* slot_base(long long pos) { return base + header_bytes + (pos & (capacity - 1)) * stride; }
+	std::atomic<int64_t>& seq(long long pos) { return *reinterpret_cast<std::atomic<int64_t>*>(slot_base(pos)); }
+	std::atomic<int64_t>& idx(int off) { return *reinterpret_cast<std::atomic<int64_t>*>(base + off); }
+	std::atomic<int32_t>& word(int off) { return *reinterpret_cast<std::atomic<int32_t>*>(base + off); }
+
+	void wake(int off_signal)
+	{
+		word(off_signal).fetch_add(1, std::memory_order_release);
+#ifdef JNI_MODERN_TOOLS_FUTEX
+		syscall(SYS_futex, reinterpret_cast<int32_t*>(base + off_signal), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+	}
+
+	// spin a little, then announce the wait in the waiting word and sleep on the signal word
+	// until try_fn() succeeds (returns >= 0) or the timeout expires (returns -1)
+	template<class F>
+	long long wait_for(F try_fn, int off_waiting, int off_signal, bool counted, long long timeout_ns)
+	{
+		for (int i = 0; i < 64; i++)
 		{
-			std::copy(temp_in, temp_in + ndata_new, temp_out + ch1 * ndpch);
+			long long r = try_fn();
+			if (r >= 0) return r;
 		}
-		else if (nr_new == nr && nc_new != nc)
+		std::chrono::steady_clock::time_point t_end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(timeout_ns < 0 ? 0 : timeout_ns);
+		std::atomic<int32_t>& waiting = word(off_waiting);
+		for (;;)
 		{
-			int cc = 0;
-			for (int k = 0; k<nch_new; k++)
+			int32_t signal = word(off_signal).load(std::memory_order_acquire);
+			if (counted) waiting.fetch_add(1, std::memory_order_seq_cst);
+			else waiting.store(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			long long r = try_fn();
+			if (r < 0)
 			{
-				std::copy(temp_in + cc, temp_in + cc + ndata_per_chan_new, temp_out + (k + ch1) * ndpch + c1*nr);
-				cc += nr_new * nc_new;
+				long long ns_left = std::chrono::duration_cast<std::chrono::nanoseconds>(t_end - std::chrono::steady_clock::now()).count();
+				if (timeout_ns < 0 || ns_left > 0)
+					sleep_on(off_signal, signal, timeout_ns < 0 ? -1 : ns_left);
 			}
+			if (counted) waiting.fetch_sub(1, std::memory_order_relaxed);
+			else waiting.store(0, std::memory_order_relaxed);
+			if (r >= 0) return r;
+			r = try_fn();
+			if (r >= 0) return r;
+			if (timeout_ns >= 0 && std::chrono::steady_clock::now() >= t_end) return -1;
 		}
-		else
-		{
-			int cc = 0;
-			for (int k = 0; k<nch_new; k++)
-				for (int j = 0; j<nc_new; j++)
-				{
-					std::copy(temp_in + cc, temp_in + cc + nr_new, temp_out + (k + ch1) * ndpch + (j + c1) * nr + r1);
-					cc += nr_new;
-				}
-		}
-
 	}
 
-	// use the entire given input matrix (in the form of an
-	// array stored in col major order to set part of this matrix with the given range
-	void set(std::vector<double> data_mIn, int r1, int r2, int c1, int c2, int ch1, int ch2)
+	void sleep_on(int off_signal, int32_t signal, long long timeout_ns)
 	{
-		if (r1 == -1) r1 = nr - 1;
-		if (r2 == -1) r2 = nr - 1;
-		if (c1 == -1) c1 = nc - 1;
-		if (c2 == -1) c2 = nc - 1;
-		if (ch1 == -1) ch1 = nch - 1;
-		if (ch2 == -1) ch2 = nch - 1;
+#ifdef JNI_MODERN_TOOLS_FUTEX
+		struct timespec ts;
+		ts.tv_sec = static_cast<time_t>(timeout_ns / 1000000000LL);
+		ts.tv_nsec = static_cast<long>(timeout_ns % 1000000000LL);
+		syscall(SYS_futex, reinterpret_cast<int32_t*>(base + off_signal), FUTEX_WAIT, signal, timeout_ns < 0 ? nullptr : &ts, nullptr, 0);
+#else
+		// java producers/consumers may not wake us, so poll
+		if (word(off_signal).load(std::memory_order_acquire) == signal)
+			std::this_thread::sleep_for(std::chrono::microseconds(timeout_ns < 0 ? 50 : std::min(50LL, timeout_ns / 1000 + 1)));
+#endif
+	}
+};
 
-		int nr_new = r2 - r1 + 1;
-		int nc_new = c2 - c1 + 1;
-		int nch_new = ch2 - ch1 + 1;
-		int ndata_per_chan_new = nr_new * nc_new;
-		int ndata_new = ndata_per_chan_new * nch_new;
+// wrapper class for Matkc Java matrix class
+class Matkc
+{
+private:
 
-		if (ndata_new != data_mIn.size())
-		{
-			jni_utils ju(env);
-			ju.throw_exception("ERROR from JNI: the input matrix data and the range specified do not match.");
-			return;
-		}			
+	JNIEnv* env;
 
-		double* temp_in = data_mIn.data();
-		double* temp_out = ptr_data;
+	jclass cls;	
+	jobject obj;
 
-		if (nr_new == nr && nc_new == nc)
-		{
-			std::copy(temp_in, temp_in + ndata_new, temp_out + ch1 * ndpch);
-		}
-		else if (nr_new == nr && nc_new != nc)
-		{
-			int cc = 0;
-			for (int k = 0; k<nch_new; k++)
-			{
-				std::copy(temp_in + cc, temp_in + cc + ndata_per_chan_new, temp_out + (k + ch1) * ndpch + c1*nr);
-				cc += nr_new * nc_new;
-			}
-		}
-		else
-		{
-			int cc = 0;
-			for (int k = 0; k<nch_new; k++)
-				for (int j = 0; j<nc_new; j++)
-				{
-					std::copy(temp_in + cc, temp_in + cc + nr_new, temp_out + (k + ch1) * ndpch + (j + c1) * nr + r1);
-					cc += nr_new;
-				}
-		}
-	}
+	jmethodID constructor_methodID;
 
-	// use the entire given input matrix to set part of this matrix with the given range
-	void set(Matkc mIn, int r1, int r2, int c1, int c2)
-	{
-		set(mIn, r1, r2, c1, c2, 0, -1);
-	}
+	jfieldID fieldID_data;	
+	jfieldID fieldID_nr;
+	jfieldID fieldID_nc;
+	jfieldID fieldID_nch;
+	jfieldID fieldID_ndata_per_chan;
+	jfieldID fieldID_ndata;
 
-	void set(std::vector<double> data_mIn, int r1, int r2, int c1, int c2)
+	jdoubleArray data;
+	jdouble* ptr_data;
+	jPinRegistry::pin pin_data;
+
+	jint nr, nc, nch, nd, ndpch;
+
+	void prep_class_info(JNIEnv* env_)
 	{
-		set(data_mIn, r1, r2, c1, c2, 0, -1);
+		env = env_;
+		cls = env->FindClass("KKH/StdLib/Matkc");
+		constructor_methodID = env->GetMethodID(cls, "<init>", "(III)V");
+		fieldID_data = env->GetFieldID(cls, "data", "[D");
+		fieldID_nr = env->GetFieldID(cls, "nr", "I");
+		fieldID_nc = env->GetFieldID(cls, "nc", "I");
+		fieldID_nch = env->GetFieldID(cls, "nch", "I");
+		fieldID_ndata = env->GetFieldID(cls, "ndata", "I");
+		fieldID_ndata_per_chan = env->GetFieldID(cls, "ndata_per_chan", "I");
 	}
 
-	// use the entire given input matrix to set part of this matrix starting with i,j,k position
-	void set(Matkc mIn, int i, int j, int k)
+	void create_new_Java_matrix(int nrows, int ncols, int nchannels)
 	{
-		set(mIn, i, i + mIn.nr - 1, j, j + mIn.nc - 1, k, k + mIn.nch - 1);
+		obj = env->NewObject(cls, constructor_methodID, nrows, ncols, nchannels);
 	}
 
-	// use the entire given input matrix to set part of this matrix starting with i,j,0 position
-	void set(Matkc mIn, int i, int j)
+	void wrap_existing_Java_matrix(jobject obj_matJava)
 	{
-		set(mIn, i, i + mIn.nr - 1, j, j + mIn.nc - 1, 0, mIn.nch - 1);
+		obj = obj_matJava;
 	}
 
-	// use the given value to set an element of this matrix at i,j,k position
-	void set(double val, int i, int j, int k)
+	void prep_data_info()
 	{
-		ptr_data[k * ndpch + j * nr + i] = val;
+		data = (jdoubleArray)env->GetObjectField(obj, fieldID_data);		
+		ptr_data = env->GetDoubleArrayElements(data, 0);
+		nr = env->GetIntField(obj, fieldID_nr);
+		nc = env->GetIntField(obj, fieldID_nc);
+		nch = env->GetIntField(obj, fieldID_nch);
+		ndpch = env->GetIntField(obj, fieldID_ndata_per_chan);
+		nd = env->GetIntField(obj, fieldID_ndata);		
+		pin_data = jPinRegistry::pin(static_cast<size_t>(nd) * sizeof(jdouble), false);
 	}
 
-	// use the given value to set an element of this matrix at i,j,0 position
-	void set(double val, int i, int j)
+	void init_new(JNIEnv* env_, int nrows, int ncols, int nchannels)
 	{
-		ptr_data[j * nr + i] = val;
+		prep_class_info(env_);
+		create_new_Java_matrix(nrows, ncols, nchannels);
+		prep_data_info();
 	}
 
-	// use the given value to set an element of this matrix at lin_index linear position
-	void set(double val, int lin_index)
+	void init_new(JNIEnv* env_, jobject obj_Matkc)
 	{
-		ptr_data[lin_index] = val;
+		prep_class_info(env_);
+		wrap_existing_Java_matrix(obj_Matkc);
+		prep_data_info();
 	}
 
-	// use the given value to set an element of this matrix at 0,0,0 position
-	void set(double val)
+	// pack a java boolean mask of n_expected elements
+	bool load_mask(jbooleanArray mask, jBitmap &bm, int n_expected)
 	{
-		ptr_data[0] = val;
+		bm.from_jbooleanArray(env, mask);
+		if (bm.size() != static_cast<size_t>(n_expected))
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: the length of the mask does not match the size of the matrix.");
+			return false;
+		}
+		return true;
 	}
 
-	// use the entire given input matrix to set part of this matrix specified by row, col and chan indices.
-	void set(Matkc mIn, std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
+	// pack a java boolean mask of either ndpch elements (nch_mask = nch, applied to each channel)
+	// or nd elements (nch_mask = 1, covering all the channels)
+	bool load_mask_elements(jbooleanArray mask, jBitmap &bm, int &nch_mask)
 	{
-		int nr_new = row_indices.size();
-		int nc_new = col_indices.size();
-		int nch_new = channel_indices.size();
-
-		double* temp_in = mIn.ptr_data;
-		double* temp_out = ptr_data;
-
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]] = temp_in[cc++];
+		bm.from_jbooleanArray(env, mask);
+		nch_mask = bm.size() == static_cast<size_t>(ndpch) ? nch : 1;
+		if (bm.size() != static_cast<size_t>(ndpch) && bm.size() != static_cast<size_t>(nd))
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: the length of the mask must be nrows * ncols or nrows * ncols * nchannels.");
+			return false;
+		}
+		return true;
 	}
 
-	void set(std::vector<double> data_mIn, std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
+	// create a new matrix with the shape of the numpy array and stream its data in.
+	// Fortran order arrays have the same layout as Matkc (col major, one channel
+	// after another) so they are read straight into ptr_data without any transpose.
+	void init_new(JNIEnv* env_, npy_reader &reader)
 	{
-		int nr_new = row_indices.size();
-		int nc_new = col_indices.size();
-		int nch_new = channel_indices.size();
+		jni_utils ju(env_);
+		int nrows, ncols, nchannels;
+		if (!reader.get_matrix_shape(nrows, ncols, nchannels))
+		{
+			ju.throw_exception("ERROR from JNI: " + reader.get_error());
+			return;
+		}
 
-		double* temp_in = data_mIn.data();
-		double* temp_out = ptr_data;
+		init_new(env_, nrows, ncols, nchannels);
 
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]] = temp_in[cc++];
+		bool ok;
+		if (reader.is_fortran_order())
+			ok = reader.read_all(ptr_data);
+		else
+		{
+			// C order: the element (i,j,k) is at linear index (i * ncols + j) * nchannels + k
+			int i = 0, j = 0, k = 0;
+			ok = reader.read_chunks<double>([&](unsigned long long, const double* buf, size_t n)
+			{
+				for (size_t ii = 0; ii < n; ii++)
+				{
+					ptr_data[k * ndpch + j * nr + i] = buf[ii];
+					if (++k == nch) { k = 0; if (++j == nc) { j = 0; i++; } }
+				}
+			});
+		}
+
+		if (!ok)
+			ju.throw_exception("ERROR from JNI: " + reader.get_error());
 	}
 
-	// use the entire given input matrix (must be a row vector) to set a row of this matrix
-	void set_row(Matkc mIn, int row_index)
+public:
+
+	~Matkc()
 	{
-		set(mIn, row_index, row_index, 0, -1, 0, -1);
+		if (ptr_data != nullptr)
+			env->ReleaseDoubleArrayElements(data, ptr_data, 0);
 	}
 
-	void set_row(std::vector<double> data_mIn, int row_index)
+	Matkc() : ptr_data(nullptr) {}
+
+	Matkc(const Matkc &m)
 	{
-		set(data_mIn, row_index, row_index, 0, -1, 0, -1);
+		init_new(m.env, m.nrows(), m.ncols(), m.nchannels());
+		std::copy(m.ptr_data, m.ptr_data + nd, ptr_data);
 	}
 
-	// use the entire given input matrix to a range of rows of this matrix
-	void set_rows(Matkc mIn, int start_index, int end_index)
+	// create a new Matkc 
+	void create(JNIEnv* env_, int nrows, int ncols, int nchannels = 1)
 	{
-		set(mIn, start_index, end_index, 0, -1, 0, -1);
+		init_new(env_, nrows, ncols, nchannels);
 	}
-
-	void set_rows(std::vector<double> data_mIn, int start_index, int end_index)
+	
+	// wrap an existing Matkc from Java
+	// no copy of data
+	void create(JNIEnv* env_, jobject obj_Matkc)
 	{
-		set(data_mIn, start_index, end_index, 0, -1, 0, -1);
+		init_new(env_, obj_Matkc);
 	}
 
-	// use the entire given input matrix to set specified rows of this matrix.
-	void set_rows(Matkc mIn, std::vector<int> row_indices)
+	// construct from opencv matrix (make copy of data)
+	// assumes that the opencv matrix is a 2D matrix with a variable number of channels
+	// template param T should be C++ native types such as float, double, int and unsigned char
+	template<class T, int nchannels>
+	void create(JNIEnv* env_, cv::Mat mIn, bool divBy255 = false)
 	{
-		int nr_new = row_indices.size();
+		int nrows = mIn.rows;
+		int ncols = mIn.cols;
 
-		double* temp_in = mIn.ptr_data;
-		double* temp_out = ptr_data;
+		jni_utils ju(env_);
 
-		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[k * ndpch + j * nr + row_indices[i]] = temp_in[cc++];
-	}
+		if (mIn.channels() != nchannels)
+		{
+			ju.throw_exception("ERROR from JNI: Input opencv matrix does not have the same number of channels as the specified template parameter.");
+			return;
+		}			
 
-	void set_rows(std::vector<double> data_mIn, std::vector<int> row_indices)
-	{
-		int nr_new = row_indices.size();
+		if (mIn.dims != 2)
+		{
+			ju.throw_exception("ERROR from JNI: Input opencv matrix is not 2D (with a variable number of channels).");
+			return;
+		}
 
-		double* temp_in = data_mIn.data();
-		double* temp_out = ptr_data;
+		init_new(env_, nrows, ncols, nchannels);
 
+		double divBy;
+		if (divBy255)
+			divBy = 255;
+		else
+			divBy = 1;
+		
 		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr_new; i++)
-					temp_out[k * ndpch + j * nr + row_indices[i]] = temp_in[cc++];
+		for (int k = 0; k < nchannels; k++)
+			for (int j = 0; j < ncols; j++)
+				for (int i = 0; i < nrows; i++)
+					ptr_data[cc++] = static_cast<double>(mIn.at<cv::Vec<T, nchannels>>(i, j)[k]) / divBy;
 	}
 
-	// use the entire given input matrix (must be a col vector) to set a col of this matrix
-	void set_col(Matkc mIn, int col_index)
-	{
-		set(mIn, 0, -1, col_index, col_index, 0, -1);
-	}
+	// construct from opencv IplImage (make copy of data)
+	// assumes that the opencv matrix is a 2D matrix with a variable number of channels
+	// template param T should be C++ native types such as float, double, int and unsigned char
+	template<class T, int nchannels>
+	void create(JNIEnv* env_, IplImage* img_ipl, bool divBy255 = false)
+	{		
+		cv::Mat mIn = cv::cvarrToMat(img_ipl, false);
 
-	void set_col(std::vector<double> data_mIn, int col_index)
-	{
-		set(data_mIn, 0, -1, col_index, col_index, 0, -1);
-	}
+		int nrows = mIn.rows;
+		int ncols = mIn.cols;
 
-	// use the entire given input matrix to a range of cols of this matrix
-	void set_cols(Matkc mIn, int start_index, int end_index)
-	{
-		set(mIn, 0, -1, start_index, end_index, 0, -1);
-	}
+		jni_utils ju(env_);
 
-	void set_cols(std::vector<double> data_mIn, int start_index, int end_index)
-	{
-		set(data_mIn, 0, -1, start_index, end_index, 0, -1);
-	}
+		if (mIn.channels() != nchannels)
+		{
+			ju.throw_exception("ERROR from JNI: Input opencv matrix does not have the same number of channels as the specified template parameter.");
+			return;
+		}
 
-	// use the entire given input matrix to set specified cols of this matrix.
-	void set_cols(Matkc mIn, std::vector<int> col_indices)
-	{
-		int nc_new = col_indices.size();
+		if (mIn.dims != 2)
+		{
+			ju.throw_exception("ERROR from JNI: Input opencv matrix is not 2D (with a variable number of channels).");
+			return;
+		}
 
-		double* temp_in = mIn.ptr_data;
-		double* temp_out = ptr_data;
+		init_new(env_, nrows, ncols, nchannels);
+
+		double divBy;
+		if (divBy255)
+			divBy = 255;
+		else
+			divBy = 0;
 
 		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[k * ndpch + col_indices[j] * nr + i] = temp_in[cc++];
+		for (int k = 0; k < nchannels; k++)
+			for (int j = 0; j < ncols; j++)
+				for (int i = 0; i < nrows; i++)
+					ptr_data[cc++] = static_cast<double>(mIn.at<cv::Vec<T, nchannels>>(i, j)[k]) / divBy;
+	}
+	
+	// construct from std::vector (make copy of data)
+	// template parameter T should be native C++ types such as float, double, int and unsigned char
+	template<class T>
+	void create(JNIEnv* env_, std::vector<T> vIn, int nrows, int ncols, int nchannels, bool transpose = false)
+	{
+		jni_utils ju(env_);
+
+		if (vIn.size() != nrows * ncols * nchannels)
+		{
+			ju.throw_exception("ERROR from JNI: vIn.size() != nrows * ncols * nchannels.");
+			return;
+		}
+			
+		init_new(env_, nrows, ncols, nchannels);
+
+		if (!transpose) // assume the data in the the vector is stored in col major
+		{
+			if (std::is_same<T, double>::value)
+			{
+				std::copy(vIn.begin(), vIn.end(), ptr_data);
+			}
+
+			else
+			{
+				for (int ii = 0; ii < vIn.size(); ii++)
+					ptr_data[ii] = static_cast<double>(vIn[ii]);
+			}
+		}
+		else // assume the data in the the vector is stored in row major
+		{
+			unsigned long long cc = 0;
+			int nch_mult_nc = nch * nc;
+			for (int k = 0; k < nch; k++)
+				for (int j = 0; j < nc; j++)
+					for (int i = 0; i < nr; i++)
+						ptr_data[cc++] = static_cast<double>(vIn[i * nch_mult_nc + j * nch + k]);
+		}			
+	}
+
+	// construct from raw data pointer (make copy of data)
+	// template parameter T should be native C++ types such as float, double, int and unsigned char
+	template<class T>
+	void create(JNIEnv* env_, T* ptr_in, int nrows, int ncols, int nchannels)
+	{
+		init_new(env_, nrows, ncols, nchannels);
+
+		if (std::is_same<T, double>::value)
+			std::copy(ptr_in, ptr_in + nd, ptr_data);
+		else
+		{
+			for (int ii = 0; ii < nd; ii++)
+				ptr_data[ii] = static_cast<double>(ptr_in[ii]);
+		}
+	}
+
+	// construct from a typed view over a java byte[] or direct ByteBuffer (make copy of data,
+	// converted to double), the data being col major with one channel after another
+	template<class T>
+	void create(JNIEnv* env_, const jByteView<T> &view, int nrows, int ncols, int nchannels)
+	{
+		if (view.size() != static_cast<size_t>(nrows) * ncols * nchannels)
+		{
+			jni_utils ju(env_);
+			ju.throw_exception("ERROR from JNI: view.size() != nrows * ncols * nchannels.");
+			return;
+		}
+		init_new(env_, nrows, ncols, nchannels);
+		view.copy_to(ptr_data);
+	}
+
+	// type T should be native C++ types such as float, double and unsigned char
+	template<class T>
+	void create(JNIEnv* env_, arma::Mat<T> mIn)
+	{		
+		int nrows = mIn.n_rows;
+		int ncols = mIn.n_cols;
+		int nchannels = 1;
+
+		init_new(env_, nrows, ncols, nchannels);
+
+		T* ptr_in = mIn.memptr();
+
+		if (std::is_same<T, double>::value)
+			std::copy(ptr_in, ptr_in + nd, ptr_data);
+		else
+		{
+			for (int ii = 0; ii < nd; ii++)
+				ptr_data[ii] = static_cast<double>(ptr_in[ii]);
+		}
+	}
+
+	// type T should be native C++ types such as float, double and unsigned char
+	template<class T>
+	void create(JNIEnv* env_, arma::Cube<T> mIn)
+	{
+		int nrows = mIn.n_rows;
+		int ncols = mIn.n_cols;
+		int nchannels = mIn.n_slices;
+
+		init_new(env_, nrows, ncols, nchannels);
+
+		T* ptr_in = mIn.memptr();
+
+		if (std::is_same<T, double>::value)
+			std::copy(ptr_in, ptr_in + nd, ptr_data);
+		else
+		{
+			for (int ii = 0; ii < nd; ii++)
+				ptr_data[ii] = static_cast<double>(ptr_in[ii]);
+		}
+	}
+	
+	// template parameter T should be native C++ types such as float, double, int and unsigned char
+	template<class T>
+	std::vector<T> to_stdVec(bool transpose = false)
+	{
+		std::vector<T> vOut(nd);
+
+		if (!transpose)
+		{
+			if (std::is_same<T, double>::value)
+				std::copy(ptr_data, ptr_data + nd, vOut.begin());
+			else
+			{
+				for (int ii = 0; ii < nd; ii++)
+					vOut[ii] = static_cast<T>(ptr_data[ii]);
+			}
+		}
+
+		else
+		{
+			unsigned long long cc = 0;
+			for (int i = 0; i < nr; i++)
+				for (int j = 0; j < nc; j++)
+					for (int k = 0; k < nch; k++)
+						vOut[cc++] = get(i,j,k);
+		}
+		
+		return vOut;
+	}
+
+	// convert to opencv matrix (make copy of data)
+	// the output opencv matrix will be a 2D matrix with a variable number of channels
+	// template param T should be C++ native types such as float, double, int and unsigned char
+	template<class T, int nchannels>
+	cv::Mat to_cvMat(bool multBy255 = false)
+	{
+		jni_utils ju(env);
+			
+		if (nchannels != nch)
+		{
+			ju.throw_exception("ERROR from JNI: template parameter nchannels does not match with internal matrix nchannels.");
+			return cv::Mat();
+		}
+
+		double multBy;
+		if (multBy255)
+			multBy = 255;
+		else
+			multBy = 1;
+			
+		cv::Mat mOut(nr, nc, CV_MAKE_TYPE(cv::DataType<T>::depth, nch));
+		int cc = 0;
+		for (int k = 0; k < nch; k++)
+			for (int j = 0; j < nc; j++)
+				for (int i = 0; i < nr; i++)
+					mOut.at<cv::Vec<T, nchannels>>(i, j)[k] = static_cast<T>(ptr_data[cc++] * multBy);
+
+		return mOut;
+	}
+
+	// type T should be native C++ types such as float, double and unsigned char
+	template<class T>
+	arma::Cube<T> to_armaCube()
+	{
+		arma::Cube<T> mOut(nr, nc, nch);		
+		T* ptr_out = mOut.memptr();
+
+		if (std::is_same<T, double>::value)
+			std::copy(ptr_data, ptr_data + nd, ptr_out);
+		else
+		{
+			for (int ii = 0; ii < nd; ii++)
+				ptr_out[ii] = static_cast<T>(ptr_data[ii]);
+		}
+
+		return mOut;
+	}
+
+	// type T should be native C++ types such as float, double and unsigned char
+	template<class T>
+	arma::Mat<T> to_armaMat()
+	{
+		jni_utils ju(env);
+
+		if (nch != 1)
+		{
+			ju.throw_exception("ERROR from JNI: to_armMat() can only called if the underlying matrix has 1 channel.");
+			return arma::Mat<T>();
+		}			
+
+		arma::Mat<T> mOut(nr, nc);
+		T* ptr_out = mOut.memptr();
+
+		if (std::is_same<T, double>::value)
+			std::copy(ptr_data, ptr_data + nd, ptr_out);
+		else
+		{
+			for (int ii = 0; ii < nd; ii++)
+				ptr_out[ii] = static_cast<T>(ptr_data[ii]);
+		}
+
+		return mOut;
+	}
+
+	// zero-copy view of one channel of this matrix as an armadillo matrix.
+	// The view uses the pinned java data directly (no allocation and no copy), so
+	// writes through the view go straight into the java matrix. The view is only
+	// valid as long as this Matkc is alive, since the data is unpinned on destruction.
+	arma::Mat<double> view_armaMat(int channel = 0)
+	{
+		return arma::Mat<double>(ptr_data + channel * ndpch, nr, nc, false, true);
+	}
+
+	// zero-copy view of the whole matrix as an armadillo cube (one slice per channel).
+	// Matkc's layout (col major, one channel after another) is the same as arma::Cube.
+	// Same lifetime rules as view_armaMat().
+	arma::Cube<double> view_armaCube()
+	{
+		return arma::Cube<double>(ptr_data, nr, nc, nch, false, true);
+	}
+
+#ifdef EIGEN_WORLD_VERSION
+	// zero-copy view of one channel of this matrix as an Eigen matrix.
+	// Same lifetime rules as view_armaMat().
+	Eigen::Map<Eigen::MatrixXd> view_eigenMat(int channel = 0)
+	{
+		return Eigen::Map<Eigen::MatrixXd>(ptr_data + channel * ndpch, nr, nc);
+	}
+#endif
+
+	double get(int i, int j, int k)
+	{
+		return ptr_data[k * ndpch + j * nr + i];
+	}
+
+	// get the copy of data corresponding to given range of a full matrix
+	Matkc get(int r1, int r2, int c1, int c2, int ch1, int ch2)
+	{
+		if (r1 == -1) r1 = nr - 1;
+		if (r2 == -1) r2 = nr - 1;
+		if (c1 == -1) c1 = nc - 1;
+		if (c2 == -1) c2 = nc - 1;
+		if (ch1 == -1) ch1 = nch - 1;
+		if (ch2 == -1) ch2 = nch - 1;
+
+		int nr_new = r2 - r1 + 1;
+		int nc_new = c2 - c1 + 1;
+		int nch_new = ch2 - ch1 + 1;
+		int ndata_per_chan_new = nr_new * nc_new;
+		int ndata_new = ndata_per_chan_new * nch_new;
+
+		Matkc mOut;
+		mOut.create(env, nr_new, nc_new, nch_new);
+		double* temp_out = mOut.ptr_data;
+
+		if (nr_new == nr && nc_new == nc)
+		{
+			std::copy(ptr_data + ch1 * ndpch, ptr_data + ch1 * ndpch + ndata_new, temp_out);
+		}
+		else if (nr_new == nr && nc_new != nc)
+		{
+			int cc = 0;
+			int idx_temp;
+			for (int k = 0; k<nch_new; k++)
+			{
+				idx_temp = (k + ch1) * ndpch + c1*nr;
+				std::copy(ptr_data + idx_temp, ptr_data + idx_temp + ndata_per_chan_new, temp_out + cc);
+				cc += nr_new * nc_new;
+			}
+		}
+		else
+		{
+			int cc = 0;
+			int idx_temp;
+			for (int k = 0; k<nch_new; k++)
+				for (int j = 0; j<nc_new; j++)
+				{					
+					idx_temp = (k + ch1) * ndpch + (j + c1) * nr + r1;
+					std::copy(ptr_data + idx_temp, ptr_data + idx_temp + nr_new, temp_out + cc);
+					cc += nr_new;
+				}
+		}
+
+		return mOut;
+	}
+
+	// get the copy of data corresponding to given range of a full matrix
+	std::vector<double> get_stdVecOutput(int r1, int r2, int c1, int c2, int ch1, int ch2)
+	{
+		if (r1 == -1) r1 = nr - 1;
+		if (r2 == -1) r2 = nr - 1;
+		if (c1 == -1) c1 = nc - 1;
+		if (c2 == -1) c2 = nc - 1;
+		if (ch1 == -1) ch1 = nch - 1;
+		if (ch2 == -1) ch2 = nch - 1;
+
+		int nr_new = r2 - r1 + 1;
+		int nc_new = c2 - c1 + 1;
+		int nch_new = ch2 - ch1 + 1;
+		int ndata_per_chan_new = nr_new * nc_new;
+		int ndata_new = ndata_per_chan_new * nch_new;
+
+		Matkc mOut;
+		mOut.create(env, nr_new, nc_new, nch_new);
+		std::vector<double> vOut(nr_new * nc_new * nch_new);
+		double* temp_out = vOut.data();
+
+		if (nr_new == nr && nc_new == nc)
+		{
+			std::copy(ptr_data + ch1 * ndpch, ptr_data + ch1 * ndpch + ndata_new, temp_out);
+		}
+		else if (nr_new == nr && nc_new != nc)
+		{
+			int cc = 0;
+			int idx_temp;
+			for (int k = 0; k<nch_new; k++)
+			{
+				idx_temp = (k + ch1) * ndpch + c1*nr;
+				std::copy(ptr_data + idx_temp, ptr_data + idx_temp + ndata_per_chan_new, temp_out + cc);
+				cc += nr_new * nc_new;
+			}
+		}
+		else
+		{
+			int cc = 0;
+			int idx_temp;
+			for (int k = 0; k<nch_new; k++)
+				for (int j = 0; j<nc_new; j++)
+				{
+					idx_temp = (k + ch1) * ndpch + (j + c1) * nr + r1;
+					std::copy(ptr_data + idx_temp, ptr_data + idx_temp + nr_new, temp_out + cc);
+					cc += nr_new;
+				}
+		}
+
+		return vOut;
+	}
+
+	Matkc get(int r1, int r2, int c1, int c2)
+	{
+		return get(r1, r2, c1, c2, 0, -1);
+	}
+
+	std::vector<double> get_stdVecOutput(int r1, int r2, int c1, int c2)
+	{
+		return get_stdVecOutput(r1, r2, c1, c2, 0, -1);
+	}
+	
+	// assume k=0
+	double get(int i, int j)
+	{
+		return ptr_data[j * nr + i];
+	}
+
+	// get from a linear index
+	double get(int lin_index)
+	{
+		return ptr_data[lin_index];
+	}
+
+	// get first element
+	double get()
+	{
+		return ptr_data[0];
+	}
+
+	// get a discontinuous submatrix of the current matrix.
+	Matkc get(std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
+	{
+		int nr_new = row_indices.size();
+		int nc_new = col_indices.size();
+		int nch_new = channel_indices.size();
+		Matkc mOut;
+		mOut.create(env, nr_new, nc_new, nch_new);
+		double* temp_out = mOut.ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]];
+
+		return mOut;
+	}
+
+	// get a discontinuous submatrix of the current matrix.
+	std::vector<double> get_stdVecOutput(std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
+	{
+		int nr_new = row_indices.size();
+		int nc_new = col_indices.size();
+		int nch_new = channel_indices.size();
+		std::vector<double> vOut(nr_new * nc_new * nch_new);
+		double* temp_out = vOut.data();
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]];
+
+		return vOut;
+	}
+
+	Matkc get_row(int row_index)
+	{
+		return get(row_index, row_index, 0, -1, 0, -1);
+	}
+
+	std::vector<double> get_row_stdVecOutput(int row_index)
+	{
+		return get_stdVecOutput(row_index, row_index, 0, -1, 0, -1);
+	}
+
+	Matkc get_rows(int start_index, int end_index)
+	{
+		return get(start_index, end_index, 0, -1, 0, -1);
+	}
+
+	std::vector<double> get_rows_stdVecOutput(int start_index, int end_index)
+	{
+		return get_stdVecOutput(start_index, end_index, 0, -1, 0, -1);
+	}
+
+	// take a discontinuous submatrix in the form of rows
+	Matkc get_rows(std::vector<int> row_indices)
+	{
+		int nr_new = row_indices.size();
+		Matkc mOut;
+		mOut.create(env, nr_new, nc, nch);
+		double* temp_out = mOut.ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[cc++] = ptr_data[k * ndpch + j * nr + row_indices[i]];
+
+		return mOut;
+	}
+
+	std::vector<double> get_rows_stdVecOutput(std::vector<int> row_indices)
+	{
+		int nr_new = row_indices.size();
+		std::vector<double> temp_out(nr_new * nc * nch);
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[cc++] = ptr_data[k * ndpch + j * nr + row_indices[i]];
+
+		return temp_out;
+	}
+
+	// take the rows for which mask (java boolean array of nrows elements) is true
+	Matkc get_rows(jbooleanArray mask)
+	{
+		jBitmap bm;
+		if (!load_mask(mask, bm, nr)) return Matkc();
+		int nr_new = static_cast<int>(bm.count());
+		Matkc mOut;
+		mOut.create(env, nr_new, nc, nch);
+		double* temp_out = mOut.ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k < nch; k++)
+			for (int j = 0; j < nc; j++)
+			{
+				const double* ptr_col = ptr_data + k * ndpch + j * nr;
+				bm.for_each_set([&](size_t i) { temp_out[cc++] = ptr_col[i]; });
+			}
+
+		return mOut;
+	}
+
+	// take the elements for which mask is true. mask is a java boolean array of either
+	// nrows * ncols elements (applied to each channel, one channel after another in the output)
+	// or nrows * ncols * nchannels elements (col major, one channel after another).
+	std::vector<double> get_masked(jbooleanArray mask)
+	{
+		jBitmap bm;
+		int nch_mask;
+		if (!load_mask_elements(mask, bm, nch_mask)) return std::vector<double>();
+		std::vector<double> temp_out;
+		temp_out.reserve(bm.count() * nch_mask);
+		for (int k = 0; k < nch_mask; k++)
+		{
+			const double* ptr_chan = ptr_data + k * ndpch;
+			bm.for_each_set([&](size_t idx) { temp_out.push_back(ptr_chan[idx]); });
+		}
+		return temp_out;
+	}
+
+	// set the elements for which mask (as in get_masked()) is true to val
+	void set_masked(jbooleanArray mask, double val)
+	{
+		jBitmap bm;
+		int nch_mask;
+		if (!load_mask_elements(mask, bm, nch_mask)) return;
+		for (int k = 0; k < nch_mask; k++)
+		{
+			double* ptr_chan = ptr_data + k * ndpch;
+			bm.for_each_set([&](size_t idx) { ptr_chan[idx] = val; });
+		}
+	}
+
+	// take a continuous submatrix in the form of a column
+	Matkc get_col(int col_index)
+	{
+		return get(0, -1, col_index, col_index, 0, -1);
+	}
+
+	std::vector<double> get_col_stdVecOutput(int col_index)
+	{
+		return get_stdVecOutput(0, -1, col_index, col_index, 0, -1);
+	}
+
+	// take a continuous submatrix in the form of cols
+	Matkc get_cols(int start_index, int end_index)
+	{
+		return get(0, -1, start_index, end_index, 0, -1);
+	}
+
+	std::vector<double> get_cols_stdVecOutput(int start_index, int end_index)
+	{
+		return get_stdVecOutput(0, -1, start_index, end_index, 0, -1);
+	}
+
+	// take a discontinuous submatrix in the form of cols
+	Matkc get_cols(std::vector<int> col_indices)
+	{
+		int nc_new = col_indices.size();
+		Matkc mOut;
+		mOut.create(env, nr, nc_new, nch);
+		double* temp_out = mOut.ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[cc++] = ptr_data[k * ndpch + col_indices[j] * nr + i];
+
+		return mOut;
+	}
+
+	std::vector<double> get_cols_stdVecOutput(std::vector<int> col_indices)
+	{
+		int nc_new = col_indices.size();
+		std::vector<double> temp_out(nr * nc_new * nch);
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[cc++] = ptr_data[k * ndpch + col_indices[j] * nr + i];
+
+		return temp_out;
+	}
+
+	// take a continuous submatrix in the form of a channel
+	Matkc get_channel(int channel_index)
+	{
+		return get(0, -1, 0, -1, channel_index, channel_index);
+	}
+
+	std::vector<double> get_channel_stdVecOutput(int channel_index)
+	{
+		return get_stdVecOutput(0, -1, 0, -1, channel_index, channel_index);
+	}
+
+	// take a continuous submatrix in the form of channels
+	Matkc get_channels(int start_index, int end_index)
+	{
+		return get(0, -1, 0, -1, start_index, end_index);
+	}
+
+	std::vector<double> get_channels_stdVecOutput(int start_index, int end_index)
+	{
+		return get_stdVecOutput(0, -1, 0, -1, start_index, end_index);
+	}
+
+	// take a discontinuous submatrix in the form of cols
+	Matkc get_channels(std::vector<int> channel_indices)
+	{
+		int nch_new = channel_indices.size();
+		Matkc mOut;
+		mOut.create(env, nr, nc, nch_new);
+		double* temp_out = mOut.ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + j * nr + i];
+
+		return mOut;
+	}
+
+	std::vector<double> get_channels_stdVecOutput(std::vector<int> channel_indices)
+	{
+		int nch_new = channel_indices.size();
+		std::vector<double> temp_out(nr * nc * nch_new);
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[cc++] = ptr_data[channel_indices[k] * ndpch + j * nr + i];
+
+		return temp_out;
+	}
+	
+	// use the entire given input matrix to set part of this matrix with the given range
+	void set(Matkc mIn, int r1, int r2, int c1, int c2, int ch1, int ch2)
+	{
+		if (r1 == -1) r1 = nr - 1;
+		if (r2 == -1) r2 = nr - 1;
+		if (c1 == -1) c1 = nc - 1;
+		if (c2 == -1) c2 = nc - 1;
+		if (ch1 == -1) ch1 = nch - 1;
+		if (ch2 == -1) ch2 = nch - 1;
+
+		int nr_new = r2 - r1 + 1;
+		int nc_new = c2 - c1 + 1;
+		int nch_new = ch2 - ch1 + 1;
+		int ndata_per_chan_new = nr_new * nc_new;
+		int ndata_new = ndata_per_chan_new * nch_new;
+
+		if (nr_new != mIn.nr || nc_new != mIn.nc || nch_new != mIn.nch)
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: the input matrix and the range specified do not match.");
+			return;
+		}			
+
+		double* temp_in = mIn.ptr_data;
+		double* temp_out = ptr_data;
+
+		if (nr_new == nr && nc_new == nc)
+		{
+			std::copy(temp_in, temp_in + ndata_new, temp_out + ch1 * ndpch);
+		}
+		else if (nr_new == nr && nc_new != nc)
+		{
+			int cc = 0;
+			for (int k = 0; k<nch_new; k++)
+			{
+				std::copy(temp_in + cc, temp_in + cc + ndata_per_chan_new, temp_out + (k + ch1) * ndpch + c1*nr);
+				cc += nr_new * nc_new;
+			}
+		}
+		else
+		{
+			int cc = 0;
+			for (int k = 0; k<nch_new; k++)
+				for (int j = 0; j<nc_new; j++)
+				{
+					std::copy(temp_in + cc, temp_in + cc + nr_new, temp_out + (k + ch1) * ndpch + (j + c1) * nr + r1);
+					cc += nr_new;
+				}
+		}
+
+	}
+
+	// use the entire given input matrix (in the form of an
+	// array stored in col major order to set part of this matrix with the given range
+	void set(std::vector<double> data_mIn, int r1, int r2, int c1, int c2, int ch1, int ch2)
+	{
+		if (r1 == -1) r1 = nr - 1;
+		if (r2 == -1) r2 = nr - 1;
+		if (c1 == -1) c1 = nc - 1;
+		if (c2 == -1) c2 = nc - 1;
+		if (ch1 == -1) ch1 = nch - 1;
+		if (ch2 == -1) ch2 = nch - 1;
+
+		int nr_new = r2 - r1 + 1;
+		int nc_new = c2 - c1 + 1;
+		int nch_new = ch2 - ch1 + 1;
+		int ndata_per_chan_new = nr_new * nc_new;
+		int ndata_new = ndata_per_chan_new * nch_new;
+
+		if (ndata_new != data_mIn.size())
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: the input matrix data and the range specified do not match.");
+			return;
+		}			
+
+		double* temp_in = data_mIn.data();
+		double* temp_out = ptr_data;
+
+		if (nr_new == nr && nc_new == nc)
+		{
+			std::copy(temp_in, temp_in + ndata_new, temp_out + ch1 * ndpch);
+		}
+		else if (nr_new == nr && nc_new != nc)
+		{
+			int cc = 0;
+			for (int k = 0; k<nch_new; k++)
+			{
+				std::copy(temp_in + cc, temp_in + cc + ndata_per_chan_new, temp_out + (k + ch1) * ndpch + c1*nr);
+				cc += nr_new * nc_new;
+			}
+		}
+		else
+		{
+			int cc = 0;
+			for (int k = 0; k<nch_new; k++)
+				for (int j = 0; j<nc_new; j++)
+				{
+					std::copy(temp_in + cc, temp_in + cc + nr_new, temp_out + (k + ch1) * ndpch + (j + c1) * nr + r1);
+					cc += nr_new;
+				}
+		}
+	}
+
+	// use the entire given input matrix to set part of this matrix with the given range
+	void set(Matkc mIn, int r1, int r2, int c1, int c2)
+	{
+		set(mIn, r1, r2, c1, c2, 0, -1);
+	}
+
+	void set(std::vector<double> data_mIn, int r1, int r2, int c1, int c2)
+	{
+		set(data_mIn, r1, r2, c1, c2, 0, -1);
+	}
+
+	// use the entire given input matrix to set part of this matrix starting with i,j,k position
+	void set(Matkc mIn, int i, int j, int k)
+	{
+		set(mIn, i, i + mIn.nr - 1, j, j + mIn.nc - 1, k, k + mIn.nch - 1);
+	}
+
+	// use the entire given input matrix to set part of this matrix starting with i,j,0 position
+	void set(Matkc mIn, int i, int j)
+	{
+		set(mIn, i, i + mIn.nr - 1, j, j + mIn.nc - 1, 0, mIn.nch - 1);
+	}
+
+	// use the given value to set an element of this matrix at i,j,k position
+	void set(double val, int i, int j, int k)
+	{
+		ptr_data[k * ndpch + j * nr + i] = val;
+	}
+
+	// use the given value to set an element of this matrix at i,j,0 position
+	void set(double val, int i, int j)
+	{
+		ptr_data[j * nr + i] = val;
+	}
+
+	// use the given value to set an element of this matrix at lin_index linear position
+	void set(double val, int lin_index)
+	{
+		ptr_data[lin_index] = val;
+	}
+
+	// use the given value to set an element of this matrix at 0,0,0 position
+	void set(double val)
+	{
+		ptr_data[0] = val;
+	}
+
+	// use the entire given input matrix to set part of this matrix specified by row, col and chan indices.
+	void set(Matkc mIn, std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
+	{
+		int nr_new = row_indices.size();
+		int nc_new = col_indices.size();
+		int nch_new = channel_indices.size();
+
+		double* temp_in = mIn.ptr_data;
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]] = temp_in[cc++];
+	}
+
+	void set(std::vector<double> data_mIn, std::vector<int> row_indices, std::vector<int> col_indices, std::vector<int> channel_indices)
+	{
+		int nr_new = row_indices.size();
+		int nc_new = col_indices.size();
+		int nch_new = channel_indices.size();
+
+		double* temp_in = data_mIn.data();
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[channel_indices[k] * ndpch + col_indices[j] * nr + row_indices[i]] = temp_in[cc++];
+	}
+
+	// use the entire given input matrix (must be a row vector) to set a row of this matrix
+	void set_row(Matkc mIn, int row_index)
+	{
+		set(mIn, row_index, row_index, 0, -1, 0, -1);
+	}
+
+	void set_row(std::vector<double> data_mIn, int row_index)
+	{
+		set(data_mIn, row_index, row_index, 0, -1, 0, -1);
+	}
+
+	// use the entire given input matrix to a range of rows of this matrix
+	void set_rows(Matkc mIn, int start_index, int end_index)
+	{
+		set(mIn, start_index, end_index, 0, -1, 0, -1);
+	}
+
+	void set_rows(std::vector<double> data_mIn, int start_index, int end_index)
+	{
+		set(data_mIn, start_index, end_index, 0, -1, 0, -1);
+	}
+
+	// use the entire given input matrix to set specified rows of this matrix.
+	void set_rows(Matkc mIn, std::vector<int> row_indices)
+	{
+		int nr_new = row_indices.size();
+
+		double* temp_in = mIn.ptr_data;
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[k * ndpch + j * nr + row_indices[i]] = temp_in[cc++];
+	}
+
+	void set_rows(std::vector<double> data_mIn, std::vector<int> row_indices)
+	{
+		int nr_new = row_indices.size();
+
+		double* temp_in = data_mIn.data();
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr_new; i++)
+					temp_out[k * ndpch + j * nr + row_indices[i]] = temp_in[cc++];
+	}
+
+	// use the entire given input matrix (must be a col vector) to set a col of this matrix
+	void set_col(Matkc mIn, int col_index)
+	{
+		set(mIn, 0, -1, col_index, col_index, 0, -1);
+	}
+
+	void set_col(std::vector<double> data_mIn, int col_index)
+	{
+		set(data_mIn, 0, -1, col_index, col_index, 0, -1);
+	}
+
+	// use the entire given input matrix to a range of cols of this matrix
+	void set_cols(Matkc mIn, int start_index, int end_index)
+	{
+		set(mIn, 0, -1, start_index, end_index, 0, -1);
+	}
+
+	void set_cols(std::vector<double> data_mIn, int start_index, int end_index)
+	{
+		set(data_mIn, 0, -1, start_index, end_index, 0, -1);
+	}
+
+	// use the entire given input matrix to set specified cols of this matrix.
+	void set_cols(Matkc mIn, std::vector<int> col_indices)
+	{
+		int nc_new = col_indices.size();
+
+		double* temp_in = mIn.ptr_data;
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[k * ndpch + col_indices[j] * nr + i] = temp_in[cc++];
+	}
+
+	void set_cols(std::vector<double> data_mIn, std::vector<int> col_indices)
+	{
+		int nc_new = col_indices.size();
+
+		double* temp_in = data_mIn.data();
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch; k++)
+			for (int j = 0; j<nc_new; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[k * ndpch + col_indices[j] * nr + i] = temp_in[cc++];
+	}
+
+	// use the entire given input matrix (must be a channel) to set a channel of this matrix
+	void set_channel(Matkc mIn, int channel_index)
+	{
+		set(mIn, 0, -1, 0, -1, channel_index, channel_index);
+	}
+
+	void set_channel(std::vector<double> data_mIn, int channel_index)
+	{
+		set(data_mIn, 0, -1, 0, -1, channel_index, channel_index);
+	}
+
+	// use the entire given input matrix to a range of channels of this matrix
+	void set_channels(Matkc mIn, int start_index, int end_index)
+	{
+		set(mIn, 0, -1, 0, -1, start_index, end_index);
+	}
+
+	void set_channels(std::vector<double> data_mIn, int start_index, int end_index)
+	{
+		set(data_mIn, 0, -1, 0, -1, start_index, end_index);
+	}
+	
+	// use the entire given input matrix to set specified channels of this matrix.
+	void set_channels(Matkc mIn, std::vector<int> channel_indices)
+	{
+		int nch_new = channel_indices.size();
+		double* temp_in = mIn.ptr_data;
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[channel_indices[k] * ndpch + j * nr + i] = temp_in[cc++];
+	}
+
+	void set_channels(std::vector<double> data_mIn, std::vector<int> channel_indices)
+	{
+		int nch_new = channel_indices.size();
+		double* temp_in = data_mIn.data();
+		double* temp_out = ptr_data;
+
+		int cc = 0;
+		for (int k = 0; k<nch_new; k++)
+			for (int j = 0; j<nc; j++)
+				for (int i = 0; i<nr; i++)
+					temp_out[channel_indices[k] * ndpch + j * nr + i] = temp_in[cc++];
+	}
+
+	void print()
+	{
+		std::cout << "=========== Printing matrix ===========" << std::endl;
+		for (int k = 0; k<nch; k++)
+		{
+			std::cout << "mat(:,:," << (k + 1) << ")=[" << std::endl;
+			for (int i = 0; i<nr; i++)
+			{
+				for (int j = 0; j<nc - 1; j++)
+					std::cout << get(i, j, k) << ",\t";		
+				std::cout << get(i, nc - 1, k) << ";" << std::endl;
+			}
+			std::cout << "];" << std::endl;
+		}
+		std::cout << "=========== Matrix printed ===========" << std::endl;
+	}
+
+	void print_info()
+	{
+		printf("Matrix info: #rows = %d, #ncols = %d, #nchannels = %d\n", nr, nc, nch);
+	}
+
+	void print_info(std::string name_matrix)
+	{
+		printf("Matrix %s info: #rows = %d, #ncols = %d, #nchannels = %d\n", name_matrix.c_str(), nr, nc, nch);
+	}
+
+	void save_data(std::string fpath)
+	{
+		std::ofstream fid(fpath);
+		fid << "Matkc data; nrows = " << nr << ", ncols = " << nc << ", nchannels = " << nch << std::endl;
+		for (int i = 0; i < nd; i++)
+			fid << ptr_data[i] << std::endl;
+	}
+
+	// construct from a numpy .npy file (make copy of data).
+	// the file is streamed in fixed-size chunks, so multi-GB files are loaded
+	// with bounded native memory. Arrays with 1, 2 or 3 dimensions are interpreted
+	// as nrows x ncols x nchannels. Any numeric dtype is converted to double.
+	void create_from_npy(JNIEnv* env_, std::string fpath)
+	{
+		npy_reader reader(fpath);
+		init_new(env_, reader);
+	}
+
+	// construct from the array named name_array inside an uncompressed numpy .npz file
+	void create_from_npz(JNIEnv* env_, std::string fpath, std::string name_array)
+	{
+		std::string str_error;
+		unsigned long long offset_data;
+		if (!npz_utils::find_member(fpath, name_array, offset_data, str_error))
+		{
+			jni_utils ju(env_);
+			ju.throw_exception("ERROR from JNI: " + str_error);
+			return;
+		}
+		npy_reader reader(fpath, offset_data);
+		init_new(env_, reader);
+	}
+
+	// save as numpy .npy file in Fortran order (i.e. the Matkc layout, so no transpose).
+	// a single channel matrix is saved as a 2D array, otherwise as nrows x ncols x nchannels.
+	// returns false (with a java exception thrown) if the file could not be written.
+	bool save_npy(std::string fpath)
+	{
+		std::ofstream fid(fpath, std::ios::binary);
+		npy_writer w(fid);
+		if (!fid || !w.write(ptr_data, npy_utils::matrix_shape(nr, nc, nch), true) || !fid.flush())
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: could not write " + fpath);
+			return false;
+		}
+		return true;
+	}
+
+	// add this matrix to a numpy .npz archive under the name name_array.
+	// returns false (with a java exception thrown) if the archive could not be written.
+	bool save_npz(npz_writer &w, std::string name_array)
+	{
+		if (!w.add(name_array, ptr_data, npy_utils::matrix_shape(nr, nc, nch), true))
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: could not add " + name_array + " to npz archive");
+			return false;
+		}
+		return true;
+	}
+
+	// construct from a jagged java array (make copy of data), arr[i][j] for a 2D array
+	// such as double[][] or arr[i][j][k] for a 3D array (k being the channel) such as float[][][].
+	// T_arr should be jdoubleArray, jfloatArray, etc. and T the corresponding primitive type.
+	template<class T_arr, class T>
+	void create_from_jagged(JNIEnv* env_, jobjectArray arr, bool is_3d = false, int nthreads = 0)
+	{
+		jJagged jg(env_);
+		int nrows, ncols, nchannels;
+		if (!jg.get_shape<T_arr>(arr, nrows, ncols, nchannels, is_3d)) return;
+		std::vector<T> rowMajor(static_cast<size_t>(nrows) * ncols * nchannels);
+		if (!jg.read_rows<T_arr>(arr, rowMajor.data(), nrows, ncols, nchannels, is_3d)) return;
+		init_new(env_, nrows, ncols, nchannels);
+		jJagged::convert_layout(rowMajor.data(), ptr_data, nr, nc, nch, true, nthreads);
+	}
+
+	// copy to a new jagged java array (2D if is_3d is false, which needs a single channel)
+	template<class T_arr, class T>
+	jobjectArray to_jagged(bool is_3d = false, int nthreads = 0)
+	{
+		jJagged jg(env);
+		if (!is_3d && nch != 1)
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: a Matkc with more than one channel can only be converted to a 3D jagged array.");
+			return nullptr;
+		}
+		std::vector<T> rowMajor(nd);
+		jJagged::convert_layout(ptr_data, rowMajor.data(), nr, nc, nch, false, nthreads);
+		if (is_3d)
+			return jg.write_3d<T_arr>(rowMajor.data(), nr, nc, nch, false, nthreads);
+		else
+			return jg.write_2d<T_arr>(rowMajor.data(), nr, nc, false, nthreads);
+	}
+			
+	int nrows() const { return nr; }
+	int ncols() const { return nc; }
+	int nchannels () const { return nch; }
+	int ndata_per_chan() const { return ndpch; }
+	int ndata() const { return nd; }
+
+	jobject get_obj() const { return obj; }
+};
+
+// pool of Java Matkc objects, held as global refs and keyed by their shape
+// (nrows, ncols, nchannels), for recycling matrices in frame loops.
+// acquire() hands out a previously released matrix of the same shape if there is one
+// and only calls NewObject on a miss, so that steady state processing does not
+// allocate anything on the Java heap. At most capacity released matrices are kept;
+// beyond that the least recently released one is evicted (its global ref is deleted).
+// Notes:
+// - a recycled matrix still holds the data it had when it was released.
+// - any Matkc wrapping the object should be destroyed before the object is released,
+//   since the Matkc releases (and possibly copies back) its data on destruction.
+class Matkc_pool
+{
+public:
+
+	Matkc_pool() = delete;
+
+	Matkc_pool(size_t capacity_)
+	{
+		capacity = capacity_;
+		vm = nullptr;
+		cls = nullptr;
+		constructor_methodID = nullptr;
+		n_hits = n_misses = n_evictions = 0;
+	}
+
+	~Matkc_pool()
+	{
+		JNIEnv* env = nullptr;
+		if (vm != nullptr && vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK)
+			clear(env);
+	}
+
+	// get a matrix (as a global ref) of the given shape: recycled if one is available,
+	// otherwise a new one is created.
+	jobject acquire(JNIEnv* env, int nrows, int ncols, int nchannels = 1)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		key_type key(nrows, ncols, nchannels);
+
+		std::map<key_type, std::deque<lru_iterator> >::iterator it = free_by_shape.find(key);
+		if (it != free_by_shape.end() && !it->second.empty())
+		{
+			// most recently released matrix of this shape
+			lru_iterator it_lru = it->second.back();
+			it->second.pop_back();
+			jobject obj = it_lru->obj;
+			lru.erase(it_lru);
+			in_use[obj] = key;
+			n_hits++;
+			return obj;
+		}
+
+		if (cls == nullptr)
+		{
+			env->GetJavaVM(&vm);
+			jclass cls_local = env->FindClass("KKH/StdLib/Matkc");
+			cls = (jclass)env->NewGlobalRef(cls_local);
+			env->DeleteLocalRef(cls_local);
+			constructor_methodID = env->GetMethodID(cls, "<init>", "(III)V");
+		}
+
+		jobject obj_local = env->NewObject(cls, constructor_methodID, nrows, ncols, nchannels);
+		jobject obj = env->NewGlobalRef(obj_local);
+		env->DeleteLocalRef(obj_local);
+		in_use[obj] = key;
+		n_misses++;
+		return obj;
+	}
+
+	// get a matrix of the given shape and wrap it with m
+	void acquire(JNIEnv* env, Matkc &m, int nrows, int ncols, int nchannels = 1)
+	{
+		m.create(env, acquire(env, nrows, ncols, nchannels));
+	}
+
+	// give back a matrix obtained from acquire() so that it can be recycled.
+	// returns false if obj was not handed out by this pool.
+	bool release(JNIEnv* env, jobject obj)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::map<jobject, key_type>::iterator it = in_use.find(obj);
+		if (it == in_use.end())
+			return false;
+
+		entry e;
+		e.key = it->second;
+		e.obj = obj;
+		in_use.erase(it);
+		lru.push_front(e);
+		free_by_shape[e.key].push_back(lru.begin());
+
+		// evict the least recently released matrices
+		while (lru.size() > capacity)
+		{
+			entry &e_old = lru.back();
+			// the oldest entry of a shape is always at the front of its deque
+			free_by_shape[e_old.key].pop_front();
+			env->DeleteGlobalRef(e_old.obj);
+			lru.pop_back();
+			n_evictions++;
+		}
+		return true;
+	}
+
+	// delete all the released matrices held by the pool (matrices still in use
+	// remain valid global refs which are then owned by the caller).
+	void clear(JNIEnv* env)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		for (std::list<entry>::iterator it = lru.begin(); it != lru.end(); ++it)
+			env->DeleteGlobalRef(it->obj);
+		lru.clear();
+		free_by_shape.clear();
+		in_use.clear();
+		if (cls != nullptr)
+		{
+			env->DeleteGlobalRef(cls);
+			cls = nullptr;
+		}
+	}
+
+	void set_capacity(size_t capacity_) { std::lock_guard<std::mutex> lock(mtx); capacity = capacity_; }
+	size_t get_capacity() const { return capacity; }
+	size_t nfree() const { return lru.size(); }
+	size_t nin_use() const { return in_use.size(); }
+	unsigned long long nhits() const { return n_hits; }
+	unsigned long long nmisses() const { return n_misses; }
+	unsigned long long nevictions() const { return n_evictions; }
+
+	double hit_rate() const
+	{
+		unsigned long long n = n_hits + n_misses;
+		return n == 0 ? 0 : static_cast<double>(n_hits) / n;
+	}
+
+	void reset_stats() { n_hits = n_misses = n_evictions = 0; }
+
+	void print_stats()
+	{
+		printf("Matkc_pool stats: #hits = %llu, #misses = %llu, hit rate = %.3f, #evictions = %llu, #free = %d, #in use = %d\n",
+			n_hits, n_misses, hit_rate(), n_evictions, (int)nfree(), (int)nin_use());
+	}
+
+private:
+
+	typedef std::tuple<int, int, int> key_type;
+
+	struct entry
+	{
+		key_type key;
+		jobject obj;
+	};
+
+	typedef std::list<entry>::iterator lru_iterator;
+
+	std::list<entry> lru; // released matrices, most recently released at the front
+	std::map<key_type, std::deque<lru_iterator> > free_by_shape;
+	std::map<jobject, key_type> in_use;
+
+	JavaVM* vm;
+	jclass cls;
+	jmethodID constructor_methodID;
+	size_t capacity;
+	std::mutex mtx;
+	unsigned long long n_hits, n_misses, n_evictions;
+};
+
+// wrap a Java class object so that I can get fields, set fields,
+// and call methods in a convenient way
+class JavaClass
+{
+
+private:
+
+	JNIEnv* env;
+	jclass cls;
+	jobject obj;
+	std::string str_class_sig;
+	std::string str_classname;
+	
+public:
+
+	// constructor given a fully-specified class name
+	// e.g. KKH/StdLib/Matkc
+	// does not create the object. Can use JavaClass.construct_new()
+	// to create the object.
+	JavaClass(JNIEnv* env_, std::string str_classname_)
+	{
+		env = env_;	
+		str_classname = str_classname_;
+		
+		// if str_classname already includes "L...;" set it to str_class_sig and remove it
+		// for storing in str_classname.
+		// Otherwise, str_classname will remain as it is and str_class_sig will be
+		// str_classname with "L" and ";" added to the beginning and end of it respectively
+		// Actually just to note that this is not really necessary as FindClass and others
+		// work work on either with "L...;" or without it. But the code below is just to 
+		// keep things consistent.
+		if (str_classname.find("L") == 0 && str_classname.find(";") == str_classname.size() - 1)
+		{
+			str_class_sig = str_classname;
+			str_classname = str_classname.substr(1, str_classname.size() - 2);
+		}
+		else
+		{
+			str_class_sig = "L" + str_classname + ";";
+		}
+		
+		cls = env->FindClass(str_classname.c_str());
+	}
+	
+	// wraps an existing java object.
+	// automatically computes the class signature, etc.
+	JavaClass(JNIEnv* env_, jobject obj_)
+	{
+		env = env_;
+		obj = obj_;
+		cls = env->GetObjectClass(obj);
+		jni_utils ju(env);
+		str_class_sig = ju.get_signature_jobject(obj);
+		str_classname = ju.get_signature_jobject(obj, true);
+	}
+	
+	std::string get_classname()
+	{
+		return str_classname;
+	}
+
+	std::string get_class_sig()
+	{
+		return str_class_sig;
+	}
+
+	jobject get_obj()
+	{
+		return obj;
+	}
+
+	// creates a new object. This is normally used after constructing this class
+	// with JavaClass(JNIEnv* env_, std::string str_classname_) which did not result in
+	// a java object (just class info such as signature is stored).
+	// types_args can be jint, jfloat, jdouble, jshort, jchar, jlong, jbyte and jstring
+	// jintArray, jdoubleArray, jfloatArray, jshortArray, jcharArray, jlongArray, jbyteArray
+	// it can also be jobject
+	template<typename... types_args>
+	void construct_new(types_args... args)
+	{
+		jni_utils ju(env);
+		std::string sig_method = ju.get_signature_jmethod<void, types_args...>("", args...);
+
+		// call constructor to create jobject
+		jmethodID mID = env->GetMethodID(cls, "<init>", sig_method.c_str());
+		obj = env->NewObject(cls, mID, args...);	
+	}
+
+	// get a data member (i.e. field) from the object of this class.
+	// T can be jint, jfloat, ..., jintArray, jdoubleArray, ..., jstring
+	// T can also be jobject. If so, signature_field_if_T_is_jobject should be set
+	// to a valid signature string. If I have a jobject created before, I can use
+	// jni_utils.get_signature_jobject<jobject>(jobject obj) to automatically
+	// get the string signature.
+	// if T is not jobject, then signature_field_if_T_is_jobject is not used
+	// not therefore can be set to any (garbage) value such as "".
+	template<class T>
+	T get_field(std::string name_field, std::string signature_field_if_T_is_jobject, bool is_static_field = false)
+	{
+		jni_utils ju(env);
+		std::string sig_field = get_signature_jtype<T>(signature_field_if_T_is_jobject);
+		jfieldID fieldID;
+
+		if (is_static_field)
+		{
+			fieldID = env->GetStaticFieldID(cls, name_field.c_str(), sig_field.c_str());
+			GetStaticFieldFunctor<T> ff;
+			return ff(env, cls, fieldID);
+		}
+	 
+		fieldID = env->GetFieldID(cls, name_field.c_str(), sig_field.c_str());
+		GetFieldFunctor<T> ff;
+		return ff(env, obj, fieldID);		
+	}
+				
+	// set a data member (i.e. field) from the object of this class.
+	// T can be jint, jfloat, ..., jintArray, jdoubleArray, ..., jstring
+	// T can also be jobject. 
+	template<class T>
+	void set_field(std::string name_field, T val, bool is_static_field = false)
+	{
+		jni_utils ju(env);
+		std::string sig_field;
+		if (std::is_same<T, jobject>::value)
+			sig_field = ju.get_signature_jobject(val);
+		else
+			sig_field = get_signature_jtype<T>("");
+
+		jfieldID fieldID;
+		
+		if (is_static_field)
+		{
+			fieldID = env->GetStaticFieldID(cls, name_field.c_str(), sig_field.c_str());
+			SetStaticFieldFunctor<T> ff;
+			ff(env, cls, fieldID, val);
+			return;
+		}
+
+		fieldID = env->GetFieldID(cls, name_field.c_str(), sig_field.c_str());
+		SetFieldFunctor<T> ff;
+		ff(env, obj, fieldID, val);		
+	}
+	
+	// call a non-static or static member function of this class/object.
+	// types_args can be jint, jfloat, jdouble, jshort, jchar, jlong, jbyte and jstring
+	// jintArray, jdoubleArray, jfloatArray, jshortArray, jcharArray, jlongArray, jbyteArray
+	// it can also be jobject. 
+	// type_returnVal can be any of the above and also "void".
+	// If type_returnVal is jobject, signature_return_type_if_type_returnVal_is_jobject should be set
+	// to a valid signature string. If I have a jobject created before, I can use
+	// jni_utils.get_signature_jobject<jobject>(jobject obj) to automatically
+	// get the string signature. Apart from case of type_returnVal being jobject, the signatures of all other types
+	// are generated automatically, including if there is a jobject in the input arguments.
+	template<typename type_returnVal, typename... types_inputArgs>
+	type_returnVal call_method(std::string methodName, std::string signature_return_type_if_type_returnVal_is_jobject, bool is_static_method, types_inputArgs... inputArgs)
+	{
+		jni_utils ju(env);
+
+		if (methodName == "") methodName = "<init>"; // assume that it is constructor
+		
+		std::string sig_method = ju.get_signature_jmethod<type_returnVal, types_inputArgs...>(signature_return_type_if_type_returnVal_is_jobject, inputArgs...);
+
+		std::cout << "sig_method = " << sig_method << std::endl;
+
+		jmethodID mID;
+		if (is_static_method)
+		{
+			mID = env->GetStaticMethodID(cls, methodName.c_str(), sig_method.c_str());
+			callXStaticMethodFunctor<type_returnVal, types_inputArgs...> ff;
+			if (std::is_same<type_returnVal, void>::value)
+				ff(env, cls, mID, inputArgs...);
+			else
+				return ff(env, cls, mID, inputArgs...);
+		}
+			
+		else
+		{
+			mID = env->GetMethodID(cls, methodName.c_str(), sig_method.c_str());
+			callXMethodFunctor<type_returnVal, types_inputArgs...> ff;
+			if (std::is_same<type_returnVal, void>::value)
+				ff(env, obj, mID, inputArgs...);
+			else
+				return ff(env, obj, mID, inputArgs...);
+		}			
+	}
+
+	// deferred writes of the fields of this object (or class, for static fields).
+	// set_field() only records the value natively: writing the same field again replaces the
+	// pending value, and get_field() returns the pending value if there is one (read your writes).
+	// commit() (also called on destruction) then makes one JNI SetXField call per modified field,
+	// with field IDs resolved only on the first write or read of each field. The session can be
+	// kept and committed once per frame, and moved to another object of the same class with
+	// retarget(), so that the IDs are resolved once for all of them, e.g.
+	//
+	// JavaClass::field_session fs = tracker.deferred_fields();
+	// fs.set_field<jfloat>("x", x); fs.set_field<jfloat>("y", y); fs.set_field<jint>("age", age + 1);
+	// ...
+	// fs.commit(); // or at the end of the scope
+	//
+	// jobject (and jstring, jarray) values are written at commit time, so their local references
+	// must still be valid then.
+	class field_session
+	{
+	public:
+
+		field_session(JavaClass &jc_) : jc(&jc_), obj(jc_.obj), nwrites(0), ncommitted(0) {}
+
+		field_session(field_session &&s) : jc(s.jc), obj(s.obj), fields(std::move(s.fields)), nwrites(s.nwrites), ncommitted(s.ncommitted)
+		{
+			s.fields.clear();
+		}
+
+		field_session(const field_session&) = delete;
+		field_session& operator=(const field_session&) = delete;
+
+		~field_session() { commit(); }
+
+		// same as JavaClass::set_field. For T = jobject, the signature of the field is taken from
+		// signature_field_if_T_is_jobject, or from the class of val if it is empty (as JavaClass::set_field).
+		// returns false if the field does not exist (NoSuchFieldError is pending) or was
+		// previously written or read with another type.
+		template<class T>
+		bool set_field(std::string name_field, T val, bool is_static_field = false, std::string signature_field_if_T_is_jobject = "")
+		{
+			field* f = find(name_field, is_static_field);
+			if (f == nullptr)
+			{
+				std::string sig_field = signature_field_if_T_is_jobject;
+				if (sig_field.empty())
+				{
+					jni_utils ju(jc->env);
+					if (std::is_same<T, jobject>::value)
+						sig_field = ju.get_signature_jobject(val);
+					else
+						sig_field = get_signature_jtype<T>("");
+				}
+				f = add<T>(name_field, sig_field, is_static_field);
+				if (f == nullptr) return false;
+			}
+			else if (f->set != &set_fn<T>)
+				return type_mismatch(name_field);
+			std::memcpy(&f->val, &val, sizeof(T));
+			f->dirty = true;
+			nwrites++;
+			return true;
+		}
+
+		// same as JavaClass::get_field, but returns the pending value if the field was set in this session
+		template<class T>
+		T get_field(std::string name_field, std::string signature_field_if_T_is_jobject, bool is_static_field = false)
+		{
+			field* f = find(name_field, is_static_field);
+			if (f == nullptr)
+			{
+				f = add<T>(name_field, get_signature_jtype<T>(signature_field_if_T_is_jobject), is_static_field);
+				if (f == nullptr) return T();
+			}
+			else if (f->set != &set_fn<T>)
+			{
+				type_mismatch(name_field);
+				return T();
+			}
+			T val;
+			if (f->dirty)
+				std::memcpy(&val, &f->val, sizeof(T));
+			else if (is_static_field)
+				val = GetStaticFieldFunctor<T>()(jc->env, jc->cls, f->id);
+			else
+				val = GetFieldFunctor<T>()(jc->env, obj, f->id);
+			return val;
+		}
+
+		// writes the pending values to java, in the order of the first write of each field.
+		// if a java exception is pending (e.g. from a failed set_field), no JNI call may be
+		// made, so the pending values are discarded and false is returned.
+		bool commit()
+		{
+			if (jc->env->ExceptionCheck())
+			{
+				discard();
+				return false;
+			}
+			for (size_t i = 0; i < fields.size(); i++)
+			{
+				field &f = fields[i];
+				if (!f.dirty) continue;
+				f.set(jc->env, obj, jc->cls, f.id, f.is_static, f.val);
+				f.dirty = false;
+				ncommitted++;
+			}
+			return true;
+		}
+
+		// forgets the pending values (the field IDs are kept)
+		void discard()
+		{
+			for (size_t i = 0; i < fields.size(); i++)
+				fields[i].dirty = false;
+		}
+
+		// commits the pending values, then writes to obj_ (which must be of the same class) from now on
+		void retarget(jobject obj_)
+		{
+			commit();
+			obj = obj_;
+		}
+
+		size_t get_npending() const
+		{
+			size_t n = 0;
+			for (size_t i = 0; i < fields.size(); i++)
+				if (fields[i].dirty) n++;
+			return n;
+		}
+
+		unsigned long long get_nwrites() const { return nwrites; }
+		unsigned long long get_ncommitted() const { return ncommitted; }
+
+		void print_stats()
+		{
+			printf("field_session stats: #fields = %d, #writes = %llu, #JNI writes = %llu, #coalesced = %llu\n",
+				static_cast<int>(fields.size()), nwrites, ncommitted, nwrites - ncommitted - get_npending());
+		}
+
+	private:
+
+		typedef void(*set_fn_type)(JNIEnv*, jobject, jclass, jfieldID, bool, const jvalue&);
+
+		struct field
+		{
+			std::string name;
+			bool is_static;
+			jfieldID id;
+			set_fn_type set; // also identifies the type of the field
+			jvalue val;
+			bool dirty;
+		};
+
+		JavaClass* jc;
+		jobject obj;
+		std::vector<field> fields; // a few fields per object, so a linear search is fastest
+		unsigned long long nwrites, ncommitted;
+
+		template<class T>
+		static void set_fn(JNIEnv* env, jobject obj, jclass cls, jfieldID id, bool is_static, const jvalue &v)
+		{
+			T val;
+			std::memcpy(&val, &v, sizeof(T));
+			if (is_static)
+				SetStaticFieldFunctor<T>()(env, cls, id, val);
+			else
+				SetFieldFunctor<T>()(env, obj, id, val);
+		}
+
+		field* find(const std::string &name, bool is_static)
+		{
+			for (size_t i = 0; i < fields.size(); i++)
+				if (fields[i].is_static == is_static && fields[i].name == name) return &fields[i];
+			return nullptr;
+		}
+
+		template<class T>
+		field* add(const std::string &name, const std::string &sig, bool is_static)
+		{
+			JNIEnv* env = jc->env;
+			jfieldID id = is_static ? env->GetStaticFieldID(jc->cls, name.c_str(), sig.c_str()) : env->GetFieldID(jc->cls, name.c_str(), sig.c_str());
+			if (id == nullptr) return nullptr;
+			field f;
+			f.name = name;
+			f.is_static = is_static;
+			f.id = id;
+			f.set = &set_fn<T>;
+			std::memset(&f.val, 0, sizeof(jvalue));
+			f.dirty = false;
+			fields.push_back(f);
+			return &fields.back();
+		}
+
+		bool type_mismatch(const std::string &name)
+		{
+			jni_utils ju(jc->env);
+			ju.throw_exception("ERROR from JNI: field_session: the field " + name + " was used with another type");
+			return false;
+		}
+	};
+
+	field_session deferred_fields()
+	{
+		return field_session(*this);
+	}
+
+};
+
+// declarative field tables for marshalling whole C++ structs to and from java objects (POJOs).
+// Declare at namespace scope, after the struct, e.g.
+//
+// struct Detection { jint x, y, w, h; jfloat score; };
+// JNI_STRUCT(Detection, x, y, w, h, score)
+//
+// for the java class
+//
+// public class Detection { public int x, y, w, h; public float score; }
+//
+// The java fields must have the same names as the members of the struct, and the members
+// must have JNI types (jint, jfloat, jdouble, jlong, jboolean, jstring, jdoubleArray, etc.,
+// which for jint, jfloat and jdouble are the same as int, float and double on the usual platforms).
+// Up to 16 fields. Then use jStruct<Detection> (below) to read and write whole objects.
+template<class T> struct jStructTraits {};
+
+#define JNI_STRUCT_EXPAND(x) x
+#define JNI_STRUCT_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define JNI_STRUCT_NARGS(...) JNI_STRUCT_EXPAND(JNI_STRUCT_NARGS_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define JNI_STRUCT_CONCAT_(a, b) a##b
+#define JNI_STRUCT_CONCAT(a, b) JNI_STRUCT_CONCAT_(a, b)
+
+#define JNI_STRUCT_FOR_EACH_1(M, T, x) M(T, x)
+#define JNI_STRUCT_FOR_EACH_2(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_1(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_3(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_2(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_4(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_3(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_5(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_4(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_6(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_5(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_7(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_6(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_8(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_7(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_9(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_8(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_10(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_9(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_11(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_10(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_12(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_11(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_13(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_12(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_14(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_13(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_15(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_14(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH_16(M, T, x, ...) M(T, x) JNI_STRUCT_EXPAND(JNI_STRUCT_FOR_EACH_15(M, T, __VA_ARGS__))
+#define JNI_STRUCT_FOR_EACH(M, T, ...) JNI_STRUCT_EXPAND(JNI_STRUCT_CONCAT(JNI_STRUCT_FOR_EACH_, JNI_STRUCT_NARGS(__VA_ARGS__))(M, T, __VA_ARGS__))
+
+#define JNI_STRUCT_NAME(T, x) #x,
+#define JNI_STRUCT_RESOLVE(T, x) if ((ids[idx] = env->GetFieldID(cls, #x, get_signature_jtype<decltype(T::x)>("").c_str())) == nullptr) return idx; idx++;
+#define JNI_STRUCT_READ(T, x) s.x = GetFieldFunctor<decltype(T::x)>()(env, obj, ids[idx++]);
+#define JNI_STRUCT_WRITE(T, x) SetFieldFunctor<decltype(T::x)>()(env, obj, ids[idx++], s.x);
+
+#define JNI_STRUCT(Type, ...) \
+template<> struct jStructTraits<Type> \
+{ \
+	static const int nfields = JNI_STRUCT_NARGS(__VA_ARGS__); \
+	static const char* name(int i) { static const char* const names[] = { JNI_STRUCT_FOR_EACH(JNI_STRUCT_NAME, Type, __VA_ARGS__) }; return names[i]; } \
+	static int resolve(JNIEnv* env, jclass cls, jfieldID* ids) { int idx = 0; JNI_STRUCT_FOR_EACH(JNI_STRUCT_RESOLVE, Type, __VA_ARGS__) return -1; } \
+	static void read(JNIEnv* env, jobject obj, const jfieldID* ids, Type &s) { int idx = 0; JNI_STRUCT_FOR_EACH(JNI_STRUCT_READ, Type, __VA_ARGS__) } \
+	static void write(JNIEnv* env, jobject obj, const jfieldID* ids, const Type &s) { int idx = 0; JNI_STRUCT_FOR_EACH(JNI_STRUCT_WRITE, Type, __VA_ARGS__) } \
+};
+
+// reads and writes whole java objects as C++ structs declared with JNI_STRUCT.
+// The field IDs are resolved once in the constructor, so each read or write is
+// just one Get/SetXField call per field (no strings, no lookups).
+// The jStruct can be kept (e.g. as a static) and reused across calls, as long as the class is
+// not unloaded: it holds a global reference to the class.
+template<class T>
+class jStruct
+{
+public:
+
+	jStruct() = delete;
+
+	// str_classname is the fully-specified class name, e.g. com/example/Detection
+	jStruct(JNIEnv* env_, std::string str_classname)
+	{
+		env = env_;
+		jclass cls_local = env->FindClass(str_classname.c_str());
+		init(cls_local);
+		env->DeleteLocalRef(cls_local);
+	}
+
+	jStruct(JNIEnv* env_, jclass cls_)
+	{
+		env = env_;
+		init(cls_);
+	}
+
+	~jStruct()
+	{
+		if (cls != nullptr) env->DeleteGlobalRef(cls);
+	}
+
+	jStruct(const jStruct&) = delete;
+	jStruct& operator=(const jStruct&) = delete;
+
+	// false if the class or one of the fields was not found (a java exception is then pending)
+	bool is_valid() const { return valid; }
+
+	// the JNIEnv is only valid in its own thread: call this before using the jStruct in another thread
+	void set_env(JNIEnv* env_) { env = env_; }
+
+	// returns false (with a java exception pending) if the jStruct is not valid or obj is null
+	bool read(jobject obj, T &s)
+	{
+		if (!check_usable(obj, false)) return false;
+		jStructTraits<T>::read(env, obj, ids, s);
+		return true;
+	}
+
+	T read(jobject obj)
+	{
+		T s = T();
+		read(obj, s);
+		return s;
+	}
+
+	bool write(jobject obj, const T &s)
+	{
+		if (!check_usable(obj, false)) return false;
+		jStructTraits<T>::write(env, obj, ids, s);
+		return true;
+	}
+
+	// create a new java object (with its no-argument constructor) holding s.
+	// returns nullptr (with a java exception pending) if the class has no such constructor.
+	jobject create(const T &s)
+	{
+		if (!check_usable(nullptr, true)) return nullptr;
+		jobject obj = env->NewObject(cls, constructor_methodID);
+		if (obj != nullptr) write(obj, s);
+		return obj;
+	}
+
+	// read all the objects of a java array (local references are freed chunk by chunk).
+	// returns an empty vector (with a java exception pending) if one of them cannot be read.
+	std::vector<T> read_array(jobjectArray arr)
+	{
+		if (!check_usable(arr, false)) return std::vector<T>();
+		jsize n = env->GetArrayLength(arr);
+		std::vector<T> v(n);
+		for (jsize i0 = 0; i0 < n; i0 += 256)
+		{
+			jsize i1 = std::min<jsize>(i0 + 256, n);
+			if (env->PushLocalFrame(i1 - i0) != 0) return std::vector<T>();
+			for (jsize i = i0; i < i1; i++)
+			{
+				if (!read(env->GetObjectArrayElement(arr, i), v[i]))
+				{
+					env->PopLocalFrame(nullptr);
+					return std::vector<T>();
+				}
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		return v;
+	}
+
+	// create a new java array of objects holding the elements of v
+	jobjectArray create_array(const std::vector<T> &v)
+	{
+		if (!check_usable(nullptr, true)) return nullptr;
+		jobjectArray arr = env->NewObjectArray(v.size(), cls, nullptr);
+		if (arr == nullptr) return nullptr;
+		for (size_t i0 = 0; i0 < v.size(); i0 += 256)
+		{
+			size_t i1 = std::min<size_t>(i0 + 256, v.size());
+			if (env->PushLocalFrame(static_cast<jint>(i1 - i0)) != 0) { env->DeleteLocalRef(arr); return nullptr; }
+			for (size_t i = i0; i < i1; i++)
+			{
+				jobject obj = create(v[i]);
+				if (obj == nullptr)
+				{
+					env->PopLocalFrame(nullptr);
+					env->DeleteLocalRef(arr);
+					return nullptr;
+				}
+				env->SetObjectArrayElement(arr, i, obj);
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		return arr;
+	}
+
+private:
+
+	JNIEnv* env;
+	jclass cls;
+	jmethodID constructor_methodID;
+	jfieldID ids[jStructTraits<T>::nfields];
+	bool valid;
+
+	// the field IDs (and for create(), the constructor) must have been resolved, and obj must
+	// not be null (pass nullptr as obj when there is no object yet)
+	bool check_usable(jobject obj, bool needs_constructor)
+	{
+		// an exception from init() may still be pending, and no JNI call is allowed then
+		if (env->ExceptionCheck()) return false;
+		std::string str_error;
+		if (!valid)
+			str_error = "the class or one of its fields was not found";
+		else if (needs_constructor && constructor_methodID == nullptr)
+			str_error = "the class has no no-argument constructor";
+		else if (!needs_constructor && obj == nullptr)
+			str_error = "null object";
+		else
+			return true;
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: jStruct: " + str_error);
+		return false;
+	}
+
+	void init(jclass cls_local)
+	{
+		cls = nullptr;
+		constructor_methodID = nullptr;
+		valid = false;
+		if (cls_local == nullptr) return;
+		cls = static_cast<jclass>(env->NewGlobalRef(cls_local));
+		// stops at the first missing field, since NoSuchFieldError is then pending
+		int i_missing = jStructTraits<T>::resolve(env, cls, ids);
+		if (i_missing >= 0)
+		{
+			env->ExceptionClear();
+			jni_utils ju(env);
+			ju.throw_exception(std::string("ERROR from JNI: field not found (or with a different type): ") + jStructTraits<T>::name(i_missing));
+			return;
+		}
+		// the no-argument constructor is optional (only needed by create())
+		constructor_methodID = env->GetMethodID(cls, "<init>", "()V");
+		if (constructor_methodID == nullptr) env->ExceptionClear();
+		valid = true;
+	}
+};
+
+// columnar (structure of arrays) access to a java array of objects of one class,
+// e.g. a Detection[] of 100k elements to std::vector<float> x, y, score:
+//
+// std::vector<jint> x, y; std::vector<float> score;
+// jColumns cols(env, "com/example/Detection");
+// cols.add("x", x); cols.add("y", y);
+// cols.add<jdouble>("score", score); // java double field, converted to float
+// cols.extract(arr);
+//
+// The field IDs are resolved once when the columns are added. The objects are then visited
+// in local-frame chunks with one Get/SetXField call per field, straight into the column buffers.
+// A column whose C++ type differs from the java field type is staged in the java type and
+// converted afterwards in parallel (jni_parallel_for).
+// inject() does the reverse, writing the columns into existing objects or into new ones.
+class jColumns
+{
+public:
+
+	jColumns() = delete;
+
+	// str_classname is the fully-specified class name, e.g. com/example/Detection
+	jColumns(JNIEnv* env_, std::string str_classname)
+	{
+		env = env_;
+		jclass cls_local = env->FindClass(str_classname.c_str());
+		cls = cls_local == nullptr ? nullptr : static_cast<jclass>(env->NewGlobalRef(cls_local));
+		env->DeleteLocalRef(cls_local);
+		constructor_methodID = nullptr;
+	}
+
+	~jColumns()
+	{
+		if (cls != nullptr) env->DeleteGlobalRef(cls);
+	}
+
+	jColumns(const jColumns&) = delete;
+	jColumns& operator=(const jColumns&) = delete;
+
+	// add a column for the java field name_field of JNI type T_java (jint, jfloat, jdouble, etc.),
+	// stored in col (converted to T if T is not T_java). T_java defaults to T.
+	// col must outlive the jColumns.
+	template<class T_java = void, class T>
+	bool add(std::string name_field, std::vector<T> &col)
+	{
+		typedef typename std::conditional<std::is_void<T_java>::value, T, T_java>::type T_field;
+		if (cls == nullptr) return false;
+		jfieldID id = env->GetFieldID(cls, name_field.c_str(), get_signature_jtype<T_field>("").c_str());
+		if (id == nullptr)
+		{
+			env->ExceptionClear();
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: field not found (or with a different type): " + name_field);
+			return false;
+		}
+		columns.push_back(std::unique_ptr<column_base>(new column<T_field, T>(id, col)));
+		return true;
+	}
+
+	// fill the columns with the fields of all the objects of arr
+	bool extract(jobjectArray arr, int nthreads = 0)
+	{
+		jsize n = env->GetArrayLength(arr);
+		for (size_t c = 0; c < columns.size(); c++)
+			columns[c]->resize(n);
+		for (jsize i0 = 0; i0 < n; i0 += nobjs_per_frame)
+		{
+			jsize i1 = std::min(i0 + nobjs_per_frame, n);
+			if (env->PushLocalFrame(i1 - i0) != 0) return false;
+			for (jsize i = i0; i < i1; i++)
+			{
+				jobject obj = env->GetObjectArrayElement(arr, i);
+				for (size_t c = 0; c < columns.size(); c++)
+					columns[c]->get(env, obj, i);
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		for (size_t c = 0; c < columns.size(); c++)
+			columns[c]->convert_from_java(nthreads);
+		return true;
+	}
+
+	// write the columns (which should have at least as many elements as arr) into the objects of arr
+	bool inject(jobjectArray arr, int nthreads = 0)
+	{
+		jsize n = env->GetArrayLength(arr);
+		if (!check_sizes(n)) return false;
+		for (size_t c = 0; c < columns.size(); c++)
+			columns[c]->convert_to_java(nthreads);
+		for (jsize i0 = 0; i0 < n; i0 += nobjs_per_frame)
+		{
+			jsize i1 = std::min(i0 + nobjs_per_frame, n);
+			if (env->PushLocalFrame(i1 - i0) != 0) return false;
+			for (jsize i = i0; i < i1; i++)
+			{
+				jobject obj = env->GetObjectArrayElement(arr, i);
+				for (size_t c = 0; c < columns.size(); c++)
+					columns[c]->set(env, obj, i);
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		return true;
+	}
+
+	// create a new java array of n objects (made with the no-argument constructor of the class)
+	// holding the columns
+	jobjectArray inject_new(jsize n, int nthreads = 0)
+	{
+		if (cls == nullptr || !check_sizes(n)) return nullptr;
+		if (constructor_methodID == nullptr)
+			constructor_methodID = env->GetMethodID(cls, "<init>", "()V");
+		if (constructor_methodID == nullptr) return nullptr;
+		jobjectArray arr = env->NewObjectArray(n, cls, nullptr);
+		if (arr == nullptr) return nullptr;
+		for (size_t c = 0; c < columns.size(); c++)
+			columns[c]->convert_to_java(nthreads);
+		for (jsize i0 = 0; i0 < n; i0 += nobjs_per_frame)
+		{
+			jsize i1 = std::min(i0 + nobjs_per_frame, n);
+			if (env->PushLocalFrame(i1 - i0) != 0) { env->DeleteLocalRef(arr); return nullptr; }
+			for (jsize i = i0; i < i1; i++)
+			{
+				jobject obj = env->NewObject(cls, constructor_methodID);
+				if (obj == nullptr) { env->PopLocalFrame(nullptr); env->DeleteLocalRef(arr); return nullptr; }
+				for (size_t c = 0; c < columns.size(); c++)
+					columns[c]->set(env, obj, i);
+				env->SetObjectArrayElement(arr, i, obj);
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		return arr;
+	}
+
+private:
+
+	// type-erased column
+	struct column_base
+	{
+		virtual ~column_base() {}
+		virtual size_t size() const = 0;
+		virtual void resize(size_t n) = 0;
+		virtual void get(JNIEnv* env, jobject obj, size_t i) = 0;
+		virtual void set(JNIEnv* env, jobject obj, size_t i) = 0;
+		virtual void convert_from_java(int nthreads) = 0;
+		virtual void convert_to_java(int nthreads) = 0;
+	};
+
+	template<class T_java, class T>
+	struct column : public column_base
+	{
+		jfieldID id;
+		std::vector<T> &col;
+		std::vector<T_java> staging; // only used if T is not T_java
+
+		column(jfieldID id_, std::vector<T> &col_) : id(id_), col(col_) {}
+
+		static const bool same_type = std::is_same<T_java, T>::value;
+
+		size_t size() const { return col.size(); }
+
+		void resize(size_t n)
+		{
+			col.resize(n);
+			if (!same_type) staging.resize(n);
+		}
+
+		T_java* target() { return same_type ? reinterpret_cast<T_java*>(col.data()) : staging.data(); }
+
+		void get(JNIEnv* env, jobject obj, size_t i) { target()[i] = GetFieldFunctor<T_java>()(env, obj, id); }
+		void set(JNIEnv* env, jobject obj, size_t i) { SetFieldFunctor<T_java>()(env, obj, id, target()[i]); }
+
+		void convert_from_java(int nthreads)
+		{
+			if (same_type) return;
+			T* p_out = col.data();
+			const T_java* p_in = staging.data();
+			jni_parallel_for(col.size(), [=](size_t idx_begin, size_t idx_end)
+			{
+				for (size_t idx = idx_begin; idx < idx_end; idx++)
+					p_out[idx] = static_cast<T>(p_in[idx]);
+			}, nthreads, 1 << 14);
+		}
+
+		void convert_to_java(int nthreads)
+		{
+			if (same_type) return;
+			staging.resize(col.size());
+			T_java* p_out = staging.data();
+			const T* p_in = col.data();
+			jni_parallel_for(col.size(), [=](size_t idx_begin, size_t idx_end)
+			{
+				for (size_t idx = idx_begin; idx < idx_end; idx++)
+					p_out[idx] = static_cast<T_java>(p_in[idx]);
+			}, nthreads, 1 << 14);
+		}
+	};
+
+	JNIEnv* env;
+	jclass cls;
+	jmethodID constructor_methodID;
+	std::vector<std::unique_ptr<column_base> > columns;
+
+	// number of objects handled per local frame
+	static const jsize nobjs_per_frame = 256;
+
+	bool check_sizes(jsize n)
+	{
+		for (size_t c = 0; c < columns.size(); c++)
+		{
+			if (columns[c]->size() < static_cast<size_t>(n))
+			{
+				jni_utils ju(env);
+				ju.throw_exception("ERROR from JNI: a column has fewer elements than the number of objects.");
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// compile-time index sequence (std::index_sequence is C++14), used to unpack tuples
+template<size_t... Is> struct jIndexSeq {};
+template<size_t N, size_t... Is> struct jMakeIndexSeq : jMakeIndexSeq<N - 1, N - 1, Is...> {};
+template<size_t... Is> struct jMakeIndexSeq<0, Is...> { typedef jIndexSeq<Is...> type; };
+
+// store a JNI value in a jvalue (for the Call...MethodA and NewObjectA functions)
+inline void set_jvalue(jvalue &v, jboolean x) { v.z = x; }
+inline void set_jvalue(jvalue &v, jbyte x) { v.b = x; }
+inline void set_jvalue(jvalue &v, jchar x) { v.c = x; }
+inline void set_jvalue(jvalue &v, jshort x) { v.s = x; }
+inline void set_jvalue(jvalue &v, jint x) { v.i = x; }
+inline void set_jvalue(jvalue &v, jlong x) { v.j = x; }
+inline void set_jvalue(jvalue &v, jfloat x) { v.f = x; }
+inline void set_jvalue(jvalue &v, jdouble x) { v.d = x; }
+inline void set_jvalue(jvalue &v, jobject x) { v.l = x; }
+
+// constructs many java objects of one class with the same constructor in one native pass,
+// into a java array or a java.util.ArrayList. types_args are the JNI types of the arguments
+// of the constructor (jint, jfloat, jstring, jdoubleArray, jobject, etc.), e.g.
+//
+// jBatchConstructor<jint, jint, jfloat> bc(env, "com/example/Detection");
+// jobjectArray arr = bc.construct_array(xs, ys, scores); // from columns (std::vectors)
+// jobject list = bc.construct_ArrayList(tuples); // from a std::vector of std::tuple
+//
+// The constructor is resolved once (its signature is built from types_args, except when an
+// argument is a jobject: then sig_constructor must be given, e.g. "(ILjava/util/Date;)V").
+// Objects are created with NewObjectA (no variadic argument promotion) in local frames.
+template<class... types_args>
+class jBatchConstructor
+{
+public:
+
+	typedef std::tuple<types_args...> tuple_type;
+
+	jBatchConstructor() = delete;
+
+	jBatchConstructor(JNIEnv* env_, std::string str_classname, std::string sig_constructor = "")
+	{
+		env = env_;
+		constructor_methodID = nullptr;
+		jclass cls_local = env->FindClass(str_classname.c_str());
+		cls = cls_local == nullptr ? nullptr : static_cast<jclass>(env->NewGlobalRef(cls_local));
+		env->DeleteLocalRef(cls_local);
+		if (cls == nullptr) return;
+		if (sig_constructor.empty())
+		{
+			std::string sigs_args[] = { std::string(), get_signature_jtype<types_args>("")... };
+			sig_constructor = "(";
+			for (size_t i = 1; i < sizeof(sigs_args) / sizeof(sigs_args[0]); i++)
+				sig_constructor += sigs_args[i];
+			sig_constructor += ")V";
+		}
+		constructor_methodID = env->GetMethodID(cls, "<init>", sig_constructor.c_str());
+	}
+
+	~jBatchConstructor()
+	{
+		if (cls != nullptr) env->DeleteGlobalRef(cls);
+	}
+
+	jBatchConstructor(const jBatchConstructor&) = delete;
+	jBatchConstructor& operator=(const jBatchConstructor&) = delete;
+
+	// false if the class or the constructor was not found (a java exception is then pending)
+	bool is_valid() const { return constructor_methodID != nullptr; }
+
+	// one object per tuple of arguments
+	jobjectArray construct_array(const std::vector<tuple_type> &tuples)
+	{
+		return construct_array_general(tuples.size(), [&](size_t i) { return new_object(tuples[i]); });
+	}
+
+	// one object per index of the columns (all of the same size), the k-th column giving
+	// the k-th argument of the constructor
+	jobjectArray construct_array(const std::vector<types_args>&... columns)
+	{
+		size_t n;
+		if (!check_columns(n, columns...)) return nullptr;
+		return construct_array_general(n, [&](size_t i) { return new_object(tuple_type(columns[i]...)); });
+	}
+
+	jobject construct_ArrayList(const std::vector<tuple_type> &tuples)
+	{
+		return construct_ArrayList_general(tuples.size(), [&](size_t i) { return new_object(tuples[i]); });
+	}
+
+	jobject construct_ArrayList(const std::vector<types_args>&... columns)
+	{
+		size_t n;
+		if (!check_columns(n, columns...)) return nullptr;
+		return construct_ArrayList_general(n, [&](size_t i) { return new_object(tuple_type(columns[i]...)); });
+	}
+
+	// a single object
+	jobject construct(types_args... args)
+	{
+		return new_object(tuple_type(args...));
+	}
+
+private:
+
+	JNIEnv* env;
+	jclass cls;
+	jmethodID constructor_methodID;
+
+	// number of objects created per local frame
+	static const int nobjs_per_frame = 256;
+
+	jobject new_object(const tuple_type &t)
+	{
+		return new_object(t, typename jMakeIndexSeq<sizeof...(types_args)>::type());
+	}
+
+	template<size_t... Is>
+	jobject new_object(const tuple_type &t, jIndexSeq<Is...>)
+	{
+		jvalue args[sizeof...(types_args) + 1];
+		int dummy[] = { 0, (set_jvalue(args[Is], std::get<Is>(t)), 0)... };
+		(void)dummy;
+		return env->NewObjectA(cls, constructor_methodID, args);
+	}
+
+	bool check_columns(size_t &n, const std::vector<types_args>&... columns)
+	{
+		size_t sizes[] = { 0, columns.size()... };
+		n = sizeof...(types_args) > 0 ? sizes[1] : 0;
+		for (size_t k = 1; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+		{
+			if (sizes[k] != n)
+			{
+				jni_utils ju(env);
+				ju.throw_exception("ERROR from JNI: all the columns of arguments must have the same size.");
+				return false;
+			}
+		}
+		return true;
+	}
+
+	template<class F>
+	jobjectArray construct_array_general(size_t n, F new_obj)
+	{
+		if (!is_valid()) return nullptr;
+		jobjectArray arr = env->NewObjectArray(static_cast<jsize>(n), cls, nullptr);
+		if (arr == nullptr) return nullptr;
+		for (size_t i0 = 0; i0 < n; i0 += nobjs_per_frame)
+		{
+			size_t i1 = std::min<size_t>(i0 + nobjs_per_frame, n);
+			if (env->PushLocalFrame(static_cast<jint>(i1 - i0)) != 0) return nullptr;
+			for (size_t i = i0; i < i1; i++)
+			{
+				jobject obj = new_obj(i);
+				if (obj == nullptr) { env->PopLocalFrame(nullptr); return nullptr; }
+				env->SetObjectArrayElement(arr, static_cast<jsize>(i), obj);
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		return arr;
+	}
+
+	template<class F>
+	jobject construct_ArrayList_general(size_t n, F new_obj)
+	{
+		if (!is_valid()) return nullptr;
+		jclass cls_list = env->FindClass("java/util/ArrayList");
+		jmethodID mID_init = env->GetMethodID(cls_list, "<init>", "(I)V");
+		jmethodID mID_add = env->GetMethodID(cls_list, "add", "(Ljava/lang/Object;)Z");
+		jobject list = env->NewObject(cls_list, mID_init, static_cast<jint>(n));
+		env->DeleteLocalRef(cls_list);
+		if (list == nullptr) return nullptr;
+		for (size_t i0 = 0; i0 < n; i0 += nobjs_per_frame)
+		{
+			size_t i1 = std::min<size_t>(i0 + nobjs_per_frame, n);
+			if (env->PushLocalFrame(static_cast<jint>(i1 - i0)) != 0) return nullptr;
+			for (size_t i = i0; i < i1; i++)
+			{
+				jobject obj = new_obj(i);
+				if (obj == nullptr) { env->PopLocalFrame(nullptr); return nullptr; }
+				env->CallBooleanMethod(list, mID_add, obj);
+			}
+			env->PopLocalFrame(nullptr);
+		}
+		return list;
+	}
+};
+
+// batcher of native events (e.g. detections) for java: records of type T_record (a trivially
+// copyable struct) are appended into a reusable native buffer and delivered to java in one
+// upcall per batch instead of one call_method per event:
+//	void onEvents(java.nio.ByteBuffer records, int count)  (use_direct_buffer, the default)
+//	void onEvents(byte[] records, int count)
+// with the records laid out as in C++ (read them with order(ByteOrder.nativeOrder())).
+// A batch is flushed when capacity records are buffered, when the oldest buffered record is
+// max_delay_ms old (checked on append, and by a background thread if start_timer() is called),
+// on flush(), and on destruction (or at the end of the scope of a flush_guard).
+// There are two buffers, so appends go on while the other one is being delivered. When both
+// are full, the overflow policy decides: block until the delivery ends, drop the new record,
+// or overwrite the oldest buffered one. The direct buffers and the byte[] are reused, so java
+// must consume (or copy) the records before returning from the upcall.
+// Appends may come from several threads; the upcall is made on the thread that triggers the
+// flush (attached to the JVM as a daemon if needed). An exception thrown by the java method is
+// left pending for the caller, except on the timer thread where it is described and cleared.
+// While an exception is pending on the calling thread, no JNI call is made: flushes from that
+// thread are skipped (the records stay buffered, and new records are dropped once the buffer is
+// full) until the caller clears the exception.
+template<class T_record>
+class jEventBatcher
+{
+public:
+
+	enum overflow_policy { block, drop_newest, drop_oldest };
+
+	jEventBatcher() = delete;
+	jEventBatcher(const jEventBatcher&) = delete;
+	jEventBatcher& operator=(const jEventBatcher&) = delete;
+
+	jEventBatcher(JNIEnv* env, jobject target_, std::string method_name, size_t capacity_, double max_delay_ms = 10, bool use_direct_buffer_ = true, overflow_policy policy_ = block)
+	{
+		static_assert(std::is_trivially_copyable<T_record>::value, "T_record must be trivially copyable");
+		env->GetJavaVM(&vm);
+		capacity = std::max<size_t>(1, capacity_);
+		max_delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(max_delay_ms));
+		use_direct_buffer = use_direct_buffer_;
+		policy = policy_;
+		active = 0;
+		start = count = 0;
+		flushing = stop = false;
+		nupcalls = nrecords = ndropped = 0;
+		payload[0] = payload[1] = nullptr;
+
+		target = env->NewGlobalRef(target_);
+		jclass cls = env->GetObjectClass(target);
+		methodID = env->GetMethodID(cls, method_name.c_str(), use_direct_buffer ? "(Ljava/nio/ByteBuffer;I)V" : "([BI)V");
+		env->DeleteLocalRef(cls);
+		if (methodID == nullptr) return; // NoSuchMethodError is pending
+
+		jlong nbytes = static_cast<jlong>(capacity * sizeof(T_record));
+		for (int i = 0; i < 2; i++)
+		{
+			bufs[i].resize(capacity);
+			if (!use_direct_buffer) continue;
+			jobject b = env->NewDirectByteBuffer(bufs[i].data(), nbytes);
+			payload[i] = env->NewGlobalRef(b);
+			env->DeleteLocalRef(b);
+		}
+		if (!use_direct_buffer)
+		{
+			// one java array is enough since it is filled at flush time
+			jbyteArray arr = env->NewByteArray(static_cast<jsize>(nbytes));
+			payload[0] = payload[1] = env->NewGlobalRef(arr);
+			env->DeleteLocalRef(arr);
+		}
+	}
+
+	~jEventBatcher()
+	{
+		stop_timer();
+		JNIEnv* env = get_env();
+		if (methodID != nullptr) flush();
+		if (env == nullptr) return;
+		if (payload[0] != nullptr) env->DeleteGlobalRef(payload[0]);
+		if (use_direct_buffer && payload[1] != nullptr) env->DeleteGlobalRef(payload[1]);
+		env->DeleteGlobalRef(target);
+	}
+
+	// returns false if the record was dropped (drop_newest policy, or full buffer with an exception pending)
+	bool append(const T_record &r)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		// the lock is released during a flush, so other threads may fill the buffer again meanwhile
+		while (count == capacity)
+		{
+			if (flushing && policy == drop_newest)
+			{
+				ndropped++;
+				return false;
+			}
+			if (flushing && policy == drop_oldest)
+			{
+				bufs[active][start] = r;
+				start = (start + 1) % capacity;
+				ndropped++;
+				return true;
+			}
+			if (!flush_locked(lock))
+			{
+				// exception pending on this thread, so the buffer cannot be delivered
+				ndropped++;
+				return false;
+			}
+		}
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		bufs[active][(start + count) % capacity] = r;
+		if (count++ == 0)
+		{
+			t_first = now;
+			cv_timer.notify_one();
+		}
+		if (!flushing && (count == capacity || now - t_first >= max_delay))
+			flush_locked(lock);
+		return true;
+	}
+
+	// returns the number of records not dropped
+	size_t append(const T_record* rs, size_t n)
+	{
+		size_t nappended = 0;
+		for (size_t i = 0; i < n; i++)
+			nappended += append(rs[i]) ? 1 : 0;
+		return nappended;
+	}
+
+	// deliver the buffered records now (after any delivery in progress).
+	// returns false if they could not be delivered because an exception is pending.
+	bool flush()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		return flush_locked(lock);
+	}
+
+	// flush if the oldest buffered record is at least max_delay_ms old (e.g. from a frame loop)
+	bool flush_if_due()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		if (count == 0 || flushing || std::chrono::steady_clock::now() - t_first < max_delay) return false;
+		return flush_locked(lock);
+	}
+
+	// background thread (attached to the JVM as a daemon) that flushes batches when they are
+	// due even if no more events arrive
+	void start_timer()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (timer.joinable()) return;
+		stop = false;
+		timer = std::thread(&jEventBatcher::timer_loop, this);
+	}
+
+	void stop_timer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		cv_timer.notify_one();
+		if (timer.joinable()) timer.join();
+	}
+
+	// flushes the batcher at the end of its scope, e.g. { auto g = batcher.guard(); ... }
+	class flush_guard
+	{
+	public:
+		flush_guard(jEventBatcher &b_) : b(&b_) {}
+		flush_guard(flush_guard &&g) : b(g.b) { g.b = nullptr; }
+		flush_guard(const flush_guard&) = delete;
+		~flush_guard() { if (b != nullptr) b->flush(); }
+	private:
+		jEventBatcher* b;
+	};
+
+	flush_guard guard() { return flush_guard(*this); }
+
+	bool is_valid() const { return methodID != nullptr; }
+	size_t get_capacity() const { return capacity; }
+	unsigned long long get_nupcalls() const { return nupcalls; }
+	unsigned long long get_nrecords() const { return nrecords; }
+	unsigned long long get_ndropped() const { return ndropped; }
+
+	void print_stats()
+	{
+		printf("jEventBatcher stats: #upcalls = %llu, #records = %llu, records per upcall = %.1f, #dropped = %llu\n",
+			(unsigned long long)nupcalls, (unsigned long long)nrecords, nupcalls == 0 ? 0.0 : static_cast<double>(nrecords) / nupcalls, (unsigned long long)ndropped);
+	}
+
+private:
+
+	JavaVM* vm;
+	jobject target;
+	jmethodID methodID;
+	jobject payload[2]; // direct buffers over bufs (or twice the same byte[])
+	std::vector<T_record> bufs[2];
+	bool use_direct_buffer;
+	overflow_policy policy;
+	size_t capacity;
+	std::chrono::steady_clock::duration max_delay;
+
+	std::mutex mtx;
+	std::condition_variable cv_flushed, cv_timer;
+	int active; // buffer receiving the appends
+	size_t start, count; // records of the active buffer, start is only non zero after drop_oldest overwrites
+	std::chrono::steady_clock::time_point t_first; // time of the oldest buffered record
+	bool flushing, stop;
+	std::thread timer;
+	std::atomic<unsigned long long> nupcalls, nrecords, ndropped;
+
+	JNIEnv* get_env()
+	{
+		JNIEnv* env = nullptr;
+		jint r = vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6);
+		if (r == JNI_EDETACHED && vm->AttachCurrentThreadAsDaemon(reinterpret_cast<void**>(&env), nullptr) != JNI_OK)
+			return nullptr;
+		return env;
+	}
+
+	// called and returns with the lock held, which is released during the upcall.
+	// returns false, without delivering anything, if an exception is pending on this thread.
+	bool flush_locked(std::unique_lock<std::mutex> &lock, bool on_timer = false)
+	{
+		while (flushing) cv_flushed.wait(lock);
+		if (count == 0 || methodID == nullptr) return true;
+		JNIEnv* env = get_env();
+		if (env != nullptr && env->ExceptionCheck()) return false;
+		std::vector<T_record> &b = bufs[active];
+		if (start != 0)
+			std::rotate(b.begin(), b.begin() + start, b.end());
+		jobject p = payload[active];
+		size_t n = count;
+		active ^= 1;
+		start = count = 0;
+		flushing = true;
+		lock.unlock();
+
+		if (env != nullptr)
+		{
+			if (!use_direct_buffer)
+				env->SetByteArrayRegion(static_cast<jbyteArray>(p), 0, static_cast<jsize>(n * sizeof(T_record)), reinterpret_cast<const jbyte*>(b.data()));
+			env->CallVoidMethod(target, methodID, p, static_cast<jint>(n));
+			if (on_timer && env->ExceptionCheck())
+			{
+				env->ExceptionDescribe();
+				env->ExceptionClear();
+			}
+			nupcalls++;
+			nrecords += n;
+		}
+
+		lock.lock();
+		flushing = false;
+		cv_flushed.notify_all();
+		return true;
+	}
+
+	void timer_loop()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!stop)
+		{
+			if (count == 0 || flushing)
+				cv_timer.wait_for(lock, max_delay);
+			else if (std::chrono::steady_clock::now() - t_first >= max_delay)
+				flush_locked(lock, true);
+			else
+				cv_timer.wait_until(lock, t_first + max_delay);
+		}
+		lock.unlock();
+		vm->DetachCurrentThread();
+	}
+};
+
+// strides (in elements) between consecutive rows, cols and channels of a jArray,
+// computed once whenever the array is wrapped or created.
+struct jArrayStrides
+{
+	int si, sj, sk;
+};
+
+// memory layout policies for jArray (template parameter T_layout).
+// Each gives the linear index of the element (i, j, k) from the precomputed strides,
+// so the accessors never branch on the layout. With jArrayLayout_colMajor and
+// jArrayLayout_rowMajor the unit stride is a compile-time constant, so loops over
+// get_val()/set_val() or over the row/col/channel slices can be vectorized.
+// The *_stride_fixed constants are the compile-time strides of the slices
+// returned by jArray::row(), col() and channel() (0 means only known at runtime).
+
+// col major, one channel after another: ptr_data[k * nr * nc + j * nr + i]
+struct jArrayLayout_colMajor
+{
+	static const bool is_fixed = true;
+	static const bool colMajor = true;
+	static const int row_stride_fixed = 0;
+	static const int col_stride_fixed = 1;
+	static const int channel_stride_fixed = 1;
+	static int index(int i, int j, int k, const jArrayStrides &s) { return i + j * s.sj + k * s.sk; }
+};
+
+// row major, interleaved channels (same as cv::Mat): ptr_data[i * nch * nc + j * nch + k]
+struct jArrayLayout_rowMajor
+{
+	static const bool is_fixed = true;
+	static const bool colMajor = false;
+	static const int row_stride_fixed = 0;
+	static const int col_stride_fixed = 0;
+	static const int channel_stride_fixed = 0;
+	static int index(int i, int j, int k, const jArrayStrides &s) { return i * s.si + j * s.sj + k; }
+};
+
+// layout chosen at runtime (the colMajor argument of wrap() and create_new()),
+// or any custom strides given with jArray::set_strides(). This is the default.
+struct jArrayLayout_strided
+{
+	static const bool is_fixed = false;
+	static const bool colMajor = true; // not used
+	static const int row_stride_fixed = 0;
+	static const int col_stride_fixed = 0;
+	static const int channel_stride_fixed = 0;
+	static int index(int i, int j, int k, const jArrayStrides &s) { return i * s.si + j * s.sj + k * s.sk; }
+};
+
+// random access iterator with a (runtime or compile-time) stride, used to iterate over
+// the rows, cols and channels of a jArray (see jArraySlice below) with the standard algorithms,
+// e.g. std::sort(a.col(2).begin(), a.col(2).end());
+template<class T, int stride_fixed = 0>
+class jStridedIterator
+{
+public:
+
+	typedef std::random_access_iterator_tag iterator_category;
+	typedef T value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef T* pointer;
+	typedef T& reference;
+
+	jStridedIterator() : ptr(nullptr), stride(1) {}
+	jStridedIterator(T* ptr_, std::ptrdiff_t stride_) : ptr(ptr_), stride(stride_) {}
+
+	T& operator*() const { return *ptr; }
+	T* operator->() const { return ptr; }
+	T& operator[](std::ptrdiff_t n) const { return ptr[n * get_stride()]; }
+
+	jStridedIterator& operator++() { ptr += get_stride(); return *this; }
+	jStridedIterator operator++(int) { jStridedIterator tmp = *this; ptr += get_stride(); return tmp; }
+	jStridedIterator& operator--() { ptr -= get_stride(); return *this; }
+	jStridedIterator operator--(int) { jStridedIterator tmp = *this; ptr -= get_stride(); return tmp; }
+	jStridedIterator& operator+=(std::ptrdiff_t n) { ptr += n * get_stride(); return *this; }
+	jStridedIterator& operator-=(std::ptrdiff_t n) { ptr -= n * get_stride(); return *this; }
+	jStridedIterator operator+(std::ptrdiff_t n) const { return jStridedIterator(ptr + n * get_stride(), stride); }
+	jStridedIterator operator-(std::ptrdiff_t n) const { return jStridedIterator(ptr - n * get_stride(), stride); }
+	friend jStridedIterator operator+(std::ptrdiff_t n, const jStridedIterator &it) { return it + n; }
+	std::ptrdiff_t operator-(const jStridedIterator &other) const { return (ptr - other.ptr) / get_stride(); }
+
+	bool operator==(const jStridedIterator &other) const { return ptr == other.ptr; }
+	bool operator!=(const jStridedIterator &other) const { return ptr != other.ptr; }
+	bool operator<(const jStridedIterator &other) const { return ptr < other.ptr; }
+	bool operator>(const jStridedIterator &other) const { return ptr > other.ptr; }
+	bool operator<=(const jStridedIterator &other) const { return ptr <= other.ptr; }
+	bool operator>=(const jStridedIterator &other) const { return ptr >= other.ptr; }
+
+	std::ptrdiff_t get_stride() const { return stride_fixed > 0 ? stride_fixed : stride; }
+
+private:
+
+	T* ptr;
+	std::ptrdiff_t stride;
+};
+
+// minimal C++11 replacement for std::span: a non-owning view of n contiguous elements.
+// Its begin()/end() are raw pointers, so it can be used with the standard algorithms
+// (including the C++17 parallel ones), e.g.
+// jSpan<double> s = a.as_span(); std::sort(std::execution::par_unseq, s.begin(), s.end());
+template<class T>
+class jSpan
+{
+public:
+
+	typedef T element_type;
+	typedef T value_type;
+	typedef size_t size_type;
+	typedef T* iterator;
+
+	jSpan() : ptr(nullptr), n(0) {}
+	jSpan(T* ptr_, size_t n_) : ptr(ptr_), n(n_) {}
+
+	T* data() const { return ptr; }
+	size_t size() const { return n; }
+	size_t size_bytes() const { return n * sizeof(T); }
+	bool empty() const { return n == 0; }
+	T& operator[](size_t idx) const { return ptr[idx]; }
+	T* begin() const { return ptr; }
+	T* end() const { return ptr + n; }
+	T& front() const { return ptr[0]; }
+	T& back() const { return ptr[n - 1]; }
+
+	jSpan first(size_t count) const { return jSpan(ptr, count); }
+	jSpan last(size_t count) const { return jSpan(ptr + n - count, count); }
+	jSpan subspan(size_t offset, size_t count) const { return jSpan(ptr + offset, count); }
+
+private:
+
+	T* ptr;
+	size_t n;
+};
+
+// strided 1D view of a row, col or channel of a jArray, for writing tight loops such as
+// for (int x = 0; x < s.size(); x++) s[x] *= 2;
+// or for the standard algorithms through begin() and end().
+// stride_fixed > 0 is a compile-time stride (1 means contiguous, see is_contiguous()
+// and data()); otherwise the stride is only known at runtime.
+template<class T, int stride_fixed = 0>
+class jArraySlice
+{
+public:
+
+	jArraySlice(T* ptr_, int n_, int stride_)
+	{
+		ptr = ptr_;
+		n = n_;
+		stride = stride_;
+	}
+
+	T& operator[](int idx) { return ptr[idx * get_stride()]; }
+	const T& operator[](int idx) const { return ptr[idx * get_stride()]; }
+
+	int size() const { return n; }
+	int get_stride() const { return stride_fixed > 0 ? stride_fixed : stride; }
+	bool is_contiguous() const { return get_stride() == 1; }
+	T* data() { return ptr; }
+	jStridedIterator<T, stride_fixed> begin() { return jStridedIterator<T, stride_fixed>(ptr, get_stride()); }
+	jStridedIterator<T, stride_fixed> end() { return jStridedIterator<T, stride_fixed>(ptr + static_cast<std::ptrdiff_t>(n) * get_stride(), get_stride()); }
+
+private:
+
+	T* ptr;
+	int n;
+	int stride;
+};
+
+// class to easily and directly manipulate java arrays
+// can also use to create a new java array or wrap an existing one.
+// T_arr should be of type jdoubleArray, jintArray, etc.
+// T should be the correponding primitive type:
+// if T_arr is jdoubleArray, T should be jdouble, etc.
+// T_layout is the memory layout policy (see jArrayLayout_colMajor, etc. above).
+// With a fixed layout policy, the colMajor arguments of wrap() and create_new() are ignored.
+template<class T_arr, class T, class T_layout = jArrayLayout_strided>
+class jArray
+{
+
+private:
+
+T_arr arr;
+T* ptr_data;
+JNIEnv* env;
+int nr, nc, nch, nd, ndpch;
+bool colMajor;
+jArrayStrides strides;
+bool currently_holding_data;
+jPinRegistry::pin pin_data;
+
+bool read_only;
+bool track_dirty;
+jboolean is_copy;
+std::vector<std::pair<int, int> > dirty_spans; // [start, end) of the modified elements
+
+// release an existing array elements so that JVM can move it
+// or garbage collect it whenever it wants.
+// read only arrays are released with JNI_ABORT, so nothing is copied back.
+// With dirty tracking, only the modified spans are copied back.
+void release_existing_array()
+{
+	if (!currently_holding_data)
+		return;
+	if (read_only)
+		jArrayOps<T_arr>::ReleaseElements(env, arr, ptr_data, JNI_ABORT);
+	else if (track_dirty)
+	{
+		write_back_dirty_spans();
+		jArrayOps<T_arr>::ReleaseElements(env, arr, ptr_data, JNI_ABORT);
+	}
+	else
+		jArrayOps<T_arr>::ReleaseElements(env, arr, ptr_data, 0);
+	pin_data.release();
+	currently_holding_data = false;
+}
+
+// nd must already be the length of arr
+void set_pointer_to_array_elements()
+{
+	ptr_data = jArrayOps<T_arr>::GetElements(env, arr, &is_copy);
+	pin_data = jPinRegistry::pin(static_cast<size_t>(nd) * sizeof(T), false);
+	dirty_spans.clear();
+}
+
+void allocate(int size)
+{
+	arr = jArrayOps<T_arr>::New(env, size);
+}
+
+// set the layout (fixed by T_layout unless it is jArrayLayout_strided) and precompute the strides
+void set_layout(bool colMajor_)
+{
+	colMajor = T_layout::is_fixed ? T_layout::colMajor : colMajor_;
+	if (colMajor)
+	{
+		strides.si = 1; strides.sj = nr; strides.sk = nr * nc;
+	}
+	else
+	{
+		strides.si = nc * nch; strides.sj = nch; strides.sk = 1;
+	}
+}
+
+// index where the element at index idx goes when converting from col major to row major
+// (colMajor_to_row = true) or vice versa. The shape (nr, nc, nch) is the same for both layouts.
+int converted_index(int idx, bool colMajor_to_row)
+{
+	int i, j, k, rem;
+	if (colMajor_to_row)
+	{
+		k = idx / ndpch; rem = idx % ndpch;
+		j = rem / nr; i = rem % nr;
+		return i * nc * nch + j * nch + k;
+	}
+	else
+	{
+		i = idx / (nc * nch); rem = idx % (nc * nch);
+		j = rem / nch; k = rem % nch;
+		return k * ndpch + j * nr + i;
+	}
+}
+
+// in-place permutation by following the cycles of the layout conversion.
+// Only needs one bit per element (to mark the already moved ones).
+void convert_layout_in_place(bool colMajor_to_row)
+{
+	std::vector<bool> visited(nd, false);
+	for (int start = 0; start < nd; start++)
+	{
+		if (visited[start]) continue;
+		visited[start] = true;
+		T val = ptr_data[start];
+		int cur = converted_index(start, colMajor_to_row);
+		while (cur != start)
+		{
+			std::swap(val, ptr_data[cur]);
+			visited[cur] = true;
+			cur = converted_index(cur, colMajor_to_row);
+		}
+		ptr_data[start] = val;
+	}
+}
+
+// out-of-place conversion into a scratch buffer, transposing each channel in cache-sized
+// blocks, then copying back. The buffer is reused across calls on the same thread, but only
+// kept while it is at most nbytes_scratch_keep so that one large array does not pin its size
+// for the lifetime of the thread.
+void convert_layout_blocked(bool colMajor_to_row)
+{
+	static thread_local std::vector<T> scratch;
+	const size_t nbytes_scratch_keep = 1 << 20;
+	const int bs = 32;
+	scratch.resize(nd);
+	T* dst = scratch.data();
+	for (int k = 0; k < nch; k++)
+		for (int j0 = 0; j0 < nc; j0 += bs)
+			for (int i0 = 0; i0 < nr; i0 += bs)
+			{
+				int j1 = std::min(j0 + bs, nc), i1 = std::min(i0 + bs, nr);
+				if (colMajor_to_row)
+				{
+					for (int i = i0; i < i1; i++)
+						for (int j = j0; j < j1; j++)
+							dst[i * nc * nch + j * nch + k] = ptr_data[k * ndpch + j * nr + i];
+				}
+				else
+				{
+					for (int j = j0; j < j1; j++)
+						for (int i = i0; i < i1; i++)
+							dst[k * ndpch + j * nr + i] = ptr_data[i * nc * nch + j * nch + k];
+				}
+			}
+	std::memcpy(ptr_data, dst, sizeof(T) * nd);
+	if (scratch.capacity() * sizeof(T) > nbytes_scratch_keep)
+		std::vector<T>().swap(scratch);
+}
+
+// sort the dirty spans and merge the overlapping or adjacent ones
+void merge_dirty_spans()
+{
+	if (dirty_spans.size() < 2) return;
+	std::sort(dirty_spans.begin(), dirty_spans.end());
+	size_t cc = 0;
+	for (size_t i = 1; i < dirty_spans.size(); i++)
+	{
+		if (dirty_spans[i].first <= dirty_spans[cc].second)
+			dirty_spans[cc].second = std::max(dirty_spans[cc].second, dirty_spans[i].second);
+		else
+			dirty_spans[++cc] = dirty_spans[i];
+	}
+	dirty_spans.resize(cc + 1);
+}
+
+// copy the modified spans back to the java array with SetXArrayRegion.
+// This is only needed if the JVM gave a copy of the array; otherwise
+// the writes already went straight into the java array.
+void write_back_dirty_spans()
+{
+	if (is_copy == JNI_TRUE)
+	{
+		merge_dirty_spans();
+		for (size_t i = 0; i < dirty_spans.size(); i++)
+			jArrayOps<T_arr>::SetRegion(env, arr, dirty_spans[i].first, dirty_spans[i].second - dirty_spans[i].first, ptr_data + dirty_spans[i].first);
+	}
+	dirty_spans.clear();
+}
+
+void wrap(T_arr arr_, int nrows, int ncols, int nchannels, bool colMajor_, bool read_only_)
+{
+	nd = env->GetArrayLength(arr_);
+	if (nrows * ncols * nchannels != nd)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: nrows * ncols * nchannels != length of array to be wrapped.");
+		return;
+	}
+	release_existing_array();
+	arr = arr_;
+	nr = nrows; nc = ncols; nch = nchannels; ndpch = nr * nc;
+	set_layout(colMajor_);
+	read_only = read_only_;
+	set_pointer_to_array_elements();
+	currently_holding_data = true;
+}
+
+void create_new(npy_reader &reader)
+{
+	jni_utils ju(env);
+	int nrows, ncols, nchannels;
+	if (!reader.get_matrix_shape(nrows, ncols, nchannels))
+	{
+		ju.throw_exception("ERROR from JNI: " + reader.get_error());
+		return;
+	}
+	if (T_layout::is_fixed && T_layout::colMajor != reader.is_fortran_order())
+	{
+		ju.throw_exception("ERROR from JNI: the order of the numpy array does not match the layout of the jArray.");
+		return;
+	}
+	create_new(nrows, ncols, nchannels, reader.is_fortran_order());
+	if (!reader.read_all(ptr_data))
+		ju.throw_exception("ERROR from JNI: " + reader.get_error());
+}
+
+public:
+
+jArray() = delete;
+
+jArray(JNIEnv* env_)
+{
+	env = env_;
+	ptr_data = nullptr;
+	nr = 0; nc = 0; nch = 0; nd = 0; ndpch = 0;
+	currently_holding_data = false;
+	read_only = false;
+	track_dirty = false;
+	is_copy = JNI_FALSE;
+}
+
+// the wrapped java array
+T_arr get_arr() const
+{
+	return arr;
+}
+
+// pointer to the (pinned) array elements
+T* data()
+{
+	return ptr_data;
+}
+
+// number of elements of the array
+size_t size() const
+{
+	return nd;
+}
+
+// iterators over all the elements in memory order, so that the standard algorithms
+// (including the C++17 parallel ones) can directly work on the java array, e.g.
+// std::sort(std::execution::par_unseq, a.begin(), a.end());
+// std::reduce(std::execution::par, a.begin(), a.end());
+// If dirty tracking is on, call mark_dirty() for the modified range afterwards.
+T* begin()
+{
+	return ptr_data;
+}
+
+T* end()
+{
+	return ptr_data + nd;
+}
+
+jSpan<T> as_span()
+{
+	return jSpan<T>(ptr_data, nd);
+}
+
+#ifdef __cpp_lib_span
+std::span<T> as_std_span()
+{
+	return std::span<T>(ptr_data, nd);
+}
+#endif
+
+// wrap an existing java array
+void wrap(T_arr arr_)
+{
+	wrap(arr_, env->GetArrayLength(arr_), 1, 1, true, false);
+}
+
+// wrap an existing java array which can be interpreted as a matrix
+void wrap(T_arr arr_, int nrows, int ncols, int nchannels, bool colMajor_=true)
+{
+	wrap(arr_, nrows, ncols, nchannels, colMajor_, false);
+}
+
+// wrap an existing java array only for reading. When released, nothing is
+// copied back to the java array (JNI_ABORT), which saves a copy of the whole array
+// if the JVM gave a copy instead of pinning it. Any changes to the data are discarded.
+void wrap_read_only(T_arr arr_)
+{
+	wrap(arr_, env->GetArrayLength(arr_), 1, 1, true, true);
+}
+
+void wrap_read_only(T_arr arr_, int nrows, int ncols, int nchannels, bool colMajor_ = true)
+{
+	wrap(arr_, nrows, ncols, nchannels, colMajor_, true);
+}
+
+// create new java array from given size
+void create_new(int size)
+{
+	release_existing_array();
+	read_only = false;
+	allocate(size);
+	nr = size; nc = 1; nch = 1; nd = size; ndpch = nr * nc;
+	set_pointer_to_array_elements();
+	currently_holding_data = true;
+	set_layout(true);
+}
+
+// create new java array which can be interpreted as a matrix
+void create_new(int nrows, int ncols, int nchannels, bool colMajor_ = true)
+{
+	nr = nrows; nc = ncols; nch = nchannels;
+	nd = nr * nc * nch; 
+	ndpch = nr * nc;
+	release_existing_array();
+	read_only = false;
+	allocate(nd);
+	set_pointer_to_array_elements();
+	currently_holding_data = true;	
+	set_layout(colMajor_);
+}
+
+// create new java array from a numpy .npy file (streamed in fixed-size chunks).
+// C order arrays are interpreted as row major (interleaved) and Fortran order arrays
+// as col major, so the data goes straight into the java array without any reordering.
+void create_new_from_npy(std::string fpath)
+{
+	npy_reader reader(fpath);
+	create_new(reader);
+}
+
+// create new java array from the array named name_array inside an uncompressed numpy .npz file
+void create_new_from_npz(std::string fpath, std::string name_array)
+{
+	std::string str_error;
+	unsigned long long offset_data;
+	if (!npz_utils::find_member(fpath, name_array, offset_data, str_error))
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: " + str_error);
+		return;
+	}
+	npy_reader reader(fpath, offset_data);
+	create_new(reader);
+}
+
+// save as numpy .npy file; col major arrays are saved in Fortran order
+// and row major arrays in C order (no reordering of the data in either case).
+// returns false (with a java exception thrown) if the file could not be written.
+bool save_npy(std::string fpath)
+{
+	std::ofstream fid(fpath, std::ios::binary);
+	npy_writer w(fid);
+	if (!fid || !w.write(ptr_data, npy_utils::matrix_shape(nr, nc, nch), colMajor) || !fid.flush())
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: could not write " + fpath);
+		return false;
+	}
+	return true;
+}
+
+// add this array to a numpy .npz archive under the name name_array.
+// returns false (with a java exception thrown) if the archive could not be written.
+bool save_npz(npz_writer &w, std::string name_array)
+{
+	if (!w.add(name_array, ptr_data, npy_utils::matrix_shape(nr, nc, nch), colMajor))
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: could not add " + name_array + " to npz archive");
+		return false;
+	}
+	return true;
+}
+
+// create new java array from a jagged java array, arr[i][j] for a 2D array such as double[][]
+// or arr[i][j][k] for a 3D array (k being the channel). Row major arrays are filled directly
+// with one region copy per inner array.
+void create_new_from_jagged(jobjectArray arr_jagged, bool is_3d = false, bool colMajor_ = true, int nthreads = 0)
+{
+	jJagged jg(env);
+	int nrows, ncols, nchannels;
+	if (!jg.get_shape<T_arr>(arr_jagged, nrows, ncols, nchannels, is_3d)) return;
+	create_new(nrows, ncols, nchannels, colMajor_);
+	if (!colMajor)
+	{
+		jg.read_rows<T_arr>(arr_jagged, ptr_data, nr, nc, nch, is_3d);
+		return;
+	}
+	std::vector<T> rowMajor(nd);
+	if (jg.read_rows<T_arr>(arr_jagged, rowMajor.data(), nr, nc, nch, is_3d))
+		jJagged::convert_layout(rowMajor.data(), ptr_data, nr, nc, nch, true, nthreads);
+}
+
+// copy to a new jagged java array (2D if is_3d is false, which needs a single channel)
+jobjectArray to_jagged(bool is_3d = false, int nthreads = 0)
+{
+	jJagged jg(env);
+	if (!is_3d && nch != 1)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: an array with more than one channel can only be converted to a 3D jagged array.");
+		return nullptr;
+	}
+	if (is_3d)
+		return jg.write_3d<T_arr>(ptr_data, nr, nc, nch, colMajor, nthreads);
+	else
+		return jg.write_2d<T_arr>(ptr_data, nr, nc, colMajor, nthreads);
+}
+
+~jArray()
+{
+	release_existing_array();
+}
+
+// release the java array now instead of on destruction
+void release()
+{
+	release_existing_array();
+}
+
+bool is_read_only() const
+{
+	return read_only;
+}
+
+// enable or disable tracking of the modified elements. When enabled, set_val()
+// records the modified spans and only those are written back (with SetXArrayRegion)
+// on commit() or release, instead of the whole array. Writes made directly through
+// data() should be recorded with mark_dirty().
+void set_dirty_tracking(bool track_dirty_)
+{
+	track_dirty = track_dirty_;
+}
+
+// record that the elements [idx_start, idx_start + len) have been modified
+void mark_dirty(int idx_start, int len = 1)
+{
+	int idx_end = idx_start + len;
+	if (!dirty_spans.empty())
+	{
+		std::pair<int, int> &last = dirty_spans.back();
+		if (idx_start <= last.second && idx_end >= last.first)
+		{
+			last.first = std::min(last.first, idx_start);
+			last.second = std::max(last.second, idx_end);
+			return;
+		}
+	}
+	dirty_spans.push_back(std::make_pair(idx_start, idx_end));
+
+	// keep the bookkeeping bounded for scattered writes
+	if (dirty_spans.size() > 256)
+	{
+		merge_dirty_spans();
+		if (dirty_spans.size() > 128)
+		{
+			dirty_spans[0].second = dirty_spans.back().second;
+			dirty_spans.resize(1);
+		}
+	}
+}
+
+// make the changes so far visible to java without releasing the array
+// (e.g. for periodic flushes of intermediate results).
+// With dirty tracking, only the modified spans are written back; otherwise
+// the whole array is (JNI_COMMIT). Does nothing for read only arrays.
+void commit()
+{
+	if (!currently_holding_data || read_only)
+		return;
+	if (track_dirty)
+		write_back_dirty_spans();
+	else
+		jArrayOps<T_arr>::ReleaseElements(env, arr, ptr_data, JNI_COMMIT);
+}
+
+void set_val(T val, int idx)
+{
+	ptr_data[idx] = val;
+	if (track_dirty) mark_dirty(idx);
+}
+
+void set_val(T val, int i, int j, int k)
+{
+	int idx = T_layout::index(i, j, k, strides);
+	ptr_data[idx] = val;
+	if (track_dirty) mark_dirty(idx);
+}
+
+// assume k=0 and nch = 1
+void set_val(T val, int i, int j)
+{
+	int idx = T_layout::index(i, j, 0, strides);
+	ptr_data[idx] = val;
+	if (track_dirty) mark_dirty(idx);
+}
+
+T get_val(int idx)
+{
+return ptr_data[idx];
+}
+
+T get_val(int i, int j, int k)
+{
+	return ptr_data[T_layout::index(i, j, k, strides)];
+}
+
+// assume k=0 and nch = 1
+T get_val(int i, int j)
+{
+	return ptr_data[T_layout::index(i, j, 0, strides)];
+}
+
+// set custom strides (in elements) between consecutive rows, cols and channels,
+// e.g. to access a sub-block or a planar layout with padding.
+// Only for the jArrayLayout_strided layout policy. Functions that work on the
+// array as a whole (views, as_cvMat(), save_npy(), etc.) still follow the colMajor flag.
+void set_strides(int stride_row, int stride_col, int stride_channel)
+{
+	static_assert(!T_layout::is_fixed, "set_strides() can only be used with jArrayLayout_strided");
+	strides.si = stride_row; strides.sj = stride_col; strides.sk = stride_channel;
+}
+
+const jArrayStrides& get_strides() const
+{
+	return strides;
+}
+
+// row i of channel k
+jArraySlice<T, T_layout::row_stride_fixed> row(int i, int k = 0)
+{
+	return jArraySlice<T, T_layout::row_stride_fixed>(ptr_data + T_layout::index(i, 0, k, strides), nc, strides.sj);
+}
+
+// col j of channel k
+jArraySlice<T, T_layout::col_stride_fixed> col(int j, int k = 0)
+{
+	return jArraySlice<T, T_layout::col_stride_fixed>(ptr_data + T_layout::index(0, j, k, strides), nr, strides.si);
+}
+
+// all the nrows * ncols elements of channel k, in memory order (i.e. col by col for
+// col major and row by row for row major arrays).
+jArraySlice<T, T_layout::channel_stride_fixed> channel(int k)
+{
+	// a dimension of extent 1 does not need its stride to match
+	int stride;
+	if (nr == 1 && nc == 1)
+		stride = 1;
+	else if (nr == 1)
+		stride = strides.sj;
+	else if (nc == 1 || strides.sj == strides.si * nr)
+		stride = strides.si;
+	else if (strides.si == strides.sj * nc)
+		stride = strides.sj;
+	else
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: the elements of a channel are not equally spaced with the current strides.");
+		return jArraySlice<T, T_layout::channel_stride_fixed>(nullptr, 0, 1);
+	}
+	return jArraySlice<T, T_layout::channel_stride_fixed>(ptr_data + T_layout::index(0, 0, k, strides), nr * nc, stride);
+}
+
+// convert the data of the java array (in place) between col major and row major (interleaved)
+// layouts, and update colMajor and the strides accordingly, e.g. when java gives col major
+// data and OpenCV needs interleaved data. No second java array is needed:
+// if in_place is true, the elements are moved by following the cycles of the permutation,
+// which needs only one extra bit per element but accesses memory randomly.
+// Otherwise, the data is transposed in cache-sized blocks into a scratch buffer (kept and
+// reused by the calling thread), which is faster but temporarily needs a copy of the data.
+// Only for the jArrayLayout_strided layout policy.
+void convert_layout(bool colMajor_new, bool in_place = true)
+{
+	static_assert(!T_layout::is_fixed, "convert_layout() can only be used with jArrayLayout_strided");
+	if (!currently_holding_data || read_only)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: convert_layout() needs a wrapped array which is not read-only.");
+		return;
+	}
+	if (colMajor_new != colMajor && nch * nc > 1 && nr * nch > 1)
+	{
+		if (in_place)
+			convert_layout_in_place(colMajor);
+		else
+			convert_layout_blocked(colMajor);
+		if (track_dirty) mark_dirty(0, nd);
+	}
+	set_layout(colMajor_new);
+}
+
+// zero-copy view of one channel of this (col major) array as an armadillo matrix.
+// The view uses the pinned java array directly, so writes through it go straight
+// into the java array. It is only valid while this jArray holds the array, i.e.
+// until the jArray is destroyed or wraps/creates another array.
+arma::Mat<T> view_armaMat(int channel = 0)
+{
+	if (!colMajor)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: view_armaMat() can only be called on a col major array.");
+		return arma::Mat<T>();
+	}
+	return arma::Mat<T>(ptr_data + channel * ndpch, nr, nc, false, true);
+}
+
+// zero-copy view of this (col major) array as an armadillo cube (one slice per channel).
+// Same lifetime rules as view_armaMat().
+arma::Cube<T> view_armaCube()
+{
+	if (!colMajor)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: view_armaCube() can only be called on a col major array.");
+		return arma::Cube<T>();
+	}
+	return arma::Cube<T>(ptr_data, nr, nc, nch, false, true);
+}
+
+// zero-copy opencv matrix header over this (row major) array.
+// The row major layout ptr_data[i * nch * nc + j * nch + k] is the same as an interleaved
+// cv::Mat of nrows x ncols with nchannels, so OpenCV reads and writes the java array directly.
+// The OpenCV type is derived from T and nchannels (e.g. jfloat with 3 channels gives CV_32FC3).
+// Same lifetime rules as view_armaMat(). Note that if an OpenCV function has to reallocate
+// its output (e.g. because of a size or type mismatch), the output will no longer point into
+// the java array.
+cv::Mat as_cvMat()
+{
+	if (colMajor)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: as_cvMat() can only be called on a row major array.");
+		return cv::Mat();
+	}
+	return cv::Mat(nr, nc, CV_MAKE_TYPE(cv::DataType<T>::depth, nch), ptr_data);
+}
+
+// create new (row major) java array of the given size and give an opencv header over it,
+// so that OpenCV functions can write their output directly into the java array
+// (e.g. cv::GaussianBlur(src, jarr.create_new_cvMat(src.rows, src.cols, src.channels()), ...)).
+cv::Mat create_new_cvMat(int nrows, int ncols, int nchannels)
+{
+	create_new(nrows, ncols, nchannels, false);
+	return as_cvMat();
+}
+
+// create new (row major) java array from opencv matrix.
+// The java array is allocated once and OpenCV copies (or converts, if the depth of
+// mIn is not the same as T) the data straight into it.
+void create_new_from_cvMat(cv::Mat mIn, double scale = 1)
+{
+	if (mIn.dims != 2)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: Input opencv matrix is not 2D (with a variable number of channels).");
+		return;
+	}
+	cv::Mat mOut = create_new_cvMat(mIn.rows, mIn.cols, mIn.channels());
+	if (mIn.depth() == cv::DataType<T>::depth && scale == 1)
+		mIn.copyTo(mOut);
+	else
+		mIn.convertTo(mOut, mOut.type(), scale);
+}
+
+// create new java array from a typed view over a java byte[] or direct ByteBuffer
+// (one copy, converted to T if needed). The data should already be in the given layout.
+template<class T_view>
+void create_new_from_bytes(const jByteView<T_view> &view, int nrows, int ncols, int nchannels, bool colMajor_ = true)
+{
+	if (view.size() != static_cast<size_t>(nrows) * ncols * nchannels)
+	{
+		jni_utils ju(env);
+		ju.throw_exception("ERROR from JNI: view.size() != nrows * ncols * nchannels.");
+		return;
+	}
+	create_new(nrows, ncols, nchannels, colMajor_);
+	view.copy_to(ptr_data);
+}
+
+#ifdef EIGEN_WORLD_VERSION
+// zero-copy view of one channel of this array as an Eigen matrix.
+// works for both layouts, since the row major (interleaved) layout is
+// just a different pair of strides. Same lifetime rules as view_armaMat().
+Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>, 0, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> > view_eigenMat(int channel = 0)
+{
+	typedef Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> stride_type;
+	if (colMajor)
+		return Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>, 0, stride_type>(ptr_data + channel * ndpch, nr, nc, stride_type(nr, 1));
+	else
+		return Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>, 0, stride_type>(ptr_data + channel, nr, nc, stride_type(nch, nc * nch));
+}
+#endif
+};
+
+// java arrays are limited to 2^31 - 1 elements (and jArray/Matkc use int sizes).
+// jBigArray stores a big array as a java array of fixed-size primitive chunks,
+// e.g. double[][] for T_arr = jdoubleArray and T = jdouble, with 64-bit indexing.
+// All chunks have chunk_size elements, except the last one which can be shorter.
+// Only one chunk is pinned at any time, so the GC is never blocked by the whole array.
+// On top of the flat index, it has the same shape layer as Matkc (nrows, ncols, nchannels,
+// col major, one channel after another): idx = k * nrows * ncols + j * nrows + i.
+// The java side only needs to hold the chunks (and the shape if needed), e.g.
+// public class BigMatkc { public double[][] chunks; public long nrows, ncols, nchannels; }
+// and can index it with chunks[(int)(idx / chunks[0].length)][(int)(idx % chunks[0].length)].
+template<class T_arr, class T>
+class jBigArray
+{
+public:
+
+	jBigArray() = delete;
+
+	jBigArray(JNIEnv* env_)
+	{
+		env = env_;
+		chunks = nullptr;
+		n = 0; chunk_size = 0; nchunks = 0;
+		nr = 0; nc = 0; nch = 0;
+	}
+
+	// create a new java array of numel elements split in chunks of chunk_size elements
+	// (the default is 2^26 elements, i.e. 512 MB of doubles per chunk)
+	void create_new(long long numel, int chunk_size_ = 1 << 26)
+	{
+		create_new(numel, 1, 1, chunk_size_);
+	}
+
+	void create_new(long long nrows, long long ncols, long long nchannels, int chunk_size_ = 1 << 26)
+	{
+		if (chunk_size_ <= 0 || nrows < 0 || ncols < 0 || nchannels < 0)
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: the chunk size of a big array must be positive, and its shape non-negative.");
+			return;
+		}
+		nr = nrows; nc = ncols; nch = nchannels;
+		n = nr * nc * nch;
+		chunk_size = chunk_size_;
+		nchunks = static_cast<int>((n + chunk_size - 1) / chunk_size);
+		jclass cls_chunk = env->FindClass(get_signature_jtype<T_arr>("").c_str());
+		chunks = cls_chunk == nullptr ? nullptr : env->NewObjectArray(nchunks, cls_chunk, nullptr);
+		env->DeleteLocalRef(cls_chunk);
+		if (chunks == nullptr)
+		{
+			// NoClassDefFoundError or OutOfMemoryError pending
+			n = 0; nchunks = 0;
+			return;
+		}
+		for (int c = 0; c < nchunks; c++)
+		{
+			T_arr chunk = jArrayOps<T_arr>::New(env, get_chunk_length(c));
+			if (chunk == nullptr) return; // OutOfMemoryError pending
+			env->SetObjectArrayElement(chunks, c, chunk);
+			env->DeleteLocalRef(chunk);
+		}
+	}
+
+	// wrap an existing java array of chunks (e.g. double[][]).
+	// The shape is nrows x 1 x 1 with nrows the total number of elements, unless given.
+	void wrap(jobjectArray chunks_)
+	{
+		wrap(chunks_, -1, 1, 1);
+	}
+
+	void wrap(jobjectArray chunks_, long long nrows, long long ncols, long long nchannels)
+	{
+		jni_utils ju(env);
+		chunks = chunks_;
+		nchunks = env->GetArrayLength(chunks);
+		n = 0; chunk_size = 0;
+		for (int c = 0; c < nchunks; c++)
+		{
+			T_arr chunk = static_cast<T_arr>(env->GetObjectArrayElement(chunks, c));
+			int len = chunk == nullptr ? 0 : env->GetArrayLength(chunk);
+			env->DeleteLocalRef(chunk);
+			if (c == 0) chunk_size = len;
+			if (len == 0 || len > chunk_size || (c < nchunks - 1 && len != chunk_size))
+			{
+				ju.throw_exception("ERROR from JNI: all the chunks of a big array must have the same (non-zero) length, except the last one which can be shorter.");
+				return;
+			}
+			n += len;
+		}
+		if (nrows < 0) nrows = n;
+		if (nrows * ncols * nchannels != n)
+		{
+			ju.throw_exception("ERROR from JNI: nrows * ncols * nchannels != total length of the chunks to be wrapped.");
+			return;
+		}
+		nr = nrows; nc = ncols; nch = nchannels;
+	}
+
+	jobjectArray get_arr() const { return chunks; }
+	long long numel() const { return n; }
+	long long get_nrows() const { return nr; }
+	long long get_ncols() const { return nc; }
+	long long get_nchannels() const { return nch; }
+	int get_chunk_size() const { return chunk_size; }
+	int get_nchunks() const { return nchunks; }
+
+	int get_chunk_length(int c) const
+	{
+		return static_cast<int>(std::min<long long>(chunk_size, n - static_cast<long long>(c) * chunk_size));
+	}
+
+	// flat index of the element (i, j, k), same layout as Matkc
+	long long index(long long i, long long j, long long k = 0) const
+	{
+		return k * nr * nc + j * nr + i;
+	}
+
+	// single elements (one JNI region call each, use the bulk functions below for many elements)
+	T get(long long idx)
+	{
+		T val;
+		copy_to(idx, 1, &val);
+		return val;
+	}
+
+	T get(long long i, long long j, long long k)
+	{
+		return get(index(i, j, k));
+	}
+
+	void set(T val, long long idx)
+	{
+		copy_from(idx, 1, &val);
+	}
+
+	void set(T val, long long i, long long j, long long k)
+	{
+		set(val, index(i, j, k));
+	}
+
+	// copy len elements starting at idx_start into buf (one region copy per chunk touched)
+	void copy_to(long long idx_start, long long len, T* buf)
+	{
+		for_each_span(idx_start, len, [&](T_arr chunk, int offset, int len_span, long long pos)
+		{
+			jArrayOps<T_arr>::GetRegion(env, chunk, offset, len_span, buf + pos);
+		});
+	}
+
+	// copy len elements from buf into the big array starting at idx_start
+	void copy_from(long long idx_start, long long len, const T* buf)
+	{
+		for_each_span(idx_start, len, [&](T_arr chunk, int offset, int len_span, long long pos)
+		{
+			jArrayOps<T_arr>::SetRegion(env, chunk, offset, len_span, buf + pos);
+		});
+	}
+
+	// copy the elements at the (arbitrary) indices idx[0], ..., idx[count - 1] into out.
+	// The indices are visited in sorted order, and each run of nearby indices (in one chunk,
+	// spanning at most gather_span elements) is read with a single region copy, so that only
+	// the elements around the indices are copied, never whole chunks.
+	void gather(const long long* idx, size_t count, T* out)
+	{
+		for (size_t x = 0; x < count; x++)
+		{
+			if (idx[x] < 0 || idx[x] >= n)
+			{
+				jni_utils ju(env);
+				ju.throw_exception("ERROR from JNI: index out of bounds of the big array.");
+				return;
+			}
+		}
+
+		std::vector<size_t> order(count);
+		for (size_t x = 0; x < count; x++) order[x] = x;
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return idx[a] < idx[b]; });
+
+		std::vector<T> buf;
+		size_t x = 0;
+		while (x < count)
+		{
+			int c = static_cast<int>(idx[order[x]] / chunk_size);
+			T_arr chunk = static_cast<T_arr>(env->GetObjectArrayElement(chunks, c));
+			long long offset = static_cast<long long>(c) * chunk_size;
+			while (x < count && idx[order[x]] / chunk_size == c)
+			{
+				long long first = idx[order[x]];
+				size_t x_end = x + 1;
+				while (x_end < count && idx[order[x_end]] / chunk_size == c && idx[order[x_end]] - first < gather_span)
+					x_end++;
+				int len = static_cast<int>(idx[order[x_end - 1]] - first + 1);
+				buf.resize(len);
+				jArrayOps<T_arr>::GetRegion(env, chunk, static_cast<int>(first - offset), len, buf.data());
+				for (; x < x_end; x++)
+					out[order[x]] = buf[idx[order[x]] - first];
+			}
+			env->DeleteLocalRef(chunk);
+		}
+	}
+
+	// pin the chunks one at a time and call fn(idx_start, ptr, len) for each of them, where
+	// ptr points to the len elements of the chunk, whose first element has the flat index idx_start.
+	// If read_only is true, changes made by fn are not copied back to java.
+	template<class F>
+	void for_each_chunk(F fn, bool read_only = false)
+	{
+		for (int c = 0; c < nchunks; c++)
+		{
+			T_arr chunk = static_cast<T_arr>(env->GetObjectArrayElement(chunks, c));
+			T* ptr = jArrayOps<T_arr>::GetElements(env, chunk, nullptr);
+			if (ptr == nullptr) { env->DeleteLocalRef(chunk); return; } // OutOfMemoryError pending
+			jPinRegistry::pin pinned(static_cast<size_t>(get_chunk_length(c)) * sizeof(T), false);
+			fn(static_cast<long long>(c) * chunk_size, ptr, get_chunk_length(c));
+			jArrayOps<T_arr>::ReleaseElements(env, chunk, ptr, read_only ? JNI_ABORT : 0);
+			pinned.release();
+			env->DeleteLocalRef(chunk);
+		}
+	}
+
+private:
+
+	JNIEnv* env;
+	jobjectArray chunks;
+	long long n;
+	int chunk_size, nchunks;
+	long long nr, nc, nch;
+
+	// longest run of elements read with one region copy by gather()
+	static const long long gather_span = 4096;
+
+	// split [idx_start, idx_start + len) in spans that each lie in a single chunk and call
+	// fn(chunk, offset in chunk, length of span, position of span relative to idx_start)
+	template<class F>
+	void for_each_span(long long idx_start, long long len, F fn)
+	{
+		if (idx_start < 0 || len < 0 || idx_start + len > n)
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: index out of bounds of the big array.");
+			return;
+		}
+		long long pos = 0;
+		while (pos < len)
+		{
+			long long idx = idx_start + pos;
+			int c = static_cast<int>(idx / chunk_size);
+			int offset = static_cast<int>(idx % chunk_size);
+			int len_span = static_cast<int>(std::min<long long>(chunk_size - offset, len - pos));
+			T_arr chunk = static_cast<T_arr>(env->GetObjectArrayElement(chunks, c));
+			fn(chunk, offset, len_span, pos);
+			env->DeleteLocalRef(chunk);
+			pos += len_span;
+		}
+	}
+};
+
+// single pass over a (possibly huge) java array in fixed-size windows with Get/SetXArrayRegion,
+// instead of pinning or copying the whole array with jArray::wrap.
+// Only two native windows (reused) are needed, whatever the size of the java array,
+// and each JNI call only copies one window, so the GC is never blocked for long.
+// The window copies (on the calling thread) overlap with the processing of the previous
+// window on a worker thread (double buffering), unless overlap is false. With overlap,
+// fn runs on the worker thread (one per read/transform/write call, reused for all the
+// windows), so it must not use the JNIEnv. An exception thrown by fn is rethrown on the
+// calling thread.
+// T_arr should be of type jdoubleArray, jintArray, etc. and T the corresponding primitive type.
+template<class T_arr, class T>
+class jArrayStream
+{
+public:
+
+	jArrayStream() = delete;
+
+	jArrayStream(JNIEnv* env_, T_arr arr_, int window_ = 1 << 16)
+	{
+		env = env_;
+		arr = arr_;
+		n = env->GetArrayLength(arr);
+		window = window_;
+		bufs[0].resize(std::min(window, n));
+		bufs[1].resize(std::min(window, n));
+		iter_start = 0; iter_len = 0;
+		pos_write = 0; len_write = 0;
+	}
+
+	~jArrayStream()
+	{
+		flush();
+	}
+
+	int size() const { return n; }
+
+	// call fn(idx_start, buf, len) for each window of the array (read only),
+	// where buf holds the len elements starting at index idx_start.
+	template<class F>
+	void read(F fn, bool overlap = true)
+	{
+		reset_windows();
+		std::unique_ptr<window_worker> worker(overlap ? new window_worker() : nullptr);
+		for (int w = 0; w * static_cast<long long>(window) < n; w++)
+		{
+			int idx_start = w * window, len = std::min(window, n - idx_start);
+			T* buf = bufs[w % 2].data();
+			jArrayOps<T_arr>::GetRegion(env, arr, idx_start, len, buf);
+			if (worker)
+				worker->submit([=]() { fn(idx_start, static_cast<const T*>(buf), len); });
+			else
+				fn(idx_start, static_cast<const T*>(buf), len);
+		}
+		if (worker) worker->wait();
+	}
+
+	// call fn(idx_start, buf, len) for each window of the array, where buf holds the
+	// len elements starting at index idx_start, and write the (modified) windows back.
+	template<class F>
+	void transform(F fn, bool overlap = true)
+	{
+		reset_windows();
+		std::unique_ptr<window_worker> worker(overlap ? new window_worker() : nullptr);
+		int prev_start = 0, prev_len = 0;
+		T* prev_buf = nullptr;
+		for (int w = 0; w * static_cast<long long>(window) < n; w++)
+		{
+			int idx_start = w * window, len = std::min(window, n - idx_start);
+			T* buf = bufs[w % 2].data();
+			jArrayOps<T_arr>::GetRegion(env, arr, idx_start, len, buf);
+			if (worker)
+				worker->submit([=]() { fn(idx_start, buf, len); });
+			else
+				fn(idx_start, buf, len);
+			if (prev_buf != nullptr)
+				jArrayOps<T_arr>::SetRegion(env, arr, prev_start, prev_len, prev_buf);
+			prev_start = idx_start; prev_len = len; prev_buf = buf;
+		}
+		if (worker) worker->wait();
+		if (prev_buf != nullptr)
+			jArrayOps<T_arr>::SetRegion(env, arr, prev_start, prev_len, prev_buf);
+	}
+
+	// fill the whole array window by window: fn(idx_start, buf, len) should write the
+	// len elements starting at index idx_start into buf.
+	template<class F>
+	void write(F fn, bool overlap = true)
+	{
+		reset_windows();
+		std::unique_ptr<window_worker> worker(overlap ? new window_worker() : nullptr);
+		int prev_start = 0, prev_len = 0;
+		T* prev_buf = nullptr;
+		for (int w = 0; w * static_cast<long long>(window) < n; w++)
+		{
+			int idx_start = w * window, len = std::min(window, n - idx_start);
+			T* buf = bufs[w % 2].data();
+			if (worker)
+				worker->submit([=]() { fn(idx_start, buf, len); });
+			else
+				fn(idx_start, buf, len);
+			if (prev_buf != nullptr)
+				jArrayOps<T_arr>::SetRegion(env, arr, prev_start, prev_len, prev_buf);
+			prev_start = idx_start; prev_len = len; prev_buf = buf;
+		}
+		if (worker) worker->wait();
+		if (prev_buf != nullptr)
+			jArrayOps<T_arr>::SetRegion(env, arr, prev_start, prev_len, prev_buf);
 	}
 
-	void set_cols(std::vector<double> data_mIn, std::vector<int> col_indices)
+	// forward iterator reading the elements one by one (one window copied at a time), e.g.
+	// double s = std::accumulate(stream.begin(), stream.end(), 0.0);
+	class iterator
 	{
-		int nc_new = col_indices.size();
+	public:
 
-		double* temp_in = data_mIn.data();
-		double* temp_out = ptr_data;
+		typedef std::forward_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const T* pointer;
+		typedef const T& reference;
 
-		int cc = 0;
-		for (int k = 0; k<nch; k++)
-			for (int j = 0; j<nc_new; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[k * ndpch + col_indices[j] * nr + i] = temp_in[cc++];
-	}
+		iterator() : stream(nullptr), idx(0) {}
+		iterator(jArrayStream* stream_, int idx_) : stream(stream_), idx(idx_) {}
 
-	// use the entire given input matrix (must be a channel) to set a channel of this matrix
-	void set_channel(Matkc mIn, int channel_index)
+		const T& operator*() const { return stream->get_for_iteration(idx); }
+		const T* operator->() const { return &stream->get_for_iteration(idx); }
+		iterator& operator++() { idx++; return *this; }
+		iterator operator++(int) { iterator tmp = *this; idx++; return tmp; }
+		bool operator==(const iterator &other) const { return idx == other.idx; }
+		bool operator!=(const iterator &other) const { return idx != other.idx; }
+
+	private:
+
+		jArrayStream* stream;
+		int idx;
+	};
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, n); }
+
+	// append val at the next position of the array (starting from index 0). The elements are
+	// buffered and written back one window at a time (and by flush() or the destructor).
+	void push_back(T val)
 	{
-		set(mIn, 0, -1, 0, -1, channel_index, channel_index);
+		if (pos_write + len_write >= n)
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: writing past the end of the java array.");
+			return;
+		}
+		bufs[1][len_write++] = val;
+		if (len_write == static_cast<int>(bufs[1].size()))
+			flush();
 	}
 
-	void set_channel(std::vector<double> data_mIn, int channel_index)
+	// write back the elements given with push_back() and not yet written
+	void flush()
 	{
-		set(data_mIn, 0, -1, 0, -1, channel_index, channel_index);
+		if (len_write > 0)
+			jArrayOps<T_arr>::SetRegion(env, arr, pos_write, len_write, bufs[1].data());
+		pos_write += len_write;
+		len_write = 0;
 	}
 
-	// use the entire given input matrix to a range of channels of this matrix
-	void set_channels(Matkc mIn, int start_index, int end_index)
+private:
+
+	JNIEnv* env;
+	T_arr arr;
+	int n, window;
+	std::vector<T> bufs[2];
+	int iter_start, iter_len; // window currently held in bufs[0] for the iterator
+	int pos_write, len_write; // for push_back(), buffered in bufs[1]
+
+	// one worker thread that runs the windows handed to it one at a time, so that a
+	// thread is not created for each window
+	class window_worker
 	{
-		set(mIn, 0, -1, 0, -1, start_index, end_index);
-	}
+	public:
 
-	void set_channels(std::vector<double> data_mIn, int start_index, int end_index)
+		window_worker() : has_task(false), stop(false)
+		{
+			th = std::thread(&window_worker::loop, this);
+		}
+
+		~window_worker()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				stop = true;
+			}
+			cv.notify_all();
+			th.join();
+		}
+
+		// run task on the worker, once the previous one has finished
+		void submit(std::function<void()> task_)
+		{
+			wait();
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				task = std::move(task_);
+				has_task = true;
+			}
+			cv.notify_all();
+		}
+
+		// wait for the current task to finish; an exception thrown by it is rethrown here
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [this]() { return !has_task; });
+			if (error)
+			{
+				std::exception_ptr e = error;
+				error = nullptr;
+				std::rethrow_exception(e);
+			}
+		}
+
+	private:
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::function<void()> task;
+		bool has_task, stop;
+		std::exception_ptr error;
+		std::thread th;
+
+		void loop()
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			for (;;)
+			{
+				cv.wait(lock, [this]() { return has_task || stop; });
+				if (!has_task) return;
+				std::function<void()> t;
+				t.swap(task);
+				lock.unlock();
+				std::exception_ptr e;
+				try { t(); }
+				catch (...) { e = std::current_exception(); }
+				lock.lock();
+				error = e;
+				has_task = false;
+				cv.notify_all();
+			}
+		}
+	};
+
+	// the windows are shared by the different ways of accessing the array
+	void reset_windows()
 	{
-		set(data_mIn, 0, -1, 0, -1, start_index, end_index);
+		flush();
+		iter_len = 0;
 	}
-	
-	// use the entire given input matrix to set specified channels of this matrix.
-	void set_channels(Matkc mIn, std::vector<int> channel_indices)
+
+	const T& get_for_iteration(int idx)
 	{
-		int nch_new = channel_indices.size();
-		double* temp_in = mIn.ptr_data;
-		double* temp_out = ptr_data;
+		if (idx < iter_start || idx >= iter_start + iter_len)
+		{
+			iter_start = idx;
+			iter_len = std::min(window, n - idx);
+			jArrayOps<T_arr>::GetRegion(env, arr, iter_start, iter_len, bufs[0].data());
+		}
+		return bufs[0][idx - iter_start];
+	}
+};
 
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[channel_indices[k] * ndpch + j * nr + i] = temp_in[cc++];
+// transfer a batch of opencv matrices or armadillo cubes to java in one go,
+// instead of one Matkc::create per item (each with its own FindClass, NewObject,
+// pin and conversion loop). All the JNI work (class lookup, allocation, pinning) is
+// done once up front on the calling thread, and the conversions then run in parallel
+// over the whole batch.
+class jBatch
+{
+public:
+
+	jBatch() = delete;
+
+	jBatch(JNIEnv* env_)
+	{
+		env = env_;
 	}
 
-	void set_channels(std::vector<double> data_mIn, std::vector<int> channel_indices)
+	// pack N opencv matrices (same size, channels and element type T_cv) into one contiguous
+	// java array of N x H x W x C, i.e. each image row major interleaved (as in cv::Mat),
+	// one image after another. T_arr should be jfloatArray, jdoubleArray, etc. and
+	// T the corresponding primitive type. Every element is multiplied by scale.
+	template<class T_arr, class T, class T_cv>
+	T_arr pack_NHWC(const std::vector<cv::Mat> &mats, double scale = 1, int nthreads = 0)
 	{
-		int nch_new = channel_indices.size();
-		double* temp_in = data_mIn.data();
-		double* temp_out = ptr_data;
+		int H, W, C;
+		if (!check_cvMats<T_cv>(mats, H, W, C))
+			return nullptr;
 
-		int cc = 0;
-		for (int k = 0; k<nch_new; k++)
-			for (int j = 0; j<nc; j++)
-				for (int i = 0; i<nr; i++)
-					temp_out[channel_indices[k] * ndpch + j * nr + i] = temp_in[cc++];
+		size_t N = mats.size();
+		size_t nd_item = static_cast<size_t>(H) * W * C;
+		if (!check_java_length(N * nd_item)) return nullptr;
+		jArray<T_arr, T> arr(env);
+		arr.create_new(static_cast<int>(N * nd_item));
+		T* ptr_out = arr.data();
+		if (ptr_out == nullptr) return nullptr; // OutOfMemoryError pending
+
+		// one task per image row
+		jni_parallel_for(N * H, [&](size_t idx_begin, size_t idx_end)
+		{
+			for (size_t idx = idx_begin; idx < idx_end; idx++)
+			{
+				size_t n = idx / H;
+				int i = static_cast<int>(idx % H);
+				const T_cv* p_in = mats[n].ptr<T_cv>(i);
+				T* p_out = ptr_out + n * nd_item + static_cast<size_t>(i) * W * C;
+				if (std::is_same<T, T_cv>::value && scale == 1)
+					std::memcpy(p_out, p_in, sizeof(T) * W * C);
+				else
+					for (int x = 0; x < W * C; x++)
+						p_out[x] = static_cast<T>(p_in[x] * scale);
+			}
+		}, nthreads, 16);
+
+		return arr.get_arr();
 	}
 
-	void print()
+	// pack N armadillo cubes (same size) into one contiguous java array where each cube
+	// has the Matkc layout (col major, one slice/channel after another), one cube after another.
+	template<class T_arr, class T, class T_arma>
+	T_arr pack(const std::vector<arma::Cube<T_arma> > &cubes, int nthreads = 0)
 	{
-		std::cout << "=========== Printing matrix ===========" << std::endl;
-		for (int k = 0; k<nch; k++)
+		if (cubes.empty()) return nullptr;
+		size_t nd_item = cubes[0].n_elem;
+		for (size_t n = 1; n < cubes.size(); n++)
 		{
-			std::cout << "mat(:,:," << (k + 1) << ")=[" << std::endl;
-			for (int i = 0; i<nr; i++)
+			if (cubes[n].n_rows != cubes[0].n_rows || cubes[n].n_cols != cubes[0].n_cols || cubes[n].n_slices != cubes[0].n_slices)
 			{
-				for (int j = 0; j<nc - 1; j++)
-					std::cout << get(i, j, k) << ",\t";		
-				std::cout << get(i, nc - 1, k) << ";" << std::endl;
+				jni_utils ju(env);
+				ju.throw_exception("ERROR from JNI: all the cubes of a batch must have the same size.");
+				return nullptr;
 			}
-			std::cout << "];" << std::endl;
 		}
-		std::cout << "=========== Matrix printed ===========" << std::endl;
-	}
 
-	void print_info()
-	{
-		printf("Matrix info: #rows = %d, #ncols = %d, #nchannels = %d\n", nr, nc, nch);
+		if (!check_java_length(cubes.size() * nd_item)) return nullptr;
+		jArray<T_arr, T> arr(env);
+		arr.create_new(static_cast<int>(cubes.size() * nd_item));
+		T* ptr_out = arr.data();
+		if (ptr_out == nullptr) return nullptr; // OutOfMemoryError pending
+
+		jni_parallel_for(cubes.size(), [&](size_t idx_begin, size_t idx_end)
+		{
+			for (size_t n = idx_begin; n < idx_end; n++)
+				std::transform(cubes[n].memptr(), cubes[n].memptr() + nd_item, ptr_out + n * nd_item,
+					[](T_arma v) { return static_cast<T>(v); });
+		}, nthreads);
+
+		return arr.get_arr();
 	}
 
-	void print_info(std::string name_matrix)
+	// create a java Matkc[] with one matrix per opencv matrix (same result as calling
+	// Matkc::create<T_cv, nchannels>(env, mats[n], divBy255) for each one).
+	template<class T_cv, int nchannels>
+	jobjectArray to_Matkc_array(const std::vector<cv::Mat> &mats, bool divBy255 = false, int nthreads = 0)
 	{
-		printf("Matrix %s info: #rows = %d, #ncols = %d, #nchannels = %d\n", name_matrix.c_str(), nr, nc, nch);
+		int H, W, C;
+		if (!check_cvMats<T_cv>(mats, H, W, C))
+			return nullptr;
+		if (C != nchannels)
+		{
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: Input opencv matrix does not have the same number of channels as the specified template parameter.");
+			return nullptr;
+		}
+
+		std::vector<jdoubleArray> arrs;
+		std::vector<jdouble*> ptrs;
+		std::vector<jPinRegistry::pin> pins;
+		jobjectArray arr_out = new_Matkc_array(mats.size(), H, W, C, arrs, ptrs, pins);
+		if (arr_out == nullptr) return nullptr;
+
+		double divBy = divBy255 ? 255 : 1;
+		int ndpch = H * W;
+
+		// one task per image row: row i only writes the elements (i, :, :) of its matrix
+		jni_parallel_for(mats.size() * H, [&](size_t idx_begin, size_t idx_end)
+		{
+			for (size_t idx = idx_begin; idx < idx_end; idx++)
+			{
+				size_t n = idx / H;
+				int i = static_cast<int>(idx % H);
+				const T_cv* p_in = mats[n].ptr<T_cv>(i);
+				jdouble* p_out = ptrs[n];
+				for (int j = 0; j < W; j++)
+					for (int k = 0; k < nchannels; k++)
+						p_out[k * ndpch + j * H + i] = static_cast<double>(p_in[j * nchannels + k]) / divBy;
+			}
+		}, nthreads, 16);
+
+		release_Matkc_arrays(arrs, ptrs, pins);
+		return arr_out;
 	}
 
-	void save_data(std::string fpath)
+	// create a java Matkc[] with one matrix per armadillo cube
+	template<class T_arma>
+	jobjectArray to_Matkc_array(const std::vector<arma::Cube<T_arma> > &cubes, int nthreads = 0)
 	{
-		std::ofstream fid(fpath);
-		fid << "Matkc data; nrows = " << nr << ", ncols = " << nc << ", nchannels = " << nch << std::endl;
-		for (int i = 0; i < nd; i++)
-			fid << ptr_data[i] << std::endl;
-	}
-			
-	int nrows() const { return nr; }
-	int ncols() const { return nc; }
-	int nchannels () const { return nch; }
-	int ndata_per_chan() const { return ndpch; }
-	int ndata() const { return nd; }
+		if (cubes.empty()) return nullptr;
+		for (size_t n = 1; n < cubes.size(); n++)
+		{
+			if (cubes[n].n_rows != cubes[0].n_rows || cubes[n].n_cols != cubes[0].n_cols || cubes[n].n_slices != cubes[0].n_slices)
+			{
+				jni_utils ju(env);
+				ju.throw_exception("ERROR from JNI: all the cubes of a batch must have the same size.");
+				return nullptr;
+			}
+		}
 
-	jobject get_obj() const { return obj; }
-};
+		std::vector<jdoubleArray> arrs;
+		std::vector<jdouble*> ptrs;
+		std::vector<jPinRegistry::pin> pins;
+		jobjectArray arr_out = new_Matkc_array(cubes.size(), cubes[0].n_rows, cubes[0].n_cols, cubes[0].n_slices, arrs, ptrs, pins);
+		if (arr_out == nullptr) return nullptr;
 
-// wrap a Java class object so that I can get fields, set fields,
-// and call methods in a convenient way
-class JavaClass
-{
+		size_t nd_item = cubes[0].n_elem;
+		jni_parallel_for(cubes.size(), [&](size_t idx_begin, size_t idx_end)
+		{
+			for (size_t n = idx_begin; n < idx_end; n++)
+				std::transform(cubes[n].memptr(), cubes[n].memptr() + nd_item, ptrs[n],
+					[](T_arma v) { return static_cast<double>(v); });
+		}, nthreads);
+
+		release_Matkc_arrays(arrs, ptrs, pins);
+		return arr_out;
+	}
 
 private:
 
 	JNIEnv* env;
-	jclass cls;
-	jobject obj;
-	std::string str_class_sig;
-	std::string str_classname;
-	
-public:
 
-	// constructor given a fully-specified class name
-	// e.g. KKH/StdLib/Matkc
-	// does not create the object. Can use JavaClass.construct_new()
-	// to create the object.
-	JavaClass(JNIEnv* env_, std::string str_classname_)
+	template<class T_cv>
+	bool check_cvMats(const std::vector<cv::Mat> &mats, int &H, int &W, int &C)
 	{
-		env = env_;	
-		str_classname = str_classname_;
-		
-		// if str_classname already includes "L...;" set it to str_class_sig and remove it
-		// for storing in str_classname.
-		// Otherwise, str_classname will remain as it is and str_class_sig will be
-		// str_classname with "L" and ";" added to the beginning and end of it respectively
-		// Actually just to note that this is not really necessary as FindClass and others
-		// work work on either with "L...;" or without it. But the code below is just to 
-		// keep things consistent.
-		if (str_classname.find("L") == 0 && str_classname.find(";") == str_classname.size() - 1)
+		jni_utils ju(env);
+		if (mats.empty())
 		{
-			str_class_sig = str_classname;
-			str_classname = str_classname.substr(1, str_classname.size() - 2);
+			ju.throw_exception("ERROR from JNI: empty batch of opencv matrices.");
+			return false;
 		}
-		else
+		H = mats[0].rows; W = mats[0].cols; C = mats[0].channels();
+		for (size_t n = 0; n < mats.size(); n++)
 		{
-			str_class_sig = "L" + str_classname + ";";
+			if (mats[n].dims != 2 || mats[n].rows != H || mats[n].cols != W || mats[n].channels() != C)
+			{
+				ju.throw_exception("ERROR from JNI: all the opencv matrices of a batch must be 2D with the same size and number of channels.");
+				return false;
+			}
+			if (mats[n].depth() != cv::DataType<T_cv>::depth)
+			{
+				ju.throw_exception("ERROR from JNI: opencv matrix element type does not match the template parameter.");
+				return false;
+			}
 		}
-		
-		cls = env->FindClass(str_classname.c_str());
+		return true;
+	}
+
+	// create Matkc[] of n matrices of nrows x ncols x nchannels and pin the data of each one
+	// (accounted in jPinRegistry by pins). The Matkc class, constructor and data field are
+	// looked up only once for the whole batch.
+	jobjectArray new_Matkc_array(size_t n, int nrows, int ncols, int nchannels, std::vector<jdoubleArray> &arrs, std::vector<jdouble*> &ptrs, std::vector<jPinRegistry::pin> &pins)
+	{
+		arrs.clear();
+		ptrs.clear();
+		pins.clear();
+		if (!check_java_length(n)) return nullptr;
+		jclass cls = env->FindClass("KKH/StdLib/Matkc");
+		if (cls == nullptr) return nullptr; // NoClassDefFoundError pending
+		jmethodID constructor_methodID = env->GetMethodID(cls, "<init>", "(III)V");
+		jfieldID fieldID_data = constructor_methodID == nullptr ? nullptr : env->GetFieldID(cls, "data", "[D");
+		jobjectArray arr_out = fieldID_data == nullptr ? nullptr : env->NewObjectArray(static_cast<jsize>(n), cls, nullptr);
+		if (arr_out == nullptr || env->EnsureLocalCapacity(static_cast<jint>(n + 4)) != 0)
+		{
+			env->DeleteLocalRef(arr_out);
+			env->DeleteLocalRef(cls);
+			return nullptr;
+		}
+
+		// stops at the first failure (a java exception is then pending)
+		arrs.reserve(n);
+		ptrs.reserve(n);
+		pins.reserve(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			jobject obj = env->NewObject(cls, constructor_methodID, nrows, ncols, nchannels);
+			if (obj == nullptr) break;
+			env->SetObjectArrayElement(arr_out, static_cast<jsize>(i), obj);
+			jdoubleArray data = (jdoubleArray)env->GetObjectField(obj, fieldID_data);
+			env->DeleteLocalRef(obj);
+			jdouble* ptr = data == nullptr ? nullptr : env->GetDoubleArrayElements(data, 0);
+			if (ptr == nullptr)
+			{
+				env->DeleteLocalRef(data);
+				if (!env->ExceptionCheck())
+				{
+					jni_utils ju(env);
+					ju.throw_exception("ERROR from JNI: the data of a new Matkc is null.");
+				}
+				break;
+			}
+			arrs.push_back(data);
+			ptrs.push_back(ptr);
+			pins.push_back(jPinRegistry::pin(static_cast<size_t>(nrows) * ncols * nchannels * sizeof(jdouble), false));
+		}
+		env->DeleteLocalRef(cls);
+
+		if (ptrs.size() < n)
+		{
+			release_Matkc_arrays(arrs, ptrs, pins);
+			env->DeleteLocalRef(arr_out);
+			return nullptr;
+		}
+		return arr_out;
 	}
-	
-	// wraps an existing java object.
-	// automatically computes the class signature, etc.
-	JavaClass(JNIEnv* env_, jobject obj_)
+
+	// java arrays are limited to 2^31 - 1 elements
+	bool check_java_length(size_t nd)
 	{
-		env = env_;
-		obj = obj_;
-		cls = env->GetObjectClass(obj);
+		if (nd <= 0x7FFFFFFFULL) return true;
 		jni_utils ju(env);
-		str_class_sig = ju.get_signature_jobject(obj);
-		str_classname = ju.get_signature_jobject(obj, true);
+		ju.throw_exception("ERROR from JNI: the batch has more elements than a java array can hold.");
+		return false;
 	}
-	
-	std::string get_classname()
+
+	void release_Matkc_arrays(std::vector<jdoubleArray> &arrs, std::vector<jdouble*> &ptrs, std::vector<jPinRegistry::pin> &pins)
 	{
-		return str_classname;
+		for (size_t i = 0; i < arrs.size(); i++)
+		{
+			env->ReleaseDoubleArrayElements(arrs[i], ptrs[i], 0);
+			pins[i].release();
+			env->DeleteLocalRef(arrs[i]);
+		}
+		arrs.clear();
+		ptrs.clear();
+		pins.clear();
 	}
+};
 
-	std::string get_class_sig()
+
+
+// registry of the native methods of a library and of the classes, fields and methods
+// it uses, so that they are all bound and resolved once when the library is loaded
+// instead of on the first calls (lazy symbol lookup, FindClass, Get*ID).
+// Declare everything at namespace scope (static initialization runs before JNI_OnLoad)
+// and let JNI_DEFINE_ONLOAD generate JNI_OnLoad/JNI_OnUnload, e.g.:
+//
+//	JNI_NATIVE("com/x/Detector", "detect", "([DII)[D", &detect);
+//	JNI_NATIVE("com/x/Detector", "version", &version); // signature derived from the function type
+//	static jNativeRegistry::method_ref& mID_onEvent = jNativeRegistry::instance().add_method("com/x/Listener", "onEvent", "(I)V");
+//	JNI_DEFINE_ONLOAD(jNativeRegistry::resolve_eager)
+//	...
+//	env->CallVoidMethod(listener, mID_onEvent.get(env), 3);
+//
+// In eager mode every declared class, field and method is resolved in JNI_OnLoad, so a
+// missing member fails System.loadLibrary (with the pending NoSuch*Error) rather than
+// the first request. In lazy mode only the classes that have natives are looked up, and
+// the rest is resolved on first get(). Note that FindClass on a thread attached from
+// native code only sees the system class loader, so lazy classes should be first used
+// from java threads.
+class jNativeRegistry
+{
+public:
+
+	enum resolve_mode { resolve_eager, resolve_lazy };
+
+	class class_ref
 	{
-		return str_class_sig;
-	}
+	public:
+		class_ref(const std::string& classname_) : classname(classname_), cls(nullptr) {}
 
-	jobject get_obj()
+		// global ref of the class
+		jclass get(JNIEnv* env)
+		{
+			jclass c = cls.load(std::memory_order_acquire);
+			return c != nullptr ? c : jNativeRegistry::instance().resolve_class(env, *this);
+		}
+
+		const std::string& name() const { return classname; }
+
+	private:
+		friend class jNativeRegistry;
+		std::string classname;
+		std::atomic<jclass> cls;
+	};
+
+	// T_id is either jfieldID or jmethodID
+	template<class T_id>
+	class member_ref
 	{
-		return obj;
-	}
+	public:
+		member_ref(class_ref* owner_, const std::string& name_, const std::string& sig_, bool is_static_)
+			: owner(owner_), name(name_), sig(sig_), is_static(is_static_), id(nullptr) {}
 
-	// creates a new object. This is normally used after constructing this class
-	// with JavaClass(JNIEnv* env_, std::string str_classname_) which did not result in
-	// a java object (just class info such as signature is stored).
-	// types_args can be jint, jfloat, jdouble, jshort, jchar, jlong, jbyte and jstring
-	// jintArray, jdoubleArray, jfloatArray, jshortArray, jcharArray, jlongArray, jbyteArray
-	// it can also be jobject
-	template<typename... types_args>
-	void construct_new(types_args... args)
+		T_id get(JNIEnv* env)
+		{
+			T_id i = id.load(std::memory_order_acquire);
+			return i != nullptr ? i : jNativeRegistry::instance().resolve_member(env, *this);
+		}
+
+		jclass get_class(JNIEnv* env) { return owner->get(env); }
+
+	private:
+		friend class jNativeRegistry;
+		class_ref* owner;
+		std::string name, sig;
+		bool is_static;
+		std::atomic<T_id> id;
+	};
+
+	typedef member_ref<jfieldID> field_ref;
+	typedef member_ref<jmethodID> method_ref;
+
+	struct timing
+	{
+		std::string what;
+		double ms;
+	};
+
+	static jNativeRegistry& instance()
+	{
+		static jNativeRegistry r;
+		return r;
+	}
+
+	// classname with '/' as separator, e.g. com/x/Detector
+	class_ref& add_class(const std::string& classname)
 	{
-		jni_utils ju(env);
-		std::string sig_method = ju.get_signature_jmethod<void, types_args...>("", args...);
+		std::lock_guard<std::mutex> lock(mtx);
+		return find_or_add_class(classname);
+	}
 
-		// call constructor to create jobject
-		jmethodID mID = env->GetMethodID(cls, "<init>", sig_method.c_str());
-		obj = env->NewObject(cls, mID, args...);	
+	field_ref& add_field(const std::string& classname, const std::string& name, const std::string& sig, bool is_static = false)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		fields.emplace_back(&find_or_add_class(classname), name, sig, is_static);
+		return fields.back();
 	}
 
-	// get a data member (i.e. field) from the object of this class.
-	// T can be jint, jfloat, ..., jintArray, jdoubleArray, ..., jstring
-	// T can also be jobject. If so, signature_field_if_T_is_jobject should be set
-	// to a valid signature string. If I have a jobject created before, I can use
-	// jni_utils.get_signature_jobject<jobject>(jobject obj) to automatically
-	// get the string signature.
-	// if T is not jobject, then signature_field_if_T_is_jobject is not used
-	// not therefore can be set to any (garbage) value such as "".
-	template<class T>
-	T get_field(std::string name_field, std::string signature_field_if_T_is_jobject, bool is_static_field = false)
+	method_ref& add_method(const std::string& classname, const std::string& name, const std::string& sig, bool is_static = false)
 	{
-		jni_utils ju(env);
-		std::string sig_field = get_signature_jtype<T>(signature_field_if_T_is_jobject);
-		jfieldID fieldID;
+		std::lock_guard<std::mutex> lock(mtx);
+		methods.emplace_back(&find_or_add_class(classname), name, sig, is_static);
+		return methods.back();
+	}
 
-		if (is_static_field)
+	// returns bool so that it can initialize a static variable (see JNI_NATIVE)
+	bool add_native(const std::string& classname, const std::string& name, const std::string& sig, void* fnPtr)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		native_method m;
+		m.owner = &find_or_add_class(classname);
+		m.name = name;
+		m.sig = sig;
+		m.fnPtr = fnPtr;
+		natives.push_back(m);
+		return true;
+	}
+
+	// the signature is derived from the function type. Arguments or a return value of
+	// type jobject carry no class name, so those natives need the explicit signature.
+	template<class T_return, class T_this, class... types_args>
+	bool add_native(const std::string& classname, const std::string& name, T_return (JNICALL *fn)(JNIEnv*, T_this, types_args...))
+	{
+		std::string sigs_args[] = { std::string(), get_signature_jtype<types_args>("")... };
+		std::string sig = "(";
+		bool ok = true;
+		for (size_t i = 1; i < sizeof(sigs_args) / sizeof(sigs_args[0]); i++)
 		{
-			fieldID = env->GetStaticFieldID(cls, name_field.c_str(), sig_field.c_str());
-			GetStaticFieldFunctor<T> ff;
-			return ff(env, cls, fieldID);
+			ok = ok && !sigs_args[i].empty();
+			sig += sigs_args[i];
 		}
-	 
-		fieldID = env->GetFieldID(cls, name_field.c_str(), sig_field.c_str());
-		GetFieldFunctor<T> ff;
-		return ff(env, obj, fieldID);		
+		std::string sig_return = get_signature_jtype<T_return>("");
+		sig += ")" + sig_return;
+		if (!ok || sig_return.empty())
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			errors.push_back("cannot derive the signature of native " + classname + "." + name + " (jobject in its type), give it explicitly");
+			return false;
+		}
+		return add_native(classname, name, sig, reinterpret_cast<void*>(fn));
 	}
-				
-	// set a data member (i.e. field) from the object of this class.
-	// T can be jint, jfloat, ..., jintArray, jdoubleArray, ..., jstring
-	// T can also be jobject. 
-	template<class T>
-	void set_field(std::string name_field, T val, bool is_static_field = false)
+
+	// called from JNI_OnLoad: registers all the natives and resolves (eagerly) the rest
+	jint on_load(JavaVM* vm_, resolve_mode mode_ = resolve_eager, jint version = JNI_VERSION_1_6)
 	{
-		jni_utils ju(env);
-		std::string sig_field;
-		if (std::is_same<T, jobject>::value)
-			sig_field = get_signature_jobject(val);
-		else
-			sig_field = get_signature_jtype<T>("");
+		JNIEnv* env = nullptr;
+		if (vm_->GetEnv(reinterpret_cast<void**>(&env), version) != JNI_OK)
+			return JNI_ERR;
 
-		jfieldID fieldID;
-		
-		if (is_static_field)
+		std::lock_guard<std::mutex> lock(mtx);
+		vm = vm_;
+		mode = mode_;
+		timings.clear();
+		std::chrono::steady_clock::time_point t_start = std::chrono::steady_clock::now();
+
+		if (!errors.empty())
 		{
-			fieldID = env->GetStaticFieldID(cls, name_field.c_str(), sig_field);
-			SetStaticFieldFunctor<T> ff;
-			ff(env, cls, fieldID, val);
-			return;
+			jni_utils ju(env);
+			ju.throw_exception("ERROR from JNI: " + errors[0]);
+			return JNI_ERR;
 		}
 
-		fieldID = env->GetFieldID(cls, name_field.c_str(), sig_field);
-		SetFieldFunctor<T> ff;
-		ff(env, obj, fieldID, val);		
-	}
-	
-	// call a non-static or static member function of this class/object.
-	// types_args can be jint, jfloat, jdouble, jshort, jchar, jlong, jbyte and jstring
-	// jintArray, jdoubleArray, jfloatArray, jshortArray, jcharArray, jlongArray, jbyteArray
-	// it can also be jobject. 
-	// type_returnVal can be any of the above and also "void".
-	// If type_returnVal is jobject, signature_return_type_if_type_returnVal_is_jobject should be set
-	// to a valid signature string. If I have a jobject created before, I can use
-	// jni_utils.get_signature_jobject<jobject>(jobject obj) to automatically
-	// get the string signature. Apart from case of type_returnVal being jobject, the signatures of all other types
-	// are generated automatically, including if there is a jobject in the input arguments.
-	template<typename type_returnVal, typename... types_inputArgs>
-	type_returnVal call_method(std::string methodName, std::string signature_return_type_if_type_returnVal_is_jobject, bool is_static_method, types_inputArgs... inputArgs)
-	{
-		jni_utils ju(env);
-
-		if (methodName == "") methodName = "<init>"; // assume that it is constructor
-		
-		std::string sig_method = ju.get_signature_jmethod<type_returnVal, types_inputArgs...>(signature_return_type_if_type_returnVal_is_jobject, inputArgs...);
+		// one RegisterNatives call per class
+		std::map<class_ref*, std::vector<JNINativeMethod> > natives_by_class;
+		for (size_t i = 0; i < natives.size(); i++)
+		{
+			JNINativeMethod m;
+			m.name = const_cast<char*>(natives[i].name.c_str());
+			m.signature = const_cast<char*>(natives[i].sig.c_str());
+			m.fnPtr = natives[i].fnPtr;
+			natives_by_class[natives[i].owner].push_back(m);
+		}
 
-		std::cout << "sig_method = " << sig_method << std::endl;
+		for (std::deque<class_ref>::iterator it = classes.begin(); it != classes.end(); ++it)
+		{
+			std::map<class_ref*, std::vector<JNINativeMethod> >::iterator it_natives = natives_by_class.find(&*it);
+			if (mode == resolve_lazy && it_natives == natives_by_class.end())
+				continue;
+			jclass cls = it->cls.load(std::memory_order_acquire);
+			if (cls == nullptr && (cls = resolve_class(env, *it)) == nullptr)
+				return JNI_ERR;
+			if (it_natives == natives_by_class.end())
+				continue;
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			if (env->RegisterNatives(cls, it_natives->second.data(), static_cast<jint>(it_natives->second.size())) != JNI_OK)
+				return JNI_ERR;
+			add_timing("RegisterNatives " + it->classname + " (" + std::to_string(it_natives->second.size()) + " methods)", t0);
+		}
 
-		jmethodID mID;
-		if (is_static_method)
+		if (mode == resolve_eager)
 		{
-			mID = env->GetStaticMethodID(cls, methodName.c_str(), sig_method.c_str());
-			callXStaticMethodFunctor<type_returnVal, types_args...> ff;
-			if (std::is_same<type_returnVal, void>::value)
-				ff(env, cls, mID, args...);
-			else
-				return ff(env, cls, mID, args...);
+			for (std::deque<field_ref>::iterator it = fields.begin(); it != fields.end(); ++it)
+				if (it->id.load(std::memory_order_acquire) == nullptr && resolve_member(env, *it) == nullptr)
+					return JNI_ERR;
+			for (std::deque<method_ref>::iterator it = methods.begin(); it != methods.end(); ++it)
+				if (it->id.load(std::memory_order_acquire) == nullptr && resolve_member(env, *it) == nullptr)
+					return JNI_ERR;
 		}
-			
-		else
+
+		ms_on_load = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+		if (verbose) print_report_unlocked();
+		return version;
+	}
+
+	// called from JNI_OnUnload
+	void on_unload(JavaVM* vm_, jint version = JNI_VERSION_1_6)
+	{
+		JNIEnv* env = nullptr;
+		if (vm_->GetEnv(reinterpret_cast<void**>(&env), version) != JNI_OK)
+			return;
+		std::lock_guard<std::mutex> lock(mtx);
+		for (std::deque<field_ref>::iterator it = fields.begin(); it != fields.end(); ++it)
+			it->id.store(nullptr, std::memory_order_release);
+		for (std::deque<method_ref>::iterator it = methods.begin(); it != methods.end(); ++it)
+			it->id.store(nullptr, std::memory_order_release);
+		for (std::deque<class_ref>::iterator it = classes.begin(); it != classes.end(); ++it)
 		{
-			mID = env->GetMethodID(cls, methodName.c_str(), sig_method.c_str());
-			callXMethodFunctor<type_returnVal, types_args...> ff;
-			if (std::is_same<type_returnVal, void>::value)
-				ff(env, obj, mID, args...);
-			else
-				return ff(env, obj, mID, args...);
-		}			
+			jclass cls = it->cls.exchange(nullptr);
+			if (cls != nullptr) env->DeleteGlobalRef(cls);
+		}
+		jClassNameCache::instance().clear(env);
+		vm = nullptr;
 	}
 
-};
+	// print the warm-up timings on stdout at the end of on_load
+	void set_verbose(bool verbose_) { verbose = verbose_; }
 
-// class to easily and directly manipulate java arrays
-// can also use to create a new java array or wrap an existing one.
-// T_arr should be of type jdoubleArray, jintArray, etc.
-// T should be the correponding primitive type:
-// if T_arr is jdoubleArray, T should be jdouble, etc.
-template<class T_arr, class T>
-class jArray
-{
+	resolve_mode get_mode() const { return mode; }
 
-private:
+	// time spent in on_load
+	double get_ms_on_load() const { return ms_on_load; }
 
-T_arr arr;
-T* ptr_data;
-JNIEnv* env;
-int nr, nc, nch, nd, ndpch;
-bool colMajor;
-bool currently_holding_data;
+	// every FindClass, RegisterNatives and Get*ID, whether done in on_load or lazily
+	std::vector<timing> get_timings()
+	{
+		std::lock_guard<std::mutex> lock(mtx_timings);
+		return timings;
+	}
 
-template<class T2> void ReleaseArrayElements() {};
-template<> void ReleaseArrayElements<jdoubleArray>() {env->ReleaseDoubleArrayElements(arr, ptr_data, 0);}	
-template<> void ReleaseArrayElements<jfloatArray>() { env->ReleaseFloatArrayElements(arr, ptr_data, 0); }
-template<> void ReleaseArrayElements<jintArray>() { env->ReleaseIntArrayElements(arr, ptr_data, 0); }
-template<> void ReleaseArrayElements<jshortArray>() { env->ReleaseShortArrayElements(arr, ptr_data, 0); }
-template<> void ReleaseArrayElements<jcharArray>() { env->ReleaseCharArrayElements(arr, ptr_data, 0); }
-template<> void ReleaseArrayElements<jlongArray>() { env->ReleaseLongArrayElements(arr, ptr_data, 0); }
-template<> void ReleaseArrayElements<jbyteArray>() { env->ReleaseByteArrayElements(arr, ptr_data, 0); }
-
-template<class T2> void GetArrayElements() {};
-template<> void GetArrayElements<jdoubleArray>() { ptr_data = env->GetDoubleArrayElements(arr, 0); }
-template<> void GetArrayElements<jfloatArray>() { ptr_data = env->GetFloatArrayElements(arr, 0); }
-template<> void GetArrayElements<jintArray>() { ptr_data = env->GetIntArrayElements(arr, 0); }
-template<> void GetArrayElements<jshortArray>() { ptr_data = env->GetShortArrayElements(arr, 0); }
-template<> void GetArrayElements<jcharArray>() { ptr_data = env->GetCharArrayElements(arr, 0); }
-template<> void GetArrayElements<jlongArray>() { ptr_data = env->GetLongArrayElements(arr, 0); }
-template<> void GetArrayElements<jbyteArray>() { ptr_data = env->GetByteArrayElements(arr, 0); }
-
-template<class T2> void NewArray(int size) {};
-template<> void NewArray<jdoubleArray>(int size) { arr = env->NewDoubleArray(size); }
-template<> void NewArray<jfloatArray>(int size) { arr = env->NewFloatArray(size); }
-template<> void NewArray<jintArray>(int size) { arr = env->NewIntArray(size); }
-template<> void NewArray<jshortArray>(int size) { arr = env->NewShortArray(size); }
-template<> void NewArray<jcharArray>(int size) { arr = env->NewCharArray(size); }
-template<> void NewArray<jlongArray>(int size) { arr = env->NewLongArray(size); }
-template<> void NewArray<jbyteArray>(int size) { arr = env->NewByteArray(size); }
+	void print_report()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		print_report_unlocked();
+	}
 
-// release an existing array elements so that JVM can move it
-// or garbage collect it whenever it wants.
-void release_existing_array()
-{
-	if (currently_holding_data)
-		ReleaseArrayElements<T_arr>();
-}
+private:
 
-void set_pointer_to_array_elements()
-{
-	GetArrayElements<T_arr>();
-}
+	struct native_method
+	{
+		class_ref* owner;
+		std::string name, sig;
+		void* fnPtr;
+	};
+
+	// deques so that the references handed out stay valid
+	std::deque<class_ref> classes;
+	std::deque<field_ref> fields;
+	std::deque<method_ref> methods;
+	std::vector<native_method> natives;
+	std::vector<std::string> errors;
+	std::vector<timing> timings;
+
+	JavaVM* vm;
+	resolve_mode mode;
+	bool verbose;
+	double ms_on_load;
+	// mtx guards the declarations and on_load. Resolution itself does not take it (a
+	// static initializer run by FindClass may call natives that resolve something
+	// lazily); the class refs are published with compare-exchange instead.
+	std::mutex mtx, mtx_timings;
+
+	jNativeRegistry() : vm(nullptr), mode(resolve_eager), verbose(false), ms_on_load(0) {}
+	jNativeRegistry(const jNativeRegistry&) = delete;
+	jNativeRegistry& operator=(const jNativeRegistry&) = delete;
+
+	class_ref& find_or_add_class(const std::string& classname)
+	{
+		for (std::deque<class_ref>::iterator it = classes.begin(); it != classes.end(); ++it)
+			if (it->classname == classname) return *it;
+		classes.emplace_back(classname);
+		return classes.back();
+	}
+
+	jclass resolve_class(JNIEnv* env, class_ref& c)
+	{
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		jclass cls_local = env->FindClass(c.classname.c_str());
+		if (cls_local == nullptr) return nullptr;
+		jclass cls = static_cast<jclass>(env->NewGlobalRef(cls_local));
+		env->DeleteLocalRef(cls_local);
+		jclass expected = nullptr;
+		if (!c.cls.compare_exchange_strong(expected, cls, std::memory_order_acq_rel))
+		{
+			// another thread was first
+			env->DeleteGlobalRef(cls);
+			return expected;
+		}
+		add_timing("FindClass " + c.classname, t0);
+		return cls;
+	}
 
-void allocate(int size)
-{
-	NewArray<T_arr>(size);
-}
+	template<class T_id>
+	T_id resolve_member(JNIEnv* env, member_ref<T_id>& m)
+	{
+		jclass cls = m.owner->get(env);
+		if (cls == nullptr) return nullptr;
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		T_id id = get_id(env, cls, m.name, m.sig, m.is_static, static_cast<T_id*>(nullptr));
+		if (id == nullptr) return nullptr;
+		// the same ID whichever thread stores it
+		m.id.store(id, std::memory_order_release);
+		add_timing(std::string(std::is_same<T_id, jfieldID>::value ? "GetFieldID " : "GetMethodID ") + m.owner->classname + "." + m.name + " " + m.sig, t0);
+		return id;
+	}
 
-public:
+	static jfieldID get_id(JNIEnv* env, jclass cls, const std::string& name, const std::string& sig, bool is_static, jfieldID*)
+	{
+		return is_static ? env->GetStaticFieldID(cls, name.c_str(), sig.c_str()) : env->GetFieldID(cls, name.c_str(), sig.c_str());
+	}
 
-jArray() = delete;
+	static jmethodID get_id(JNIEnv* env, jclass cls, const std::string& name, const std::string& sig, bool is_static, jmethodID*)
+	{
+		return is_static ? env->GetStaticMethodID(cls, name.c_str(), sig.c_str()) : env->GetMethodID(cls, name.c_str(), sig.c_str());
+	}
 
-jArray(JNIEnv* env_)
-{
-	env = env_;
-	currently_holding_data = false;
-}
+	void add_timing(const std::string& what, std::chrono::steady_clock::time_point t0)
+	{
+		timing t;
+		t.what = what;
+		t.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		std::lock_guard<std::mutex> lock(mtx_timings);
+		timings.push_back(t);
+	}
 
-// wrap an existing java array
-void wrap(T_arr arr_)
+	void print_report_unlocked()
+	{
+		std::vector<timing> t = get_timings();
+		printf("jNativeRegistry warm-up (%s): #classes = %d, #natives = %d, #fields = %d, #methods = %d, on_load = %.3f ms\n",
+			mode == resolve_eager ? "eager" : "lazy", (int)classes.size(), (int)natives.size(), (int)fields.size(), (int)methods.size(), ms_on_load);
+		for (size_t i = 0; i < t.size(); i++)
+			printf("\t%8.3f ms  %s\n", t[i].ms, t[i].what.c_str());
+	}
+};
+
+// register a native method at namespace scope, with or without its signature:
+// JNI_NATIVE("com/x/Detector", "detect", "([DII)[D", &detect) or JNI_NATIVE("com/x/Detector", "version", &version)
+#define JNI_NATIVE_1(classname, name, fn) static const bool JNI_STRUCT_CONCAT(jni_native_registered_, __LINE__) = jNativeRegistry::instance().add_native(classname, name, fn)
+#define JNI_NATIVE_2(classname, name, sig, fn) static const bool JNI_STRUCT_CONCAT(jni_native_registered_, __LINE__) = jNativeRegistry::instance().add_native(classname, name, sig, reinterpret_cast<void*>(fn))
+#define JNI_NATIVE_SELECT(_1, _2, _3, _4, N, ...) N
+#define JNI_NATIVE(...) JNI_STRUCT_EXPAND(JNI_NATIVE_SELECT(__VA_ARGS__, JNI_NATIVE_2, JNI_NATIVE_1, unused, unused)(__VA_ARGS__))
+
+// define JNI_OnLoad and JNI_OnUnload of the library with the registry.
+// mode is jNativeRegistry::resolve_eager or jNativeRegistry::resolve_lazy
+#define JNI_DEFINE_ONLOAD(mode) \
+	extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*) { return jNativeRegistry::instance().on_load(vm, mode); } \
+	extern "C" JNIEXPORT void JNICALL JNI_OnUnload(JavaVM* vm, void*) { jNativeRegistry::instance().on_unload(vm); }
+
+
+// Kernels with a plain C ABI (raw pointers and lengths, no JNIEnv) that are exposed both
+// as JNI natives and as C symbols for downcalls from Java's Foreign Function & Memory API
+// (java.lang.foreign). A kernel is written once; its JNI entry point is generated from
+// its type by jDualEntry, so both entry points always have the same arguments:
+//
+//	JNI_FFM_KERNEL(jdouble, kk_dot, (const jdouble* a, const jdouble* b, jlong n)) { ... }
+//	JNI_KERNEL_NATIVE("com/x/Kernels", "dot", kk_dot);
+//
+// and on the java side either
+//
+//	static native double dot(double[] a, double[] b, long n);
+//
+// or, without any JNI transition (the FFM descriptor is jDualEntry<...>::ffm_descriptor()),
+//
+//	MethodHandle dot = Linker.nativeLinker().downcallHandle(SymbolLookup.loaderLookup().find("kk_dot").get(),
+//		FunctionDescriptor.of(JAVA_DOUBLE, ADDRESS, ADDRESS, JAVA_LONG), Linker.Option.critical(true));
+//
+// called on MemorySegments (off-heap, or heap arrays with critical(true) on JDK 22+).
+// In the JNI entry point, pointer arguments are java arrays of the pointed type, pinned
+// with Get/ReleasePrimitiveArrayCritical around the kernel (released with JNI_ABORT for
+// const pointers); the other arguments are passed through. Kernels must not call back
+// into the JVM. The lengths are not checked against the java arrays.
+
+// FFM value layout of a kernel argument
+template<class T> struct jFfmLayout { static const char* get() { return "ADDRESS"; } };
+template<> struct jFfmLayout<jint> { static const char* get() { return "JAVA_INT"; } };
+template<> struct jFfmLayout<jfloat> { static const char* get() { return "JAVA_FLOAT"; } };
+template<> struct jFfmLayout<jdouble> { static const char* get() { return "JAVA_DOUBLE"; } };
+template<> struct jFfmLayout<jshort> { static const char* get() { return "JAVA_SHORT"; } };
+template<> struct jFfmLayout<jchar> { static const char* get() { return "JAVA_CHAR"; } };
+template<> struct jFfmLayout<jlong> { static const char* get() { return "JAVA_LONG"; } };
+template<> struct jFfmLayout<jbyte> { static const char* get() { return "JAVA_BYTE"; } };
+template<> struct jFfmLayout<jboolean> { static const char* get() { return "JAVA_BOOLEAN"; } };
+
+// how a kernel argument arrives in the JNI entry point.
+// failed is set if an array cannot be pinned (OutOfMemoryError is pending), and the following
+// arrays are then not pinned at all.
+template<class T>
+struct jFfmArg
 {
-	release_existing_array();
-	arr = arr_;
-	nd = env->GetArrayLength(arr);
-	nr = nd; nc = nch = 1; ndpch = nr * nc;
-	colMajor = true;
-	set_pointer_to_array_elements();
-	currently_holding_data = true;
-}
+	typedef T jni_type;
+	T val;
+	static size_t get_nbytes(JNIEnv*, T) { return 0; }
+	jFfmArg(JNIEnv*, T val_, size_t, bool&) : val(val_) {}
+	T get() const { return val; }
+};
 
-// wrap an existing java array which can be interpreted as a matrix
-void wrap(T_arr arr_, int nrows, int ncols, int nchannels, bool colMajor_=true)
+template<class T>
+struct jFfmArg<T*>
 {
-	nd = env->GetArrayLength(arr_);
-	if (nrows * ncols * nchannels != nd)
+	typedef typename jType_to_jArrayType<T>::type jni_type;
+	JNIEnv* env;
+	jni_type arr;
+	T* ptr;
+	jPinRegistry::pin pinned;
+	// for jPinRegistry, called for all the arguments before any of them is pinned
+	static size_t get_nbytes(JNIEnv* env_, jni_type arr_)
 	{
-		jni_utils ju(env);
-		ju.throw_exception("ERROR from JNI: nrows * ncols * nchannels != length of array to be wrapped.");
-		return;
+		return arr_ == nullptr || !jPinRegistry::instance().is_enabled() ? 0 : env_->GetArrayLength(arr_) * sizeof(T);
 	}
-	release_existing_array();
-	arr = arr_;
-	nr = nrows; nc = ncols; nch = nchannels; ndpch = nr * nc;
-	colMajor = colMajor_;
-	set_pointer_to_array_elements();
-	currently_holding_data = true;
-}
+	jFfmArg(JNIEnv* env_, jni_type arr_, size_t nbytes, bool &failed) : env(env_), arr(arr_),
+		ptr(arr_ == nullptr || failed ? nullptr : static_cast<T*>(env_->GetPrimitiveArrayCritical(arr_, nullptr))),
+		pinned(ptr == nullptr ? jPinRegistry::pin() : jPinRegistry::pin(nbytes, true))
+	{
+		if (arr_ != nullptr && ptr == nullptr) failed = true;
+	}
+	jFfmArg(jFfmArg&& a) : env(a.env), arr(a.arr), ptr(a.ptr), pinned(std::move(a.pinned)) { a.ptr = nullptr; }
+	jFfmArg(const jFfmArg&) = delete;
+	~jFfmArg() { if (ptr != nullptr) env->ReleasePrimitiveArrayCritical(arr, ptr, 0); }
+	T* get() const { return ptr; }
+};
 
-// create new java array from given size
-void create_new(int size)
+template<class T>
+struct jFfmArg<const T*>
 {
-	release_existing_array();
-	allocate(size);
-	set_pointer_to_array_elements();
-	currently_holding_data = true;
-	nr = size; nc = 1; nch = 1; nd = size; ndpch = nr * nc;
-	colMajor = true;
-}
+	typedef typename jType_to_jArrayType<T>::type jni_type;
+	JNIEnv* env;
+	jni_type arr;
+	T* ptr;
+	jPinRegistry::pin pinned;
+	// for jPinRegistry, called for all the arguments before any of them is pinned
+	static size_t get_nbytes(JNIEnv* env_, jni_type arr_)
+	{
+		return arr_ == nullptr || !jPinRegistry::instance().is_enabled() ? 0 : env_->GetArrayLength(arr_) * sizeof(T);
+	}
+	jFfmArg(JNIEnv* env_, jni_type arr_, size_t nbytes, bool &failed) : env(env_), arr(arr_),
+		ptr(arr_ == nullptr || failed ? nullptr : static_cast<T*>(env_->GetPrimitiveArrayCritical(arr_, nullptr))),
+		pinned(ptr == nullptr ? jPinRegistry::pin() : jPinRegistry::pin(nbytes, true))
+	{
+		if (arr_ != nullptr && ptr == nullptr) failed = true;
+	}
+	jFfmArg(jFfmArg&& a) : env(a.env), arr(a.arr), ptr(a.ptr), pinned(std::move(a.pinned)) { a.ptr = nullptr; }
+	jFfmArg(const jFfmArg&) = delete;
+	// nothing to copy back
+	~jFfmArg() { if (ptr != nullptr) env->ReleasePrimitiveArrayCritical(arr, ptr, JNI_ABORT); }
+	const T* get() const { return ptr; }
+};
 
-// create new java array which can be interpreted as a matrix
-void create_new(int nrows, int ncols, int nchannels, bool colMajor_ = true)
-{
-	nr = nrows; nc = ncols; nch = nchannels;
-	nd = nr * nc * nch; 
-	ndpch = nr * nc;
-	release_existing_array();
-	allocate(nd);
-	set_pointer_to_array_elements();
-	currently_holding_data = true;	
-	colMajor = colMajor_;
-}
+// the JNI entry point of a kernel, e.g. &jDualEntry<decltype(kk_dot), kk_dot>::jni
+template<class T_sig, T_sig* kernel> struct jDualEntry;
 
-~jArray()
+template<class T_return, class... types_args, T_return (*kernel)(types_args...)>
+struct jDualEntry<T_return(types_args...), kernel>
 {
-	release_existing_array();
-}
+	// registered as a static native (JNI_KERNEL_NATIVE), its signature derived from this type
+	static T_return JNICALL jni(JNIEnv* env, jclass, typename jFfmArg<types_args>::jni_type... args)
+	{
+		return pin_and_call(env, typename jMakeIndexSeq<sizeof...(types_args)>::type(), args...);
+	}
 
-void set_val(T val, int idx)
-{
-	ptr_data[idx] = val;
-}
+	// arguments of the java FunctionDescriptor, e.g. of(JAVA_DOUBLE, ADDRESS, ADDRESS, JAVA_LONG)
+	static std::string ffm_descriptor()
+	{
+		std::string layouts[] = { std::string(), std::string(jFfmLayout<types_args>::get())... };
+		bool is_void = std::is_same<T_return, void>::value;
+		std::string s = is_void ? "ofVoid(" : std::string("of(") + jFfmLayout<T_return>::get();
+		for (size_t i = 1; i < sizeof(layouts) / sizeof(layouts[0]); i++)
+			s += (i == 1 && is_void ? "" : ", ") + layouts[i];
+		return s + ")";
+	}
 
-void set_val(T val, int i, int j, int k)
-{
-	if(colMajor)
-		ptr_data[k * nr * nc + j * nr + i] = val;
-	else
-		ptr_data[i * nch * nc + j * nch + k] = val;
-}
+private:
 
-// assume k=0 and nch = 1
-void set_val(T val, int i, int j)
-{
-	if (colMajor)
-		ptr_data[j * nr + i] = val;
-	else
-		ptr_data[i * nc + j] = val;
-}
+	template<size_t... Is>
+	static T_return pin_and_call(JNIEnv* env, jIndexSeq<Is...> is, typename jFfmArg<types_args>::jni_type... args)
+	{
+		// all the lengths first: no other JNI call may be made once the first array is pinned
+		size_t nbytes[] = { 0, jFfmArg<types_args>::get_nbytes(env, args)... };
+		bool failed = false;
+		std::tuple<jFfmArg<types_args>...> pinned{ jFfmArg<types_args>(env, args, nbytes[Is + 1], failed)... };
+		if (failed) return T_return(); // OutOfMemoryError is pending
+		return call(pinned, is);
+	}
 
-T get_val(int idx)
-{
-return ptr_data[idx];
-}
+	template<size_t... Is>
+	static T_return call(std::tuple<jFfmArg<types_args>...> &pinned, jIndexSeq<Is...>)
+	{
+		return kernel(std::get<Is>(pinned).get()...);
+	}
+};
 
-T get_val(int i, int j, int k)
-{
-	if(colMajor)
-		return ptr_data[k * nr * nc + j * nr + i];
-	else
-		return ptr_data[i * nch * nc + j * nch + k];
-}
+// define a kernel with a C ABI, exported as is for FFM downcalls (in one translation unit)
+#define JNI_FFM_KERNEL(ret, name, params) extern "C" JNIEXPORT ret name params
 
-// assume k=0 and nch = 1
-T get_val(int i, int j)
+// register the JNI entry point of a kernel as a static native method (see JNI_NATIVE)
+#define JNI_KERNEL_NATIVE(classname, name, kernel) static const bool JNI_STRUCT_CONCAT(jni_kernel_registered_, __LINE__) = jNativeRegistry::instance().add_native(classname, name, &jDualEntry<decltype(kernel), kernel>::jni)
+
+// the library's own kernels on raw data: element-wise arithmetic on Matkc data (nd doubles),
+// reductions, and the conversions between java element types and between the col major
+// planar (Matkc) and row major interleaved layouts.
+// JNI_KERNELS_EXPORT_FFM(prefix) exports them as prefix_add, prefix_axpy, ... for FFM and
+// jKernels::register_natives(classname) registers them as static natives add, axpy, ...
+struct jKernels
 {
-	if (colMajor)
-		return ptr_data[j * nr + i];
-	else
-		return ptr_data[i * nc + j];
-}
+	static void add(const jdouble* a, const jdouble* b, jdouble* out, jlong n) { for (jlong i = 0; i < n; i++) out[i] = a[i] + b[i]; }
+	static void sub(const jdouble* a, const jdouble* b, jdouble* out, jlong n) { for (jlong i = 0; i < n; i++) out[i] = a[i] - b[i]; }
+	static void mul(const jdouble* a, const jdouble* b, jdouble* out, jlong n) { for (jlong i = 0; i < n; i++) out[i] = a[i] * b[i]; }
+	static void div(const jdouble* a, const jdouble* b, jdouble* out, jlong n) { for (jlong i = 0; i < n; i++) out[i] = a[i] / b[i]; }
+	static void scale(const jdouble* a, jdouble s, jdouble* out, jlong n) { for (jlong i = 0; i < n; i++) out[i] = a[i] * s; }
+	// y = alpha * x + y
+	static void axpy(jdouble alpha, const jdouble* x, jdouble* y, jlong n) { for (jlong i = 0; i < n; i++) y[i] += alpha * x[i]; }
+
+	static jdouble dot(const jdouble* a, const jdouble* b, jlong n)
+	{
+		// 4 partial sums so that the adds do not wait on each other
+		jdouble s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		jlong i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			s0 += a[i] * b[i]; s1 += a[i + 1] * b[i + 1];
+			s2 += a[i + 2] * b[i + 2]; s3 += a[i + 3] * b[i + 3];
+		}
+		for (; i < n; i++) s0 += a[i] * b[i];
+		return (s0 + s1) + (s2 + s3);
+	}
+
+	static jdouble sum(const jdouble* a, jlong n)
+	{
+		jdouble s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		jlong i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			s0 += a[i]; s1 += a[i + 1]; s2 += a[i + 2]; s3 += a[i + 3];
+		}
+		for (; i < n; i++) s0 += a[i];
+		return (s0 + s1) + (s2 + s3);
+	}
+
+	static void double_to_float(const jdouble* in, jfloat* out, jlong n) { for (jlong i = 0; i < n; i++) out[i] = static_cast<jfloat>(in[i]); }
+	static void float_to_double(const jfloat* in, jdouble* out, jlong n) { for (jlong i = 0; i < n; i++) out[i] = in[i]; }
+	// bytes read as unsigned (e.g. 8 bit pixels), times s
+	static void bytes_to_double(const jbyte* in, jdouble* out, jlong n, jdouble s) { for (jlong i = 0; i < n; i++) out[i] = static_cast<unsigned char>(in[i]) * s; }
+
+	static void interleaved_to_planar(const jdouble* in, jdouble* out, jint nrows, jint ncols, jint nchannels) { jJagged::convert_layout(in, out, nrows, ncols, nchannels, true, 1); }
+	static void planar_to_interleaved(const jdouble* in, jdouble* out, jint nrows, jint ncols, jint nchannels) { jJagged::convert_layout(in, out, nrows, ncols, nchannels, false, 1); }
+
+	static bool register_natives(const std::string& classname)
+	{
+		jNativeRegistry& r = jNativeRegistry::instance();
+		return r.add_native(classname, "add", &jDualEntry<decltype(add), add>::jni)
+			&& r.add_native(classname, "sub", &jDualEntry<decltype(sub), sub>::jni)
+			&& r.add_native(classname, "mul", &jDualEntry<decltype(mul), mul>::jni)
+			&& r.add_native(classname, "div", &jDualEntry<decltype(div), div>::jni)
+			&& r.add_native(classname, "scale", &jDualEntry<decltype(scale), scale>::jni)
+			&& r.add_native(classname, "axpy", &jDualEntry<decltype(axpy), axpy>::jni)
+			&& r.add_native(classname, "dot", &jDualEntry<decltype(dot), dot>::jni)
+			&& r.add_native(classname, "sum", &jDualEntry<decltype(sum), sum>::jni)
+			&& r.add_native(classname, "double_to_float", &jDualEntry<decltype(double_to_float), double_to_float>::jni)
+			&& r.add_native(classname, "float_to_double", &jDualEntry<decltype(float_to_double), float_to_double>::jni)
+			&& r.add_native(classname, "bytes_to_double", &jDualEntry<decltype(bytes_to_double), bytes_to_double>::jni)
+			&& r.add_native(classname, "interleaved_to_planar", &jDualEntry<decltype(interleaved_to_planar), interleaved_to_planar>::jni)
+			&& r.add_native(classname, "planar_to_interleaved", &jDualEntry<decltype(planar_to_interleaved), planar_to_interleaved>::jni);
+	}
 };
 
+#define JNI_KERNELS_EXPORT_FFM(prefix) \
+	JNI_FFM_KERNEL(void, prefix##_add, (const jdouble* a, const jdouble* b, jdouble* out, jlong n)) { jKernels::add(a, b, out, n); } \
+	JNI_FFM_KERNEL(void, prefix##_sub, (const jdouble* a, const jdouble* b, jdouble* out, jlong n)) { jKernels::sub(a, b, out, n); } \
+	JNI_FFM_KERNEL(void, prefix##_mul, (const jdouble* a, const jdouble* b, jdouble* out, jlong n)) { jKernels::mul(a, b, out, n); } \
+	JNI_FFM_KERNEL(void, prefix##_div, (const jdouble* a, const jdouble* b, jdouble* out, jlong n)) { jKernels::div(a, b, out, n); } \
+	JNI_FFM_KERNEL(void, prefix##_scale, (const jdouble* a, jdouble s, jdouble* out, jlong n)) { jKernels::scale(a, s, out, n); } \
+	JNI_FFM_KERNEL(void, prefix##_axpy, (jdouble alpha, const jdouble* x, jdouble* y, jlong n)) { jKernels::axpy(alpha, x, y, n); } \
+	JNI_FFM_KERNEL(jdouble, prefix##_dot, (const jdouble* a, const jdouble* b, jlong n)) { return jKernels::dot(a, b, n); } \
+	JNI_FFM_KERNEL(jdouble, prefix##_sum, (const jdouble* a, jlong n)) { return jKernels::sum(a, n); } \
+	JNI_FFM_KERNEL(void, prefix##_double_to_float, (const jdouble* in, jfloat* out, jlong n)) { jKernels::double_to_float(in, out, n); } \
+	JNI_FFM_KERNEL(void, prefix##_float_to_double, (const jfloat* in, jdouble* out, jlong n)) { jKernels::float_to_double(in, out, n); } \
+	JNI_FFM_KERNEL(void, prefix##_bytes_to_double, (const jbyte* in, jdouble* out, jlong n, jdouble s)) { jKernels::bytes_to_double(in, out, n, s); } \
+	JNI_FFM_KERNEL(void, prefix##_interleaved_to_planar, (const jdouble* in, jdouble* out, jint nrows, jint ncols, jint nchannels)) { jKernels::interleaved_to_planar(in, out, nrows, ncols, nchannels); } \
+	JNI_FFM_KERNEL(void, prefix##_planar_to_interleaved, (const jdouble* in, jdouble* out, jint nrows, jint ncols, jint nchannels)) { jKernels::planar_to_interleaved(in, out, nrows, ncols, nchannels); }
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+// Copyright (C) 2017 Kyaw Kyaw Htike @ Ali Abdul Ghafur. All rights reserved.
+
+// bench_jni_ffm: per-call cost of a small kernel called directly on raw pointers (what an
+// FFM downcall reaches) against its generated JNI entry point (jDualEntry), which pins and
+// releases the java arrays and goes through the JNIEnv, in an embedded JVM.
+// This measures the native side of the difference only; the java to native transition
+// itself (JNI frame against FFM downcall) needs a java harness such as JMH.
+//
+// usage: bench_jni_ffm [ncalls]
+
+#include <jni.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <opencv2/opencv.hpp>
+#include <armadillo>
+#if !defined(_MSC_VER)
+typedef long long _int64; // the header uses the MSVC name
+#endif
+#include "JNI_modern_tools.h"
+
+typedef jDualEntry<decltype(jKernels::dot), jKernels::dot> dot_entry;
+typedef jDualEntry<decltype(jKernels::axpy), jKernels::axpy> axpy_entry;
+
+int main(int argc, char** argv)
+{
+	long long ncalls = argc > 1 ? atoll(argv[1]) : 2000000;
+
+	JavaVM* vm = nullptr;
+	JNIEnv* env = nullptr;
+	JavaVMInitArgs vm_args;
+	vm_args.version = JNI_VERSION_1_8;
+	vm_args.nOptions = 0;
+	vm_args.options = nullptr;
+	vm_args.ignoreUnrecognized = JNI_TRUE;
+	if (JNI_CreateJavaVM(&vm, reinterpret_cast<void**>(&env), &vm_args) != JNI_OK)
+	{
+		fprintf(stderr, "cannot create the JVM\n");
+		return 1;
+	}
+
+	const jlong sizes[] = { 4, 64, 1024, 16384 };
+	printf("%8s %16s %16s %16s %16s\n", "n", "dot direct", "dot JNI entry", "axpy direct", "axpy JNI entry");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		jlong n = sizes[s];
+		long long ncalls_n = std::max(1000LL, ncalls * 4 / n);
+		jdoubleArray x = env->NewDoubleArray(static_cast<jsize>(n));
+		jdoubleArray y = env->NewDoubleArray(static_cast<jsize>(n));
+		std::vector<jdouble> px(n, 1.0), py(n, 2.0);
+		env->SetDoubleArrayRegion(x, 0, static_cast<jsize>(n), px.data());
+		env->SetDoubleArrayRegion(y, 0, static_cast<jsize>(n), py.data());
+
+		volatile jdouble sink = 0;
+		double ns[4];
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		for (long long i = 0; i < ncalls_n; i++) sink = sink + jKernels::dot(px.data(), py.data(), n);
+		std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+		for (long long i = 0; i < ncalls_n; i++) sink = sink + dot_entry::jni(env, nullptr, x, y, n);
+		std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+		for (long long i = 0; i < ncalls_n; i++) jKernels::axpy(1e-9, px.data(), py.data(), n);
+		std::chrono::steady_clock::time_point t3 = std::chrono::steady_clock::now();
+		for (long long i = 0; i < ncalls_n; i++) axpy_entry::jni(env, nullptr, 1e-9, x, y, n);
+		std::chrono::steady_clock::time_point t4 = std::chrono::steady_clock::now();
+		ns[0] = std::chrono::duration<double, std::nano>(t1 - t0).count() / ncalls_n;
+		ns[1] = std::chrono::duration<double, std::nano>(t2 - t1).count() / ncalls_n;
+		ns[2] = std::chrono::duration<double, std::nano>(t3 - t2).count() / ncalls_n;
+		ns[3] = std::chrono::duration<double, std::nano>(t4 - t3).count() / ncalls_n;
+		printf("%8lld %13.1f ns %13.1f ns %13.1f ns %13.1f ns\n", (long long)n, ns[0], ns[1], ns[2], ns[3]);
+
+		env->DeleteLocalRef(x);
+		env->DeleteLocalRef(y);
+	}
+
+	vm->DestroyJavaVM();
+	return 0;
+}
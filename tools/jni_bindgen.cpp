@@ -0,0 +1,611 @@
+// Copyright (C) 2017 Kyaw Kyaw Htike @ Ali Abdul Ghafur. All rights reserved.
+
+// jni_bindgen: offline generator of C++ bindings for java classes.
+// Reads compiled .class files (constant pool, fields and methods with their descriptors)
+// and writes one header-only C++ file with a wrapper class per java class:
+// - constexpr signatures of every field, method and native method
+// - the class (global ref) and all its field and method IDs resolved once, on first use
+//   or in warm_up(env) (e.g. called from JNI_OnLoad). A failed resolution (exception pending,
+//   and the wrappers then return zero / nullptr) is retried on the next use, e.g. from a
+//   thread that sees the class loader of the class
+// - typed getters/setters and methods with the JNI types of the descriptors, plus overloads
+//   taking the library's jArray (committed before the call) and Matkc for array and
+//   KKH/StdLib/Matkc arguments
+// - typed registration of the native methods with jNativeRegistry, so that a C++ function
+//   whose type does not match the java declaration is a compile error
+// Call sites then do no reflection and no string work, and regenerating the bindings after
+// a change on the java side turns interface drift into compile errors.
+//
+// usage: jni_bindgen [-o out.h] [--namespace ns] [--public-only] A.class [B.class ...]
+// The generated header includes JNI_modern_tools.h. Only the members declared by the class
+// itself are bound (not the inherited ones); synthetic and bridge members are skipped.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+
+// access flags of the class file format
+enum
+{
+	ACC_PUBLIC = 0x0001, ACC_PRIVATE = 0x0002, ACC_STATIC = 0x0008, ACC_FINAL = 0x0010,
+	ACC_BRIDGE = 0x0040, ACC_NATIVE = 0x0100, ACC_INTERFACE = 0x0200, ACC_ABSTRACT = 0x0400,
+	ACC_SYNTHETIC = 0x1000, ACC_MODULE = 0x8000
+};
+
+struct member_info
+{
+	int access_flags;
+	std::string name;
+	std::string descriptor;
+};
+
+struct class_info
+{
+	int access_flags;
+	std::string classname; // with '/' as separator, e.g. com/x/Detector
+	std::vector<member_info> fields;
+	std::vector<member_info> methods;
+};
+
+// minimal big endian reader of a .class file
+class class_file_reader
+{
+public:
+
+	class_file_reader(const std::string& fpath)
+	{
+		std::ifstream f(fpath.c_str(), std::ios::binary);
+		if (!f) throw std::runtime_error("cannot open " + fpath);
+		buf.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+		pos = 0;
+	}
+
+	class_info parse()
+	{
+		if (u4() != 0xCAFEBABE) throw std::runtime_error("not a class file");
+		u2(); u2(); // minor and major versions
+		read_constant_pool();
+
+		class_info c;
+		c.access_flags = u2();
+		c.classname = class_name(u2());
+		u2(); // super class
+		int ninterfaces = u2();
+		skip(2 * ninterfaces);
+		read_members(c.fields);
+		read_members(c.methods);
+		return c;
+	}
+
+private:
+
+	std::vector<unsigned char> buf;
+	size_t pos;
+	std::vector<int> tags;
+	std::vector<std::string> utf8s; // for CONSTANT_Utf8
+	std::vector<int> class_name_index; // for CONSTANT_Class
+
+	void need(size_t n)
+	{
+		if (pos + n > buf.size()) throw std::runtime_error("truncated class file");
+	}
+
+	int u1() { need(1); return buf[pos++]; }
+	int u2() { need(2); int v = (buf[pos] << 8) | buf[pos + 1]; pos += 2; return v; }
+	uint32_t u4() { need(4); uint32_t v = (uint32_t(buf[pos]) << 24) | (uint32_t(buf[pos + 1]) << 16) | (uint32_t(buf[pos + 2]) << 8) | buf[pos + 3]; pos += 4; return v; }
+	void skip(size_t n) { need(n); pos += n; }
+
+	void read_constant_pool()
+	{
+		int n = u2();
+		tags.assign(n, 0);
+		utf8s.assign(n, std::string());
+		class_name_index.assign(n, 0);
+		for (int i = 1; i < n; i++)
+		{
+			int tag = u1();
+			tags[i] = tag;
+			switch (tag)
+			{
+			case 1: // Utf8 (modified UTF-8, identical to UTF-8 for the usual names)
+			{
+				int len = u2();
+				need(len);
+				utf8s[i].assign(reinterpret_cast<const char*>(&buf[pos]), len);
+				pos += len;
+				break;
+			}
+			case 7: class_name_index[i] = u2(); break; // Class
+			case 8: case 16: case 19: case 20: skip(2); break; // String, MethodType, Module, Package
+			case 15: skip(3); break; // MethodHandle
+			case 3: case 4: case 9: case 10: case 11: case 12: case 17: case 18: skip(4); break;
+			case 5: case 6: skip(8); i++; break; // Long and Double take two entries
+			default:
+				throw std::runtime_error("unknown constant pool tag " + std::to_string(tag));
+			}
+		}
+	}
+
+	const std::string& utf8(int idx)
+	{
+		if (idx <= 0 || idx >= (int)tags.size() || tags[idx] != 1) throw std::runtime_error("bad constant pool index");
+		return utf8s[idx];
+	}
+
+	std::string class_name(int idx)
+	{
+		if (idx <= 0 || idx >= (int)tags.size() || tags[idx] != 7) throw std::runtime_error("bad constant pool index");
+		return utf8(class_name_index[idx]);
+	}
+
+	void skip_attributes()
+	{
+		int n = u2();
+		for (int i = 0; i < n; i++)
+		{
+			u2();
+			skip(u4());
+		}
+	}
+
+	void read_members(std::vector<member_info>& members)
+	{
+		int n = u2();
+		for (int i = 0; i < n; i++)
+		{
+			member_info m;
+			m.access_flags = u2();
+			m.name = utf8(u2());
+			m.descriptor = utf8(u2());
+			skip_attributes();
+			members.push_back(m);
+		}
+	}
+};
+
+// one java type of a descriptor and how it is handled in C++
+struct jtype
+{
+	std::string desc; // e.g. I, [D, Ljava/lang/String;
+	std::string cpp; // e.g. jint, jdoubleArray, jstring
+	std::string call; // X in CallXMethod / GetXField: Int, Double, Object, Void, ...
+	std::string lib; // library type to accept in the convenience overload, if any
+	std::string lib_arg; // expression giving the JNI value of the library argument (%s is the name)
+};
+
+jtype make_jtype(const std::string& desc)
+{
+	static const char* prims = "ZBCSIJFDV";
+	static const char* cpps[] = { "jboolean", "jbyte", "jchar", "jshort", "jint", "jlong", "jfloat", "jdouble", "void" };
+	static const char* calls[] = { "Boolean", "Byte", "Char", "Short", "Int", "Long", "Float", "Double", "Void" };
+	jtype t;
+	t.desc = desc;
+	if (desc.size() == 1)
+	{
+		const char* p = strchr(prims, desc[0]);
+		if (p == nullptr) throw std::runtime_error("bad descriptor " + desc);
+		t.cpp = cpps[p - prims];
+		t.call = calls[p - prims];
+		return t;
+	}
+	t.call = "Object";
+	if (desc.size() == 2 && desc[0] == '[' && desc[1] != 'V' && strchr(prims, desc[1]) != nullptr)
+	{
+		std::string elem = make_jtype(desc.substr(1)).cpp;
+		t.cpp = elem + "Array";
+		t.lib = "::jArray<" + t.cpp + ", " + elem + ", T_layout%d>&";
+		t.lib_arg = "(%s.commit(), %s.get_arr())";
+	}
+	else if (desc[0] == '[')
+		t.cpp = "jobjectArray";
+	else if (desc == "Ljava/lang/String;")
+		t.cpp = "jstring";
+	else if (desc == "Ljava/lang/Class;")
+		t.cpp = "jclass";
+	else if (desc == "Ljava/lang/Throwable;")
+		t.cpp = "jthrowable";
+	else if (desc == "LKKH/StdLib/Matkc;")
+	{
+		t.cpp = "jobject";
+		t.lib = "const ::Matkc&";
+		t.lib_arg = "%s.get_obj()";
+	}
+	else
+		t.cpp = "jobject";
+	return t;
+}
+
+// split a method descriptor such as (I[DLjava/lang/String;)V
+void parse_method_descriptor(const std::string& desc, std::vector<jtype>& args, jtype& ret)
+{
+	size_t i = 1;
+	if (desc.empty() || desc[0] != '(') throw std::runtime_error("bad method descriptor " + desc);
+	while (i < desc.size() && desc[i] != ')')
+	{
+		size_t j = i;
+		while (j < desc.size() && desc[j] == '[') j++;
+		if (j < desc.size() && desc[j] == 'L') j = desc.find(';', j);
+		if (j == std::string::npos || j >= desc.size()) throw std::runtime_error("bad method descriptor " + desc);
+		args.push_back(make_jtype(desc.substr(i, j - i + 1)));
+		i = j + 1;
+	}
+	if (i + 1 >= desc.size()) throw std::runtime_error("bad method descriptor " + desc);
+	ret = make_jtype(desc.substr(i + 1));
+}
+
+// java identifiers may contain '$' and may be C++ keywords
+std::string cpp_identifier(const std::string& name)
+{
+	static const std::set<std::string> keywords = {
+		"alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break", "case", "catch",
+		"char", "char16_t", "char32_t", "class", "compl", "const", "constexpr", "const_cast", "continue", "decltype",
+		"default", "delete", "do", "double", "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false",
+		"float", "for", "friend", "goto", "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept",
+		"not", "not_eq", "nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register",
+		"reinterpret_cast", "return", "short", "signed", "sizeof", "static", "static_assert", "static_cast", "struct",
+		"switch", "template", "this", "thread_local", "throw", "true", "try", "typedef", "typeid", "typename", "union",
+		"unsigned", "using", "virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq",
+		// names used by the generated wrappers
+		"env", "obj", "ids", "ids_type", "warm_up", "get_obj", "classname" };
+	std::string s = name;
+	for (size_t i = 0; i < s.size(); i++)
+		if (!isalnum(static_cast<unsigned char>(s[i])) && s[i] != '_') s[i] = '_';
+	if (keywords.count(s)) s += "_";
+	return s;
+}
+
+std::string c_string_literal(const std::string& s)
+{
+	std::string out = "\"";
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		unsigned char ch = static_cast<unsigned char>(s[i]);
+		if (ch == '"' || ch == '\\') { out += '\\'; out += s[i]; }
+		else if (ch < 0x20 || ch >= 0x7f) { char b[8]; snprintf(b, sizeof(b), "\\%03o", ch); out += b; }
+		else out += s[i];
+	}
+	return out + "\"";
+}
+
+std::string replace_all(std::string s, const std::string& from, const std::string& to)
+{
+	for (size_t p = s.find(from); p != std::string::npos; p = s.find(from, p + to.size()))
+		s.replace(p, from.size(), to);
+	return s;
+}
+
+// a bound method with the names used for it in the generated code
+struct method_binding
+{
+	member_info m;
+	std::vector<jtype> args;
+	jtype ret;
+	std::string id; // unique among the methods of the class: name, or name_k for overloads
+	std::string cpp_name; // name of the C++ function(s)
+};
+
+class binding_writer
+{
+public:
+
+	binding_writer(bool public_only_) : public_only(public_only_) {}
+
+	void write_class(std::ostream& os, const class_info& c)
+	{
+		std::vector<std::string> parts;
+		std::stringstream ss(c.classname);
+		for (std::string p; std::getline(ss, p, '/');) parts.push_back(p);
+		std::string wrapper = cpp_identifier(parts.back());
+		parts.pop_back();
+
+		std::vector<member_info> fields;
+		for (size_t i = 0; i < c.fields.size(); i++)
+			if (keep(c.fields[i])) fields.push_back(c.fields[i]);
+
+		std::vector<method_binding> methods, natives;
+		std::map<std::string, int> count_by_name, ordinal_by_name;
+		for (size_t i = 0; i < c.methods.size(); i++)
+			if (keep(c.methods[i]) && c.methods[i].name != "<clinit>") count_by_name[c.methods[i].name]++;
+		std::set<std::string> cpp_signatures; // name + C++ parameter types, to avoid duplicate overloads
+		for (size_t i = 0; i < fields.size(); i++)
+		{
+			bool is_static = (fields[i].access_flags & ACC_STATIC) != 0;
+			jtype t = make_jtype(fields[i].descriptor);
+			cpp_signatures.insert("get_" + cpp_identifier(fields[i].name) + (is_static ? "(JNIEnv*)" : "()"));
+			cpp_signatures.insert("set_" + cpp_identifier(fields[i].name) + (is_static ? "(JNIEnv*," : "(") + t.cpp + ")");
+		}
+		for (size_t i = 0; i < c.methods.size(); i++)
+		{
+			const member_info& m = c.methods[i];
+			if (!keep(m) || m.name == "<clinit>") continue;
+			method_binding b;
+			b.m = m;
+			parse_method_descriptor(m.descriptor, b.args, b.ret);
+			std::string base = m.name == "<init>" ? "init" : cpp_identifier(m.name);
+			b.id = count_by_name[m.name] == 1 ? base : base + "_" + std::to_string(ordinal_by_name[m.name]++);
+			if (m.access_flags & ACC_NATIVE)
+			{
+				b.cpp_name = "register_native_" + b.id;
+				natives.push_back(b);
+				continue;
+			}
+			if (m.name == "<init>" && (c.access_flags & (ACC_ABSTRACT | ACC_INTERFACE))) continue;
+			b.cpp_name = m.name == "<init>" ? "construct_new" : cpp_identifier(m.name);
+			if (b.cpp_name == wrapper) b.cpp_name += "_";
+			std::vector<std::string> key_types;
+			if (m.name == "<init>" || (m.access_flags & ACC_STATIC)) key_types.push_back("JNIEnv*");
+			for (size_t k = 0; k < b.args.size(); k++) key_types.push_back(b.args[k].cpp);
+			std::string key = "(";
+			for (size_t k = 0; k < key_types.size(); k++) key += (k == 0 ? "" : ",") + key_types[k];
+			key += ")";
+			for (int suffix = 1; cpp_signatures.count(b.cpp_name + key); suffix++)
+				b.cpp_name = (m.name == "<init>" ? "construct_new" : cpp_identifier(m.name) == wrapper ? wrapper + "_" : cpp_identifier(m.name)) + "_" + std::to_string(suffix);
+			cpp_signatures.insert(b.cpp_name + key);
+			methods.push_back(b);
+		}
+
+		for (size_t i = 0; i < parts.size(); i++) os << "namespace " << cpp_identifier(parts[i]) << " {\n";
+		if (!parts.empty()) os << "\n";
+
+		os << "// " << c.classname << "\n";
+		os << "class " << wrapper << "\n{\npublic:\n\n";
+		os << "\t" << wrapper << "(JNIEnv* env_, jobject obj_) : env(env_), obj(obj_) {}\n\n";
+		os << "\tjobject get_obj() const { return obj; }\n\n";
+		os << "\tstatic constexpr const char* classname() { return " << c_string_literal(c.classname) << "; }\n\n";
+		os << "\t// resolve the class and all the IDs now (e.g. in JNI_OnLoad) instead of on first use.\n";
+		os << "\t// returns false if the class or a member was not found (the exception is pending)\n";
+		os << "\tstatic bool warm_up(JNIEnv* env) { return ids(env) != nullptr; }\n";
+
+		if (!fields.empty()) os << "\n\t// fields\n";
+		for (size_t i = 0; i < fields.size(); i++)
+			write_field(os, fields[i]);
+
+		if (!methods.empty()) os << "\n\t// methods\n";
+		for (size_t i = 0; i < methods.size(); i++)
+			write_method(os, wrapper, methods[i]);
+
+		if (!natives.empty()) os << "\n\t// native methods: register_native_X(&fn) only compiles if fn has the type of the java declaration\n";
+		for (size_t i = 0; i < natives.size(); i++)
+			write_native(os, natives[i]);
+
+		os << "\nprivate:\n\n";
+		os << "\tJNIEnv* env;\n\tjobject obj;\n\n";
+		os << "\tstruct ids_type\n\t{\n\t\tjclass cls = nullptr;\n\t\tbool valid = false;\n";
+		for (size_t i = 0; i < fields.size(); i++)
+			os << "\t\tjfieldID fID_" << cpp_identifier(fields[i].name) << " = nullptr;\n";
+		for (size_t i = 0; i < methods.size(); i++)
+			os << "\t\tjmethodID mID_" << methods[i].id << " = nullptr;\n";
+		os << "\n\t\tids_type(JNIEnv* env)\n\t\t{\n";
+		os << "\t\t\tjclass cls_local = env->FindClass(classname());\n";
+		os << "\t\t\tif (cls_local == nullptr) return;\n";
+		os << "\t\t\tcls = static_cast<jclass>(env->NewGlobalRef(cls_local));\n";
+		os << "\t\t\tenv->DeleteLocalRef(cls_local);\n";
+		for (size_t i = 0; i < fields.size(); i++)
+		{
+			std::string n = cpp_identifier(fields[i].name);
+			bool is_static = (fields[i].access_flags & ACC_STATIC) != 0;
+			os << "\t\t\tif ((fID_" << n << " = env->Get" << (is_static ? "Static" : "") << "FieldID(cls, " << c_string_literal(fields[i].name) << ", sig_field_" << n << "())) == nullptr) return;\n";
+		}
+		for (size_t i = 0; i < methods.size(); i++)
+		{
+			bool is_static = (methods[i].m.access_flags & ACC_STATIC) != 0;
+			os << "\t\t\tif ((mID_" << methods[i].id << " = env->Get" << (is_static ? "Static" : "") << "MethodID(cls, " << c_string_literal(methods[i].m.name) << ", sig_" << methods[i].id << "())) == nullptr) return;\n";
+		}
+		os << "\t\t\tvalid = true;\n";
+		os << "\t\t}\n\n";
+		os << "\t\tvoid release(JNIEnv* env) { if (cls != nullptr) env->DeleteGlobalRef(cls); }\n";
+		os << "\t};\n\n";
+		os << "\t// nullptr if the resolution failed (the exception is pending); it is then retried on the next call\n";
+		os << "\tstatic const ids_type* ids(JNIEnv* env)\n\t{\n";
+		os << "\t\tstatic std::atomic<const ids_type*> resolved(nullptr);\n";
+		os << "\t\tconst ids_type* i = resolved.load(std::memory_order_acquire);\n";
+		os << "\t\tif (i != nullptr) return i;\n";
+		os << "\t\tids_type* r = new ids_type(env);\n";
+		os << "\t\tif (!r->valid)\n\t\t{\n\t\t\tr->release(env);\n\t\t\tdelete r;\n\t\t\treturn nullptr;\n\t\t}\n";
+		os << "\t\t// another thread may have resolved them meanwhile\n";
+		os << "\t\tif (!resolved.compare_exchange_strong(i, r, std::memory_order_acq_rel))\n\t\t{\n\t\t\tr->release(env);\n\t\t\tdelete r;\n\t\t\treturn i;\n\t\t}\n";
+		os << "\t\treturn r;\n\t}\n";
+		os << "};\n";
+
+		if (!parts.empty()) os << "\n";
+		for (size_t i = parts.size(); i > 0; i--) os << "} // namespace " << cpp_identifier(parts[i - 1]) << "\n";
+
+		std::string qualified;
+		for (size_t i = 0; i < parts.size(); i++) qualified += cpp_identifier(parts[i]) + "::";
+		warm_ups.push_back(qualified + wrapper);
+	}
+
+	// qualified names of the wrappers written so far
+	const std::vector<std::string>& get_wrappers() const { return warm_ups; }
+
+private:
+
+	bool public_only;
+	std::vector<std::string> warm_ups;
+
+	// native methods are kept whatever their access, as they have to be registered
+	bool keep(const member_info& m)
+	{
+		if (m.access_flags & (ACC_SYNTHETIC | ACC_BRIDGE)) return false;
+		if (public_only && !(m.access_flags & (ACC_PUBLIC | ACC_NATIVE))) return false;
+		return true;
+	}
+
+	void write_field(std::ostream& os, const member_info& f)
+	{
+		std::string n = cpp_identifier(f.name);
+		jtype t = make_jtype(f.descriptor);
+		bool is_static = (f.access_flags & ACC_STATIC) != 0;
+		std::string cast = t.call == "Object" && t.cpp != "jobject" ? "(" + t.cpp + ")" : "";
+		os << "\tstatic constexpr const char* sig_field_" << n << "() { return " << c_string_literal(f.descriptor) << "; }\n";
+		if (is_static)
+		{
+			os << "\tstatic " << t.cpp << " get_" << n << "(JNIEnv* env) { const ids_type* i = ids(env); if (i == nullptr) return " << t.cpp << "(); return " << cast << "env->GetStatic" << t.call << "Field(i->cls, i->fID_" << n << "); }\n";
+			if (!(f.access_flags & ACC_FINAL))
+				os << "\tstatic void set_" << n << "(JNIEnv* env, " << t.cpp << " val) { const ids_type* i = ids(env); if (i == nullptr) return; env->SetStatic" << t.call << "Field(i->cls, i->fID_" << n << ", val); }\n";
+		}
+		else
+		{
+			os << "\t" << t.cpp << " get_" << n << "() { const ids_type* i = ids(env); if (i == nullptr) return " << t.cpp << "(); return " << cast << "env->Get" << t.call << "Field(obj, i->fID_" << n << "); }\n";
+			if (!(f.access_flags & ACC_FINAL))
+				os << "\tvoid set_" << n << "(" << t.cpp << " val) { const ids_type* i = ids(env); if (i == nullptr) return; env->Set" << t.call << "Field(obj, i->fID_" << n << ", val); }\n";
+		}
+	}
+
+	void write_method(std::ostream& os, const std::string& wrapper, const method_binding& b)
+	{
+		os << "\tstatic constexpr const char* sig_" << b.id << "() { return " << c_string_literal(b.m.descriptor) << "; }\n";
+		write_method_overload(os, wrapper, b, false);
+		for (size_t k = 0; k < b.args.size(); k++)
+			if (!b.args[k].lib.empty())
+			{
+				write_method_overload(os, wrapper, b, true);
+				break;
+			}
+	}
+
+	// with_lib: array and Matkc arguments are taken as jArray and Matkc
+	void write_method_overload(std::ostream& os, const std::string& wrapper, const method_binding& b, bool with_lib)
+	{
+		bool is_ctor = b.m.name == "<init>";
+		bool is_static = is_ctor || (b.m.access_flags & ACC_STATIC) != 0;
+		std::string params, args, tparams;
+		if (is_static) params = "JNIEnv* env";
+		for (size_t k = 0; k < b.args.size(); k++)
+		{
+			std::string a = "a" + std::to_string(k);
+			if (!params.empty()) params += ", ";
+			if (with_lib && !b.args[k].lib.empty())
+			{
+				std::string lib = replace_all(b.args[k].lib, "%d", std::to_string(k));
+				if (lib.find("T_layout") != std::string::npos) tparams += std::string(tparams.empty() ? "" : ", ") + "class T_layout" + std::to_string(k);
+				params += lib + " " + a;
+				args += ", " + replace_all(b.args[k].lib_arg, "%s", a);
+			}
+			else
+			{
+				params += b.args[k].cpp + " " + a;
+				args += ", " + a;
+			}
+		}
+		os << "\t";
+		if (!tparams.empty()) os << "template<" << tparams << "> ";
+		if (is_ctor)
+		{
+			os << "static " << wrapper << " " << b.cpp_name << "(" << params << ") { const ids_type* i = ids(env); if (i == nullptr) return "
+				<< wrapper << "(env, nullptr); return " << wrapper << "(env, env->NewObject(i->cls, i->mID_" << b.id << args << ")); }\n";
+			return;
+		}
+		std::string cast = b.ret.call == "Object" && b.ret.cpp != "jobject" ? "(" + b.ret.cpp + ")" : "";
+		std::string ret = b.ret.call == "Void" ? "" : "return " + cast;
+		std::string check = "const ids_type* i = ids(env); if (i == nullptr) return" + std::string(b.ret.call == "Void" ? "" : " " + b.ret.cpp + "()") + "; ";
+		if (is_static)
+			os << "static " << b.ret.cpp << " " << b.cpp_name << "(" << params << ") { " << check << ret
+				<< "env->CallStatic" << b.ret.call << "Method(i->cls, i->mID_" << b.id << args << "); }\n";
+		else
+			os << b.ret.cpp << " " << b.cpp_name << "(" << params << ") { " << check << ret
+				<< "env->Call" << b.ret.call << "Method(obj, i->mID_" << b.id << args << "); }\n";
+	}
+
+	void write_native(std::ostream& os, const method_binding& b)
+	{
+		bool is_static = (b.m.access_flags & ACC_STATIC) != 0;
+		os << "\tstatic constexpr const char* sig_" << b.id << "() { return " << c_string_literal(b.m.descriptor) << "; }\n";
+		os << "\ttypedef " << b.ret.cpp << " (JNICALL *native_" << b.id << "_type)(JNIEnv*, " << (is_static ? "jclass" : "jobject");
+		for (size_t k = 0; k < b.args.size(); k++) os << ", " << b.args[k].cpp;
+		os << ");\n";
+		os << "\tstatic bool " << b.cpp_name << "(native_" << b.id << "_type fn) { return jNativeRegistry::instance().add_native(classname(), "
+			<< c_string_literal(b.m.name) << ", sig_" << b.id << "(), reinterpret_cast<void*>(fn)); }\n";
+	}
+};
+
+int main(int argc, char** argv)
+{
+	std::string fpath_out, ns;
+	bool public_only = false;
+	std::vector<std::string> fpaths;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		if (a == "-o" && i + 1 < argc) fpath_out = argv[++i];
+		else if (a == "--namespace" && i + 1 < argc) ns = argv[++i];
+		else if (a == "--public-only") public_only = true;
+		else if (!a.empty() && a[0] == '-')
+		{
+			fprintf(stderr, "unknown option %s\n", a.c_str());
+			return 1;
+		}
+		else fpaths.push_back(a);
+	}
+	if (fpaths.empty())
+	{
+		fprintf(stderr, "usage: jni_bindgen [-o out.h] [--namespace ns] [--public-only] A.class [B.class ...]\n");
+		return 1;
+	}
+
+	std::ostringstream os;
+	binding_writer writer(public_only);
+	try
+	{
+		for (size_t i = 0; i < fpaths.size(); i++)
+		{
+			class_info c = class_file_reader(fpaths[i]).parse();
+			if (c.access_flags & ACC_MODULE) continue;
+			writer.write_class(os, c);
+			os << "\n";
+		}
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "jni_bindgen: %s\n", e.what());
+		return 1;
+	}
+
+	std::string guard = "_JNI_BINDINGS_H_";
+	if (!fpath_out.empty())
+	{
+		std::string fname = fpath_out.substr(fpath_out.find_last_of("/\\") + 1);
+		guard = "_" + cpp_identifier(fname) + "_";
+		for (size_t i = 0; i < guard.size(); i++) guard[i] = toupper(static_cast<unsigned char>(guard[i]));
+	}
+
+	std::ostringstream out;
+	out << "// generated by jni_bindgen, do not edit\n\n";
+	out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+	out << "#include \"JNI_modern_tools.h\"\n\n";
+	if (!ns.empty()) out << "namespace " << ns << " {\n\n";
+	out << os.str();
+	out << "// resolve the classes and IDs of all the bindings above (e.g. in JNI_OnLoad).\n";
+	out << "// stops at the first failure and returns false (the exception is pending)\n";
+	out << "inline bool warm_up_bindings(JNIEnv* env)\n{\n";
+	for (size_t i = 0; i < writer.get_wrappers().size(); i++)
+		out << "\tif (!" << writer.get_wrappers()[i] << "::warm_up(env)) return false;\n";
+	out << "\treturn true;\n}\n\n";
+	if (!ns.empty()) out << "} // namespace " << ns << "\n\n";
+	out << "#endif\n";
+
+	if (fpath_out.empty())
+	{
+		std::cout << out.str();
+		return 0;
+	}
+	std::ofstream f(fpath_out.c_str());
+	f << out.str();
+	if (!f)
+	{
+		fprintf(stderr, "jni_bindgen: cannot write %s\n", fpath_out.c_str());
+		return 1;
+	}
+	return 0;
+}